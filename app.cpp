@@ -1,31 +1,296 @@
 #include "stego.h"
+#include "bitpack.h"
+#include "batch.h"
+#include "scan.h"
+#include "server.h"
+#include <chrono>
+#include <climits>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <new>
 #include <string>
+#include <vector>
+
+int parseProfile(const std::string& name) {
+    if (name == "fast") {
+        return PROFILE_FAST;
+    } else if (name == "balanced") {
+        return PROFILE_BALANCED;
+    } else if (name == "small") {
+        return PROFILE_SMALL;
+    } else if (name == "stored") {
+        return PROFILE_STORED;
+    }
+
+    throw StegoError("Unknown profile: " + name + " (use fast, balanced, small or stored)");
+}
+
+// Output size and wall time, so profiles can be compared on real images
+void reportEncode(const std::string& profileName, const char *outputFile, double seconds) {
+    std::cerr << "profile " << profileName << ": " << outputFile << " is "
+              << std::filesystem::file_size(outputFile) << " bytes, encoded in " << seconds << " s\n";
+}
+
+// One JSON line per command, appended to statsFile or written to stderr
+void reportStats(const std::string& command, const StegoStats& stats, const std::string& statsFile) {
+    std::string line = "{\"command\": \"" + command + "\", \"stats\": " + statsJSON(stats) + "}\n";
+    if (statsFile.empty()) {
+        std::cerr << line;
+        return;
+    }
+
+    std::ofstream out(statsFile, std::ios::app);
+    if (!(out << line)) {
+        throw StegoError("Could not write stats file: " + statsFile);
+    }
+}
+
+std::string readMessageFile(const char *path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw StegoError(std::string("Could not open message file: ") + path);
+    }
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Each shard keeps its carrier's file name, in the output directory
+std::vector<std::string> shardOutputs(const std::vector<std::string>& carriers, const char *outputDir) {
+    std::vector<std::string> outputs;
+    for (const std::string& carrier : carriers) {
+        std::filesystem::path output = std::filesystem::path(outputDir) / std::filesystem::path(carrier).filename();
+        if (std::filesystem::exists(output) && std::filesystem::equivalent(output, carrier)) {
+            throw StegoError("Shard would overwrite its carrier: " + carrier);
+        }
+        outputs.push_back(output.string());
+    }
+    return outputs;
+}
+
+const char *USAGE =
+    "usage: stegopng 0 0 <image> <message> <output>\n"
+    "       stegopng 0 1 <image> <message> <output> <key image> <key output>\n"
+    "       stegopng 0 2 <image> <message> <output> <key image>\n"
+    "       stegopng 1 0 <image>\n"
+    "       stegopng 1 1 <image> <key image>\n"
+    "       stegopng 1 2 <image> <key image>\n"
+    "       stegopng batch <manifest> <results>\n"
+    "       stegopng scan <directory>\n"
+    "       stegopng capacity <image>...\n"
+    "       stegopng shard <message file> <output directory> <carrier>...\n"
+    "       stegopng unshard <image>...\n"
+    "       stegopng serve <socket>";
+
+// Positional arguments a mode and encoding take, counting the program name,
+// or 0 for an unknown pair
+size_t expectedArgs(int mode, int encodingOption) {
+    static const size_t counts[2][3] = {{6, 8, 7}, {4, 5, 5}};
+    if ((mode != ENCODE && mode != DECODE) || encodingOption < PLAINTEXT_MODE || encodingOption > AES_DERIVED_MODE) {
+        return 0;
+    }
+    return counts[mode][encodingOption];
+}
+
+int parseArgNumber(const char *arg) {
+    try {
+        size_t end;
+        int value = std::stoi(arg, &end);
+        if (arg[end] == '\0') {
+            return value;
+        }
+    } catch (const std::logic_error&) {
+    }
+    throw StegoError(USAGE);
+}
+
+// An option's value must be a whole number in range, so "abc" or "4x" is a
+// usage error rather than an exception out of std::stoll
+long long parseOptionNumber(const std::string& option, const char *arg, long long minValue, long long maxValue) {
+    try {
+        size_t end;
+        long long value = std::stoll(arg, &end);
+        if (arg[end] == '\0' && value >= minValue && value <= maxValue) {
+            return value;
+        }
+    } catch (const std::logic_error&) {
+    }
+    throw StegoError(option + " takes a number from " + std::to_string(minValue) + " to " + std::to_string(maxValue) + ", not " + arg);
+}
+
+std::string commandName(char **argv) {
+    std::string name = parseArgNumber(argv[1]) == ENCODE ? "encode" : "decode";
+    int encodingOption = parseArgNumber(argv[2]);
+    if (encodingOption == AES_DERIVED_MODE) {
+        return name + " aes-derived";
+    }
+    return name + (encodingOption == AES_MODE ? " aes" : " plaintext");
+}
+
+void runCommand(char **argv, size_t numArgs, const StegoOptions& options, const std::string& profileName);
 
 int main(int argc, char **argv) {
-    int mode = std::stoi(argv[1]);
-    int encodingOption = std::stoi(argv[2]);
+    try {
+        // Options may appear anywhere, everything else is positional
+        StegoOptions options;
+        std::string profileName;
+        bool threadsGiven = false;
+        StegoStats stats;
+        bool statsGiven = false;
+        std::string statsFile;
+        bool extract = false;
+        std::vector<char *> args;
+        for (int i = 0; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--threads" && i + 1 < argc) {
+                // 0 is one per core
+                options.threads = parseOptionNumber(arg, argv[++i], 0, INT_MAX);
+                threadsGiven = true;
+            } else if (arg == "--idat-size" && i + 1 < argc) {
+                // PNG chunk lengths stop at 2^31 - 1
+                options.IDATSize = parseOptionNumber(arg, argv[++i], 1, 0x7fffffff);
+            } else if (arg == "--bits" && i + 1 < argc) {
+                // Only encodes need it, decodes read it from the image
+                options.bitsPerSample = parseOptionNumber(arg, argv[++i], 1, MAX_BITS_PER_SAMPLE);
+            } else if (arg == "--stats") {
+                statsGiven = true;
+            } else if (arg == "--stats-file" && i + 1 < argc) {
+                statsGiven = true;
+                statsFile = argv[++i];
+            } else if (arg == "--extract") {
+                extract = true;
+            } else if (arg == "--profile" && i + 1 < argc) {
+                profileName = argv[++i];
+                options.profile = parseProfile(profileName);
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+        // NULL terminated like the argv it replaces
+        size_t numArgs = args.size();
+        args.push_back(nullptr);
+        argv = args.data();
+        if (statsGiven) {
+            options.stats = &stats;
+        }
+
+        // stegopng batch <manifest> <results>, with --threads setting how
+        // many images are processed at once
+        if (numArgs == 4 && std::string(argv[1]) == "batch") {
+            size_t numFailed = runBatch(argv[2], argv[3], threadsGiven ? options.threads : 0, options);
+            if (statsGiven) {
+                reportStats("batch", stats, statsFile);
+            }
+            return numFailed == 0 ? 0 : 2;
+        }
+
+        // stegopng scan <directory>, listing the PNGs under it that hold a
+        // message as JSON lines, with --extract adding the messages
+        if (numArgs == 3 && std::string(argv[1]) == "scan") {
+            ScanSummary summary = runScan(argv[2], threadsGiven ? options.threads : 0, extract, options, std::cout);
+            std::cerr << "Scanned " << summary.numFiles << " PNGs: " << summary.numFound << " with a message, "
+                      << summary.numFailed << " unreadable\n";
+            if (statsGiven) {
+                reportStats("scan", stats, statsFile);
+            }
+            return summary.numFailed == 0 ? 0 : 2;
+        }
+
+        // stegopng capacity <image>..., the longest message the image can
+        // hold at --bits bits per sample, or the images between them as shards
+        if (numArgs >= 3 && std::string(argv[1]) == "capacity") {
+            if (numArgs == 3) {
+                std::cout << messageCapacity(argv[2], options.bitsPerSample) << '\n';
+            } else {
+                std::cout << shardCapacity(std::vector<std::string>(argv + 2, argv + numArgs), options.bitsPerSample) << '\n';
+            }
+            return 0;
+        }
+
+        // stegopng shard <message file> <output directory> <carrier>...,
+        // splitting a message too long for one carrier across several
+        if (numArgs >= 5 && std::string(argv[1]) == "shard") {
+            std::string message = readMessageFile(argv[2]);
+            std::vector<std::string> carriers(argv + 4, argv + numArgs);
+            encodeShards(carriers, (const unsigned char *) message.data(), message.size(), shardOutputs(carriers, argv[3]), options);
+            if (statsGiven) {
+                reportStats("shard", stats, statsFile);
+            }
+            return 0;
+        }
+
+        // stegopng unshard <image>..., the images in any order
+        if (numArgs >= 3 && std::string(argv[1]) == "unshard") {
+            std::cout << decodeShards(std::vector<std::string>(argv + 2, argv + numArgs), options);
+            if (statsGiven) {
+                reportStats("unshard", stats, statsFile);
+            }
+            return 0;
+        }
+
+        // stegopng serve <socket>, answering requests until killed
+        if (numArgs == 3 && std::string(argv[1]) == "serve") {
+            return runServer(argv[2], threadsGiven ? options.threads : 0, options);
+        }
+
+        runCommand(argv, numArgs, options, profileName);
+        if (statsGiven) {
+            reportStats(commandName(argv), stats, statsFile);
+        }
+    } catch (const std::bad_alloc&) {
+        // An image whose header claims more rows than fit in memory
+        std::cerr << "Out of memory\n";
+        return 1;
+    } catch (const std::exception& e) {
+        // Besides StegoError, a filesystem error while reporting
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
+
+void runCommand(char **argv, size_t numArgs, const StegoOptions& options, const std::string& profileName) {
+    if (numArgs < 3) {
+        throw StegoError(USAGE);
+    }
+    int mode = parseArgNumber(argv[1]);
+    int encodingOption = parseArgNumber(argv[2]);
+    if (expectedArgs(mode, encodingOption) == 0 || numArgs != expectedArgs(mode, encodingOption)) {
+        throw StegoError(USAGE);
+    }
     char *inputFile = argv[3];
 
     if (mode == ENCODE) {
         std::string message = argv[4];
         int msgLen = message.length();
         char *outputFile = argv[5];
+        auto start = std::chrono::steady_clock::now();
 
         if (encodingOption == PLAINTEXT_MODE) {
-            encodePlaintext(inputFile, (unsigned char *) message.data(), msgLen, outputFile);
+            encodePlaintext(inputFile, (unsigned char *) message.data(), msgLen, outputFile, options);
         } else if (encodingOption == AES_MODE) {
             char *inputKeyFile = argv[6];
             char *outputKeyFile = argv[7];
-            encodeAES(inputFile, (unsigned char *) message.data(), msgLen, outputFile, inputKeyFile, outputKeyFile);
+            encodeAES(inputFile, (unsigned char *) message.data(), msgLen, outputFile, inputKeyFile, outputKeyFile, options);
+        } else if (encodingOption == AES_DERIVED_MODE) {
+            // The key image is only read
+            char *keyFile = argv[6];
+            encodeAESDerived(inputFile, (unsigned char *) message.data(), msgLen, outputFile, keyFile, options);
+        }
+
+        if (!profileName.empty()) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            reportEncode(profileName, outputFile, elapsed.count());
         }
     } else if (mode == DECODE) {
         std::string output;
         if (encodingOption == PLAINTEXT_MODE) {
-            output = decodePlaintext(inputFile);
+            output = decodePlaintext(inputFile, options);
         } else if (encodingOption == AES_MODE) {
             char *inputKeyFile = argv[4];
-            output = decodeAES(inputFile, inputKeyFile);
+            output = decodeAES(inputFile, inputKeyFile, options);
+        } else if (encodingOption == AES_DERIVED_MODE) {
+            char *keyFile = argv[4];
+            output = decodeAESDerived(inputFile, keyFile, options);
         }
         
         std::cout << output;
@@ -2,9 +2,105 @@ import tkinter as tk
 import subprocess
 import secrets
 import random
+import os
+import socket
+import struct
+import threading
+import queue
+import stegopng
 from tkinterdnd2 import TkinterDnD, DND_FILES
 from tkinter import filedialog
 
+# Socket of a running `stegopng serve`, used instead of starting a process
+SOCKET_PATH = os.environ.get("STEGOPNG_SOCKET", "/tmp/stegopng.sock")
+
+def read_exactly(conn, length):
+    data = b""
+    while len(data) < length:
+        chunk = conn.recv(length - len(data))
+        if not chunk:
+            raise ConnectionError("stegopng server closed the connection")
+        data += chunk
+    return data
+
+def request_daemon(args):
+    # Same positional arguments as the command line, sent in the framing
+    # described in protocol.h
+    op, mode, input_file = int(args[0]), int(args[1]), args[2]
+    fields = [input_file, "", "", "", ""]
+    if op == 0:
+        fields[1:3] = args[3:5]
+        if mode == 1:
+            fields[3:5] = args[5:7]
+    elif mode == 1:
+        fields[3] = args[3]
+
+    # The server resolves paths from its own working directory
+    fields = [field if i == 1 or not field else os.path.abspath(field) for i, field in enumerate(fields)]
+
+    payload = bytes([op, mode])
+    for field in fields:
+        encoded = field.encode("utf-8")
+        payload += struct.pack(">I", len(encoded)) + encoded
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as conn:
+        conn.connect(SOCKET_PATH)
+        conn.sendall(struct.pack(">I", len(payload)) + payload)
+        (length,) = struct.unpack(">I", read_exactly(conn, 4))
+        response = read_exactly(conn, length)
+
+    (text_length,) = struct.unpack(">I", response[1:5])
+    text = response[5:5 + text_length].decode("utf-8", errors="replace")
+    if response[0] == 0:
+        return subprocess.CompletedProcess(args, 0, text if op == 1 else "", "")
+    return subprocess.CompletedProcess(args, 1, "", text)
+
+def run_stegopng(args):
+    if os.path.exists(SOCKET_PATH):
+        try:
+            return request_daemon(args)
+        except (OSError, ConnectionError):
+            pass
+    return subprocess.run(["./stegopng"] + args, capture_output=True, encoding="utf-8", errors="replace")
+
+def load_stego():
+    try:
+        return stegopng.Stego()
+    except OSError:
+        return None
+
+def read_file(path):
+    with open(path, "rb") as file:
+        return file.read()
+
+def write_file(path, data):
+    # Written aside and renamed so a failed write leaves no partial image
+    temp_path = path + ".tmp"
+    with open(temp_path, "wb") as file:
+        file.write(data)
+    os.replace(temp_path, path)
+
+def run_library(stego, args, progress):
+    # Same positional arguments as the command line, run in this process
+    op, mode, input_file = int(args[0]), int(args[1]), args[2]
+    try:
+        png = read_file(input_file)
+        if op == 0 and mode == 0:
+            write_file(args[4], stego.encode_plaintext(png, args[3].encode("utf-8"), progress))
+        elif op == 0:
+            output, key_output = stego.encode_aes(png, read_file(args[5]), args[3].encode("utf-8"), progress)
+            write_file(args[4], output)
+            write_file(args[6], key_output)
+        else:
+            if mode == 0:
+                message = stego.decode_plaintext(png, progress)
+            else:
+                message = stego.decode_aes(png, read_file(args[3]), progress)
+            return subprocess.CompletedProcess(args, 0, message.decode("utf-8", errors="replace"), "")
+    except (stegopng.StegoError, OSError) as e:
+        return subprocess.CompletedProcess(args, 1, "", str(e))
+    return subprocess.CompletedProcess(args, 0, "", "")
+
 def main():
     root = TkinterDnD.Tk()
     root.title("PNG Steganography")
@@ -138,28 +234,71 @@ def main():
         message_entry.delete(0, tk.END)
         message_entry.insert(0, random_password)
 
+    # Operations run on a worker thread so large images do not freeze the
+    # window. The worker only puts progress and its result on this queue, as
+    # Tk may only be touched from the main thread.
+    stego = load_stego()
+    events = queue.Queue()
+
+    def run_in_background(args):
+        def progress(done, total):
+            events.put(("progress", done / total if total else 0.0))
+
+        def work():
+            if stego is not None:
+                result = run_library(stego, args, progress)
+            else:
+                result = run_stegopng(args)
+            events.put(("done", result))
+
+        submit_button.config(state=tk.DISABLED)
+        status_label.config(text="Working...")
+        threading.Thread(target=work, daemon=True).start()
+        root.after(50, poll_events)
+
+    def poll_events():
+        while True:
+            try:
+                kind, value = events.get_nowait()
+            except queue.Empty:
+                root.after(50, poll_events)
+                return
+            if kind == "progress":
+                status_label.config(text="Working... {:.0%}".format(min(value, 1.0)))
+            else:
+                submit_button.config(state=tk.NORMAL)
+                show_result(value)
+                return
+
     def submit():
         if operating_mode.get() == "Encode":
             if encryption_mode.get() == "Plaintext":
-                result = subprocess.run(["./stegopng", "0", "0", main_img_entry.get(), message_entry.get(), output_img_entry.get() + ".png"], capture_output=True, text=True)
+                args = ["0", "0", main_img_entry.get(), message_entry.get(), output_img_entry.get() + ".png"]
             elif encryption_mode.get() == "AES":
                 outputFile = output_img_entry.get()
                 outputKeyFile = outputFile + ' - key'
 
-                result = subprocess.run(["./stegopng", "0", "1", main_img_entry.get(), message_entry.get(), outputFile + ".png", aes_key_entry.get(), outputKeyFile + ".png"], capture_output=True, text=True)
-            
+                args = ["0", "1", main_img_entry.get(), message_entry.get(), outputFile + ".png", aes_key_entry.get(), outputKeyFile + ".png"]
+        elif operating_mode.get() == "Decode":
+            if encryption_mode.get() == "Plaintext":
+                args = ["1", "0", main_img_entry.get()]
+            elif encryption_mode.get() == "AES":
+                args = ["1", "1", main_img_entry.get(), aes_key_entry.get()]
+
+        run_in_background(args)
+
+        main_img_entry.delete(0, tk.END)
+        message_entry.delete(0, tk.END)
+        aes_key_entry.delete(0, tk.END)
+        output_img_entry.delete(0, tk.END)
+
+    def show_result(result):
+        if result.args[0] == "0":
             if len(result.stderr) == 0:
                 status_label.config(text="Success!")
             else:
                 status_label.config(text=result.stderr)
-
-                
-        elif operating_mode.get() == "Decode":
-            if encryption_mode.get() == "Plaintext":
-                result = subprocess.run(["./stegopng", "1", "0", main_img_entry.get()], capture_output=True)
-            elif encryption_mode.get() == "AES":
-                result = subprocess.run(["./stegopng", "1", "1", main_img_entry.get(), aes_key_entry.get()], capture_output=True)
-            
+        else:
             if len(result.stderr) == 0:
                 status_label.config(text="Success!")
                 decoded_output_entry.delete(0, tk.END)
@@ -172,11 +311,6 @@ def main():
             else:
                 status_label.config(text=result.stderr)
 
-        main_img_entry.delete(0, tk.END)
-        message_entry.delete(0, tk.END)
-        aes_key_entry.delete(0, tk.END)
-        output_img_entry.delete(0, tk.END)
-
     def toggle_decoded_output_visibility():
         if decoded_output_entry.cget("show") == "":
             decoded_output_entry.config(show="*")
@@ -0,0 +1,570 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "batch.h"
+#include "threadpool.h"
+
+typedef std::map<std::string, std::string> ManifestFields;
+
+void parseManifestLine(const std::string& line, BatchJob *job);
+void parseJSONLine(const std::string& line, BatchJob *job);
+void parseTSVLine(const std::string& line, BatchJob *job);
+ManifestFields parseJSONObject(const std::string& line);
+std::string parseJSONString(const std::string& line, size_t *pos);
+void appendUTF8(std::string& out, uint32_t codePoint);
+int parseOperation(const std::string& op);
+int parseEncodingOption(const std::string& mode);
+std::string field(const ManifestFields& fields, const char *name, bool required);
+
+void writeResult(std::ofstream& results, bool tsv, bool withStats, const BatchJob& job, const BatchResult& result);
+std::string escapeTSV(const std::string& str);
+size_t validUTF8Length(const std::string& str, size_t pos);
+bool isValidUTF8(const std::string& str);
+std::string encodeBase64(const std::string& data);
+std::string unescapeTSV(const std::string& str);
+
+size_t runBatch(const char *manifestFile, const char *resultsFile, int threads, const StegoOptions& options) {
+    std::ifstream manifest(manifestFile);
+    if (!manifest) {
+        throw StegoError(std::string("Could not open manifest: ") + manifestFile);
+    }
+
+    std::ofstream results(resultsFile);
+    if (!results) {
+        throw StegoError(std::string("Could not open results file: ") + resultsFile);
+    }
+
+    std::string resultsName = resultsFile;
+    bool tsv = resultsName.size() >= 4 && resultsName.compare(resultsName.size() - 4, 4, ".tsv") == 0;
+
+    // Jobs get a pool of their own, since a job may itself wait on work it
+    // hands to the shared pool. Each job compresses on one thread, an AES
+    // job handles its two images one after the other and no job pipelines
+    // its stages, as the batch is already parallel across images.
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    ThreadPool pool(threads);
+    StegoOptions jobOptions = options;
+    jobOptions.threads = 1;
+    jobOptions.concurrentAES = false;
+    jobOptions.pipelineStages = false;
+    // Jobs run side by side, so each fills in stats of its own
+    bool collectStats = options.stats != NULL;
+    jobOptions.stats = NULL;
+
+    // Results are written in manifest order, with a bounded number of jobs
+    // queued ahead so huge manifests are not read in all at once
+    size_t maxInFlight = 4 * (size_t) threads;
+    std::deque<std::pair<BatchJob, std::future<BatchResult>>> pending;
+    size_t numFailed = 0;
+
+    auto writeNext = [&]() {
+        BatchResult result = pending.front().second.get();
+        writeResult(results, tsv, collectStats, pending.front().first, result);
+        numFailed += result.ok ? 0 : 1;
+        if (collectStats) {
+            mergeStats(options.stats, result.stats);
+        }
+        pending.pop_front();
+    };
+
+    std::string line;
+    size_t lineNum = 0;
+    while (std::getline(manifest, line)) {
+        lineNum++;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.find_first_not_of(" \t") == std::string::npos || line[0] == '#') {
+            continue;
+        }
+
+        BatchJob job;
+        job.lineNum = lineNum;
+        job.id = std::to_string(lineNum);
+
+        std::future<BatchResult> result;
+        try {
+            parseManifestLine(line, &job);
+            result = pool.submit([job, jobOptions, collectStats]() {
+                StegoStats stats;
+                StegoOptions statsOptions = jobOptions;
+                statsOptions.stats = collectStats ? &stats : NULL;
+                BatchResult result = runBatchJob(job, statsOptions);
+                result.stats = stats;
+                return result;
+            });
+        } catch (const std::exception& e) {
+            std::promise<BatchResult> failed;
+            failed.set_value({false, "", e.what(), StegoStats()});
+            result = failed.get_future();
+        }
+
+        pending.emplace_back(job, std::move(result));
+        if (pending.size() >= maxInFlight) {
+            writeNext();
+        }
+    }
+
+    while (!pending.empty()) {
+        writeNext();
+    }
+    return numFailed;
+}
+
+BatchResult runBatchJob(BatchJob job, const StegoOptions& options) {
+    try {
+        if (job.mode == ENCODE) {
+            unsigned char *message = (unsigned char *) job.message.data();
+            if (job.encodingOption == PLAINTEXT_MODE) {
+                encodePlaintext(job.inputFile.data(), message, job.message.length(), job.outputFile.data(), options);
+            } else if (job.encodingOption == AES_DERIVED_MODE) {
+                encodeAESDerived(job.inputFile.data(), message, job.message.length(), job.outputFile.data(), job.inputKeyFile.data(), options);
+            } else {
+                encodeAES(job.inputFile.data(), message, job.message.length(), job.outputFile.data(),
+                          job.inputKeyFile.data(), job.outputKeyFile.data(), options);
+            }
+            return {true, job.outputFile, "", StegoStats()};
+        }
+
+        if (job.encodingOption == PLAINTEXT_MODE) {
+            return {true, decodePlaintext(job.inputFile.data(), options), "", StegoStats()};
+        } else if (job.encodingOption == AES_DERIVED_MODE) {
+            return {true, decodeAESDerived(job.inputFile.data(), job.inputKeyFile.data(), options), "", StegoStats()};
+        }
+        return {true, decodeAES(job.inputFile.data(), job.inputKeyFile.data(), options), "", StegoStats()};
+    } catch (const std::exception& e) {
+        return {false, "", e.what(), StegoStats()};
+    }
+}
+
+void parseManifestLine(const std::string& line, BatchJob *job) {
+    size_t start = line.find_first_not_of(" \t");
+    if (line[start] == '{') {
+        parseJSONLine(line, job);
+    } else {
+        parseTSVLine(line, job);
+    }
+}
+
+// {"id": "a1", "op": "encode", "mode": "aes", "input": "in.png", "message": "hi",
+//  "output": "out.png", "key_input": "key.png", "key_output": "key_out.png"}
+// The aes-derived mode takes a key_input but no key_output.
+void parseJSONLine(const std::string& line, BatchJob *job) {
+    ManifestFields fields = parseJSONObject(line);
+
+    if (fields.count("id")) {
+        job->id = fields["id"];
+    }
+    job->mode = parseOperation(field(fields, "op", true));
+    job->encodingOption = parseEncodingOption(fields.count("mode") ? fields["mode"] : "plaintext");
+    job->inputFile = field(fields, "input", true);
+
+    bool isAES = job->encodingOption == AES_MODE;
+    bool hasKeyImage = isAES || job->encodingOption == AES_DERIVED_MODE;
+    if (job->mode == ENCODE) {
+        job->message = field(fields, "message", true);
+        job->outputFile = field(fields, "output", true);
+        job->outputKeyFile = field(fields, "key_output", isAES);
+    }
+    job->inputKeyFile = field(fields, "key_input", hasKeyImage);
+}
+
+// The command line's positional arguments, tab separated:
+// op, mode, input, then the message, output and key files as needed
+void parseTSVLine(const std::string& line, BatchJob *job) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t tab = line.find('\t', start);
+        fields.push_back(unescapeTSV(line.substr(start, tab - start)));
+        if (tab == std::string::npos) {
+            break;
+        }
+        start = tab + 1;
+    }
+
+    if (fields.size() < 3) {
+        throw StegoError("Expected at least op, mode and input fields");
+    }
+    job->mode = parseOperation(fields[0]);
+    job->encodingOption = parseEncodingOption(fields[1]);
+    job->inputFile = fields[2];
+
+    bool isAES = job->encodingOption == AES_MODE;
+    bool hasKeyImage = isAES || job->encodingOption == AES_DERIVED_MODE;
+    size_t expected;
+    if (job->mode == ENCODE) {
+        expected = isAES ? 7 : hasKeyImage ? 6 : 5;
+    } else {
+        expected = hasKeyImage ? 4 : 3;
+    }
+    if (fields.size() != expected) {
+        throw StegoError("Expected " + std::to_string(expected) + " fields, found " + std::to_string(fields.size()));
+    }
+
+    if (job->mode == ENCODE) {
+        job->message = fields[3];
+        job->outputFile = fields[4];
+        if (hasKeyImage) {
+            job->inputKeyFile = fields[5];
+        }
+        if (isAES) {
+            job->outputKeyFile = fields[6];
+        }
+    } else if (hasKeyImage) {
+        job->inputKeyFile = fields[3];
+    }
+}
+
+int parseOperation(const std::string& op) {
+    if (op == "encode" || op == "0") {
+        return ENCODE;
+    } else if (op == "decode" || op == "1") {
+        return DECODE;
+    }
+    throw StegoError("Unknown op: " + op);
+}
+
+int parseEncodingOption(const std::string& mode) {
+    if (mode == "plaintext" || mode == "0") {
+        return PLAINTEXT_MODE;
+    } else if (mode == "aes" || mode == "1") {
+        return AES_MODE;
+    } else if (mode == "aes-derived" || mode == "2") {
+        return AES_DERIVED_MODE;
+    }
+    throw StegoError("Unknown mode: " + mode);
+}
+
+std::string field(const ManifestFields& fields, const char *name, bool required) {
+    auto it = fields.find(name);
+    if (it == fields.end()) {
+        if (required) {
+            throw StegoError(std::string("Missing field: ") + name);
+        }
+        return "";
+    }
+    return it->second;
+}
+
+// A flat object only: values are strings, or numbers and literals kept as
+// their text
+ManifestFields parseJSONObject(const std::string& line) {
+    ManifestFields fields;
+    size_t pos = 0;
+
+    auto skipSpace = [&]() {
+        while (pos < line.size() && isspace((unsigned char) line[pos])) {
+            pos++;
+        }
+    };
+    auto expect = [&](char c) {
+        skipSpace();
+        if (pos >= line.size() || line[pos] != c) {
+            throw StegoError(std::string("Bad JSON: expected '") + c + "' at column " + std::to_string(pos + 1));
+        }
+        pos++;
+    };
+
+    expect('{');
+    skipSpace();
+    if (pos < line.size() && line[pos] == '}') {
+        pos++;
+    } else {
+        while (true) {
+            skipSpace();
+            std::string key = parseJSONString(line, &pos);
+            expect(':');
+            skipSpace();
+
+            if (pos < line.size() && line[pos] == '"') {
+                fields[key] = parseJSONString(line, &pos);
+            } else {
+                size_t end = line.find_first_of(",} \t", pos);
+                if (end == std::string::npos || end == pos || line[pos] == '{' || line[pos] == '[') {
+                    throw StegoError("Bad JSON: unsupported value for " + key);
+                }
+                fields[key] = line.substr(pos, end - pos);
+                pos = end;
+            }
+
+            skipSpace();
+            if (pos < line.size() && line[pos] == ',') {
+                pos++;
+                continue;
+            }
+            expect('}');
+            break;
+        }
+    }
+
+    skipSpace();
+    if (pos != line.size()) {
+        throw StegoError("Bad JSON: trailing characters after object");
+    }
+    return fields;
+}
+
+std::string parseJSONString(const std::string& line, size_t *pos) {
+    if (*pos >= line.size() || line[*pos] != '"') {
+        throw StegoError("Bad JSON: expected a string at column " + std::to_string(*pos + 1));
+    }
+    (*pos)++;
+
+    std::string out;
+    while (*pos < line.size() && line[*pos] != '"') {
+        char c = line[(*pos)++];
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+
+        if (*pos >= line.size()) {
+            break;
+        }
+        char escape = line[(*pos)++];
+        switch (escape) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                auto hex4 = [&]() {
+                    if (*pos + 4 > line.size()) {
+                        throw StegoError("Bad JSON: short \\u escape");
+                    }
+                    uint32_t value = 0;
+                    for (int i = 0; i < 4; i++) {
+                        char digit = line[(*pos)++];
+                        if (!isxdigit((unsigned char) digit)) {
+                            throw StegoError("Bad JSON: \\u escape needs four hex digits at column " + std::to_string(*pos));
+                        }
+                        value = (value << 4) | (isdigit((unsigned char) digit) ? digit - '0' : (tolower((unsigned char) digit) - 'a' + 10));
+                    }
+                    return value;
+                };
+                uint32_t codePoint = hex4();
+                // Characters outside the BMP come as a surrogate pair, and
+                // half of one on its own is not a character
+                if (codePoint >= 0xDC00 && codePoint < 0xE000) {
+                    throw StegoError("Bad JSON: unpaired surrogate at column " + std::to_string(*pos));
+                }
+                if (codePoint >= 0xD800 && codePoint < 0xDC00) {
+                    if (line.compare(*pos, 2, "\\u") != 0) {
+                        throw StegoError("Bad JSON: unpaired surrogate at column " + std::to_string(*pos));
+                    }
+                    *pos += 2;
+                    uint32_t low = hex4();
+                    if (low < 0xDC00 || low >= 0xE000) {
+                        throw StegoError("Bad JSON: unpaired surrogate at column " + std::to_string(*pos));
+                    }
+                    codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUTF8(out, codePoint);
+                break;
+            }
+            default: out += escape; break;
+        }
+    }
+
+    if (*pos >= line.size()) {
+        throw StegoError("Bad JSON: unterminated string");
+    }
+    (*pos)++;
+    return out;
+}
+
+void appendUTF8(std::string& out, uint32_t codePoint) {
+    if (codePoint < 0x80) {
+        out += (char) codePoint;
+    } else if (codePoint < 0x800) {
+        out += (char) (0xC0 | (codePoint >> 6));
+        out += (char) (0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x10000) {
+        out += (char) (0xE0 | (codePoint >> 12));
+        out += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        out += (char) (0x80 | (codePoint & 0x3F));
+    } else {
+        out += (char) (0xF0 | (codePoint >> 18));
+        out += (char) (0x80 | ((codePoint >> 12) & 0x3F));
+        out += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        out += (char) (0x80 | (codePoint & 0x3F));
+    }
+}
+
+void writeResult(std::ofstream& results, bool tsv, bool withStats, const BatchJob& job, const BatchResult& result) {
+    if (tsv) {
+        results << job.lineNum << '\t' << escapeTSV(job.id) << '\t' << (result.ok ? "ok" : "error") << '\t'
+                << escapeTSV(result.ok ? result.output : result.error) << '\n';
+    } else {
+        results << "{\"line\": " << job.lineNum << ", \"id\": \"" << escapeJSON(job.id) << "\", \"ok\": " << (result.ok ? "true" : "false");
+        if (result.ok) {
+            results << ", " << payloadJSON("output", result.output);
+        } else {
+            results << ", \"error\": \"" << escapeJSON(result.error) << '"';
+        }
+        if (withStats) {
+            results << ", \"stats\": " << statsJSON(result.stats);
+        }
+        results << "}\n";
+    }
+    results.flush();
+}
+
+std::string escapeJSON(const std::string& str) {
+    std::string out;
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = str[i];
+        if (c >= 0x80) {
+            // Valid UTF-8 is copied through, and any other byte, as in a file
+            // name, is written as the code point of the same value so the line
+            // stays valid JSON. That cannot be undone, so payloads go through
+            // payloadJSON instead.
+            size_t len = validUTF8Length(str, i);
+            if (len == 0) {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            } else {
+                out.append(str, i, len);
+                i += len - 1;
+            }
+        } else if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string payloadJSON(const std::string& name, const std::string& payload) {
+    if (isValidUTF8(payload)) {
+        return "\"" + name + "\": \"" + escapeJSON(payload) + "\"";
+    }
+    return "\"" + name + "_base64\": \"" + encodeBase64(payload) + "\"";
+}
+
+bool isValidUTF8(const std::string& str) {
+    for (size_t i = 0; i < str.size(); i++) {
+        if ((unsigned char) str[i] >= 0x80) {
+            size_t len = validUTF8Length(str, i);
+            if (len == 0) {
+                return false;
+            }
+            i += len - 1;
+        }
+    }
+    return true;
+}
+
+std::string encodeBase64(const std::string& data) {
+    static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < data.size(); i += 3) {
+        size_t len = std::min((size_t) 3, data.size() - i);
+        uint32_t group = (uint8_t) data[i] << 16;
+        if (len > 1) {
+            group |= (uint8_t) data[i + 1] << 8;
+        }
+        if (len > 2) {
+            group |= (uint8_t) data[i + 2];
+        }
+        out += ALPHABET[(group >> 18) & 0x3f];
+        out += ALPHABET[(group >> 12) & 0x3f];
+        out += len > 1 ? ALPHABET[(group >> 6) & 0x3f] : '=';
+        out += len > 2 ? ALPHABET[group & 0x3f] : '=';
+    }
+    return out;
+}
+
+// Length of the UTF-8 sequence starting at pos, or 0 if it is not a valid
+// one, counting overlong forms, surrogates and code points past U+10FFFF as
+// invalid
+size_t validUTF8Length(const std::string& str, size_t pos) {
+    unsigned char lead = str[pos];
+    size_t len;
+    uint32_t codePoint;
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        len = 2;
+        codePoint = lead & 0x1f;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        len = 3;
+        codePoint = lead & 0x0f;
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        len = 4;
+        codePoint = lead & 0x07;
+    } else {
+        return 0;
+    }
+    if (pos + len > str.size()) {
+        return 0;
+    }
+
+    for (size_t i = 1; i < len; i++) {
+        unsigned char c = str[pos + i];
+        if ((c & 0xc0) != 0x80) {
+            return 0;
+        }
+        codePoint = (codePoint << 6) | (c & 0x3f);
+    }
+
+    if ((len == 3 && codePoint < 0x800) || (len == 4 && codePoint < 0x10000) || codePoint > 0x10ffff ||
+        (codePoint >= 0xd800 && codePoint <= 0xdfff)) {
+        return 0;
+    }
+    return len;
+}
+
+std::string escapeTSV(const std::string& str) {
+    std::string out;
+    for (char c : str) {
+        if (c == '\\') {
+            out += "\\\\";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\r') {
+            out += "\\r";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string unescapeTSV(const std::string& str) {
+    std::string out;
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] != '\\' || i + 1 == str.size()) {
+            out += str[i];
+            continue;
+        }
+
+        char escape = str[++i];
+        out += escape == 't' ? '\t' : escape == 'n' ? '\n' : escape == 'r' ? '\r' : escape;
+    }
+    return out;
+}
@@ -0,0 +1,48 @@
+#include <cstddef>
+#include <string>
+#include "stego.h"
+#ifndef BATCH_H
+#define BATCH_H
+
+// One encode or decode from a batch manifest, with the same arguments the
+// command line takes
+typedef struct BatchJob {
+    size_t lineNum;
+    std::string id;
+    int mode;
+    int encodingOption;
+    std::string inputFile;
+    std::string message;
+    std::string outputFile;
+    std::string inputKeyFile;
+    std::string outputKeyFile;
+} BatchJob;
+
+// A failed job keeps its error here instead of ending the batch
+typedef struct BatchResult {
+    bool ok;
+    std::string output;
+    std::string error;
+    // Only filled in when the batch collects stats
+    StegoStats stats;
+} BatchResult;
+
+BatchResult runBatchJob(BatchJob job, const StegoOptions& options);
+
+// Runs every job in the manifest on a pool of threads and writes one result
+// per job, in manifest order. Manifest lines are JSON objects or tab
+// separated fields, and results are written as JSON lines unless the results
+// file ends in .tsv. A JSON result's decoded output is written as
+// output_base64 when it is not valid UTF-8. With stats in the options, each
+// JSON result carries its job's stats and the options' stats get the sum.
+// Returns the number of failed jobs.
+size_t runBatch(const char *manifestFile, const char *resultsFile, int threads, const StegoOptions& options);
+
+// Escapes a string for a JSON result line
+std::string escapeJSON(const std::string& str);
+
+// A decoded payload as a JSON field: "name": "..." when it is valid UTF-8,
+// or "name_base64": "..." holding its bytes when it is not
+std::string payloadJSON(const std::string& name, const std::string& payload);
+
+#endif
@@ -0,0 +1,533 @@
+#include "bitpack.h"
+#include "corpus.h"
+#include "filter.h"
+#include "pdeflate.h"
+#include "stages.h"
+#include "stego.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// stegopng_bench [width] [height]
+//   Times the filter, deflate and bit packing kernels on a synthetic image,
+//   comparing each against its reference version.
+// stegopng_bench stages [--large] [--runs N]
+//   Times each step of an encode, and whole encodes and decodes, over the
+//   synthetic corpus, printing JSON to compare between versions.
+// stegopng_bench corpus <dir> [--large]
+//   Writes the synthetic corpus out as PNG files.
+
+typedef struct ColourLayout {
+    int colourType;
+    const char *name;
+    int bytesPerPixel;
+} ColourLayout;
+
+static const ColourLayout layouts[] = {
+    {0, "gray", 1},
+    {4, "gray+alpha", 2},
+    {2, "RGB", 3},
+    {6, "RGBA", 4}
+};
+
+const int NUM_RUNS = 5;
+// Stage runs cover whole encodes, so fewer of them
+const int NUM_STAGE_RUNS = 3;
+
+// Rows cycle through the Sub, Up, Avg and Paeth filters
+std::vector<uint8_t> makeFilteredImage(uint32_t width, uint32_t height, int bytesPerPixel) {
+    size_t scanlineLen = (size_t) width * bytesPerPixel + 1;
+    std::vector<uint8_t> data(scanlineLen * height);
+
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < data.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+
+    for (uint32_t row = 0; row < height; row++) {
+        data[row * scanlineLen] = 1 + (row % 4);
+    }
+    return data;
+}
+
+double unfilterImage(const FilterKernels *kernels, std::vector<uint8_t>& data, size_t scanlineLen) {
+    std::vector<uint8_t> zeroScanline(scanlineLen, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < data.size(); i += scanlineLen) {
+        const uint8_t *prevScanline = (i == 0) ? zeroScanline.data() : &data[i - scanlineLen];
+        unfilterScanline(kernels, &data[i], prevScanline, scanlineLen);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+double refilterImage(const FilterKernels *kernels, std::vector<uint8_t>& data, const std::vector<uint8_t>& orig, size_t scanlineLen) {
+    std::vector<uint8_t> zeroScanline(scanlineLen, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < data.size(); i += scanlineLen) {
+        const uint8_t *origPrevScanline = (i == 0) ? zeroScanline.data() : &orig[i - scanlineLen];
+        refilterScanline(kernels, &data[i], &orig[i], origPrevScanline, scanlineLen);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Best of several runs, checking the output matches the generic kernels
+void timeKernels(const FilterKernels *kernels, const std::vector<uint8_t>& filtered, const std::vector<uint8_t>& expectedUnfiltered,
+                 const std::vector<uint8_t>& expectedRefiltered, size_t scanlineLen, double *unfilterMs, double *refilterMs) {
+    *unfilterMs = 1e30;
+    *refilterMs = 1e30;
+
+    for (int run = 0; run < NUM_RUNS; run++) {
+        std::vector<uint8_t> data = filtered;
+        *unfilterMs = std::min(*unfilterMs, unfilterImage(kernels, data, scanlineLen));
+        if (data != expectedUnfiltered) {
+            fprintf(stderr, "%s kernels unfiltered differently from the generic kernels\n", kernels->name);
+            exit(1);
+        }
+
+        *refilterMs = std::min(*refilterMs, refilterImage(kernels, data, expectedUnfiltered, scanlineLen));
+        if (data != expectedRefiltered) {
+            fprintf(stderr, "%s kernels refiltered differently from the generic kernels\n", kernels->name);
+            exit(1);
+        }
+    }
+}
+
+// Best of several runs of the whole-image refilter split across row bands
+double timeBandRefilter(const std::vector<uint8_t>& unfiltered, const std::vector<uint8_t>& expectedRefiltered, const std::vector<uint8_t>& filtered,
+                        size_t scanlineLen, int bytesPerPixel, int threads) {
+    double bestMs = 1e30;
+
+    for (int run = 0; run < NUM_RUNS; run++) {
+        std::vector<uint8_t> data = unfiltered;
+        // Filter types come from the original filtered image
+        for (size_t i = 0; i < data.size(); i += scanlineLen) {
+            data[i] = filtered[i];
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        refilter(data, scanlineLen, bytesPerPixel, threads);
+        auto end = std::chrono::steady_clock::now();
+        bestMs = std::min(bestMs, std::chrono::duration<double, std::milli>(end - start).count());
+
+        if (data != expectedRefiltered) {
+            fprintf(stderr, "Refilter on %d threads differs from the generic kernels\n", threads);
+            exit(1);
+        }
+    }
+    return bestMs;
+}
+
+// Smooth gradients with a little noise, Sub filtered, so deflate sees data
+// shaped like a real image rather than noise
+std::vector<uint8_t> makeGradientImage(uint32_t width, uint32_t height, int bytesPerPixel) {
+    size_t scanlineLen = (size_t) width * bytesPerPixel + 1;
+    std::vector<uint8_t> data(scanlineLen * height);
+
+    uint32_t seed = 54321;
+    for (uint32_t row = 0; row < height; row++) {
+        uint8_t *scanline = &data[row * scanlineLen];
+        scanline[0] = 1;
+        for (size_t i = 1; i < scanlineLen; i++) {
+            seed = seed * 1103515245 + 12345;
+            scanline[i] = (i / bytesPerPixel + row) / 8 + ((seed >> 16) & 3);
+        }
+    }
+
+    refilter(data, scanlineLen, bytesPerPixel);
+    return data;
+}
+
+typedef struct DeflateCodec {
+    const char *name;
+    int level;
+    int threads;
+} DeflateCodec;
+
+std::vector<uint8_t> zlibDeflate(const std::vector<uint8_t>& data, int level) {
+    uLongf compressedLen = compressBound(data.size());
+    std::vector<uint8_t> compressedData(compressedLen);
+    if (compress2(compressedData.data(), &compressedLen, data.data(), data.size(), level) != Z_OK) {
+        fprintf(stderr, "compress2 failed\n");
+        exit(1);
+    }
+    compressedData.resize(compressedLen);
+    return compressedData;
+}
+
+std::vector<uint8_t> runCodec(const DeflateCodec& codec, const std::vector<uint8_t>& data, size_t scanlineLen) {
+    if (codec.level == 0) {
+        return storedDeflate(data.data(), data.size());
+    } else if (codec.threads == 1) {
+        return zlibDeflate(data, codec.level);
+    }
+    return parallelDeflate(data.data(), data.size(), scanlineLen, codec.threads, codec.level, Z_DEFAULT_STRATEGY);
+}
+
+// Best of several runs of each output codec on an RGBA image, checking that
+// stock zlib inflates every result back to the input
+void benchCodecs(uint32_t width, uint32_t height, int maxThreads) {
+    size_t scanlineLen = (size_t) width * 4 + 1;
+    std::vector<uint8_t> data = makeGradientImage(width, height, 4);
+
+    printf("\nIDAT codecs on an RGBA gradient image\n\n");
+    printf("%-22s %12s %10s %10s %10s\n", "codec", "bytes", "ratio", "ms", "MB/s");
+
+    std::vector<DeflateCodec> codecs = {{"zlib level 6", 6, 1}, {"zlib level 1", 1, 1}};
+    if (maxThreads > 1) {
+        codecs.push_back({"parallel level 6", 6, maxThreads});
+    }
+    codecs.push_back({"stored", 0, 1});
+
+    for (const DeflateCodec& codec : codecs) {
+        double bestMs = 1e30;
+        std::vector<uint8_t> compressedData;
+
+        for (int run = 0; run < NUM_RUNS; run++) {
+            auto start = std::chrono::steady_clock::now();
+            compressedData = runCodec(codec, data, scanlineLen);
+            auto end = std::chrono::steady_clock::now();
+            bestMs = std::min(bestMs, std::chrono::duration<double, std::milli>(end - start).count());
+        }
+
+        std::vector<uint8_t> inflated(data.size());
+        uLongf inflatedLen = inflated.size();
+        if (uncompress(inflated.data(), &inflatedLen, compressedData.data(), compressedData.size()) != Z_OK || inflated != data) {
+            fprintf(stderr, "%s output does not inflate back to the input\n", codec.name);
+            exit(1);
+        }
+
+        printf("%-22s %12zu %9.2f%% %10.2f %10.1f\n", codec.name, compressedData.size(),
+               100.0 * compressedData.size() / data.size(), bestMs, data.size() / 1e3 / bestMs);
+    }
+}
+
+// Best of several runs embedding and extracting a payload as large as the
+// image's samples can hold, checked against the bitwise reference kernels
+void benchBitPack(uint32_t width, uint32_t height) {
+    // Groups of eight samples, each holding one payload byte per bit of depth
+    size_t numGroups = (size_t) width * height * 4 / 8;
+    std::vector<uint8_t> samples = makeGradientImage(width, height, 4);
+    samples.resize(numGroups * 8);
+
+    printf("\nBit packing into %zu samples\n\n", numGroups * 8);
+    printf("%-6s %-10s %12s %12s %10s %10s\n", "depth", "kernels", "embed ms", "extract ms", "embed x", "extract x");
+
+    std::vector<const BitPackKernels *> candidates = {bitwiseBitPackKernels(), portableBitPackKernels()};
+    if (bmi2BitPackKernels() != NULL) {
+        candidates.push_back(bmi2BitPackKernels());
+    }
+    // The mix the encoder picked, when it is not just the portable kernels
+    if (bitPackKernels() != portableBitPackKernels()) {
+        candidates.push_back(bitPackKernels());
+    }
+
+    for (int depth = 1; depth <= MAX_BITS_PER_SAMPLE; depth++) {
+        size_t numBytes = numGroups * depth;
+        std::vector<uint8_t> payload(numBytes);
+        for (size_t i = 0; i < numBytes; i++) {
+            payload[i] = (i * 2654435761u) >> 13;
+        }
+
+        std::vector<uint8_t> expectedSamples = samples;
+        bitwiseBitPackKernels()->embed[depth](expectedSamples.data(), payload.data(), numGroups);
+
+        double baseEmbedMs = 0;
+        double baseExtractMs = 0;
+        for (const BitPackKernels *kernels : candidates) {
+            double embedMs = 1e30;
+            double extractMs = 1e30;
+            std::vector<uint8_t> extracted(numBytes);
+
+            for (int run = 0; run < NUM_RUNS; run++) {
+                std::vector<uint8_t> data = samples;
+                auto start = std::chrono::steady_clock::now();
+                kernels->embed[depth](data.data(), payload.data(), numGroups);
+                auto end = std::chrono::steady_clock::now();
+                embedMs = std::min(embedMs, std::chrono::duration<double, std::milli>(end - start).count());
+
+                start = std::chrono::steady_clock::now();
+                kernels->extract[depth](data.data(), extracted.data(), numGroups);
+                end = std::chrono::steady_clock::now();
+                extractMs = std::min(extractMs, std::chrono::duration<double, std::milli>(end - start).count());
+
+                if (data != expectedSamples || extracted != payload) {
+                    fprintf(stderr, "%s bit packing at depth %d differs from the bitwise kernels\n", kernels->name, depth);
+                    exit(1);
+                }
+            }
+
+            if (kernels == bitwiseBitPackKernels()) {
+                baseEmbedMs = embedMs;
+                baseExtractMs = extractMs;
+            }
+            printf("%-6d %-10s %12.2f %12.2f %9.2fx %9.2fx\n", depth, kernels->name, embedMs, extractMs, baseEmbedMs / embedMs,
+                   baseExtractMs / extractMs);
+        }
+    }
+}
+
+// Best of several runs of one stage, with prepare run untimed before each
+template <typename Prepare, typename Run>
+double timeStage(int runs, Prepare prepare, Run run) {
+    double bestMs = 1e30;
+    for (int i = 0; i < runs; i++) {
+        prepare();
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto end = std::chrono::steady_clock::now();
+        bestMs = std::min(bestMs, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return bestMs;
+}
+
+typedef struct StageTimes {
+    size_t pngBytes;
+    size_t messageBytes;
+    double readMs;
+    double inflateMs;
+    double unfilterMs;
+    double embedMs;
+    double refilterMs;
+    double deflateMs;
+    double createPNGMs;
+    double encodeMs;
+    double pipelinedEncodeMs;
+    double decodeMs;
+} StageTimes;
+
+// Runs the whole-image steps one after another on the output of the last,
+// then whole encodes and decodes, all with the balanced profile on one
+// thread and a message as long as the image holds. The encode is timed
+// again with its stages pipelined, which only images past the pipeline's
+// size threshold use.
+StageTimes benchStages(const CorpusSpec& spec, int runs, const std::string& dir) {
+    StageTimes times;
+    std::string inputFile = dir + "/" + spec.name + ".png";
+    std::string stagesFile = dir + "/" + spec.name + ".stages.png";
+    std::string encodedFile = dir + "/" + spec.name + ".encoded.png";
+
+    std::vector<uint8_t> png = makeCorpusPNG(spec);
+    std::ofstream(inputFile, std::ios::binary).write((const char *) png.data(), png.size());
+    times.pngBytes = png.size();
+
+    int bytesPerPixel = corpusBytesPerPixel(spec.colourType);
+    size_t scanlineLen = (size_t) spec.width * bytesPerPixel + 1;
+    std::string message(messageCapacity(png.data(), png.size()), '\0');
+    for (size_t i = 0; i < message.size(); i++) {
+        message[i] = 'a' + (i * 7) % 26;
+    }
+    times.messageBytes = message.size();
+    unsigned char *messageData = (unsigned char *) &message[0];
+
+    std::vector<uint8_t> compressedData;
+    times.readMs = timeStage(runs, [] {}, [&] {
+        MappedPNG input(inputFile.c_str());
+        compressedData = readIDATData(input);
+    });
+
+    std::vector<uint8_t> data;
+    times.inflateMs = timeStage(runs, [] {}, [&] {
+        data = decompressIDATChunk(compressedData, scanlineLen * spec.height);
+    });
+
+    const std::vector<uint8_t> filtered = data;
+    times.unfilterMs = timeStage(runs, [&] { data = filtered; }, [&] {
+        processFilter(data, scanlineLen, bytesPerPixel);
+    });
+
+    const std::vector<uint8_t> unfiltered = data;
+    times.embedMs = timeStage(runs, [&] { data = unfiltered; }, [&] {
+        embedMessage(data, messageData, message.size(), scanlineLen);
+    });
+
+    const std::vector<uint8_t> embedded = data;
+    times.refilterMs = timeStage(runs, [&] { data = embedded; }, [&] {
+        refilter(data, scanlineLen, bytesPerPixel);
+    });
+
+    EncoderSettings settings = encoderSettings(PROFILE_BALANCED);
+    times.deflateMs = timeStage(runs, [] {}, [&] {
+        compressedData = compressIDATChunk(data, scanlineLen, 1, settings);
+    });
+
+    MappedPNG carrier(png.data(), png.size());
+    times.createPNGMs = timeStage(runs, [] {}, [&] {
+        createPNG(compressedData, carrier, (char *) stagesFile.c_str(), StegoOptions().IDATSize);
+    });
+
+    StegoOptions serialOptions;
+    serialOptions.pipelineStages = false;
+    times.encodeMs = timeStage(runs, [] {}, [&] {
+        encodePlaintext((char *) inputFile.c_str(), messageData, message.size(), (char *) encodedFile.c_str(), serialOptions);
+    });
+
+    times.pipelinedEncodeMs = timeStage(runs, [] {}, [&] {
+        encodePlaintext((char *) inputFile.c_str(), messageData, message.size(), (char *) encodedFile.c_str());
+    });
+
+    std::string decoded;
+    times.decodeMs = timeStage(runs, [] {}, [&] {
+        decoded = decodePlaintext((char *) encodedFile.c_str());
+    });
+
+    // Both routes have to give an image holding the message
+    if (decoded != message || decodePlaintext((char *) stagesFile.c_str()) != message) {
+        fprintf(stderr, "%s: decoded message differs from the one embedded\n", spec.name.c_str());
+        exit(1);
+    }
+
+    std::filesystem::remove(inputFile);
+    std::filesystem::remove(stagesFile);
+    std::filesystem::remove(encodedFile);
+    return times;
+}
+
+int benchStagesCommand(bool large, int runs) {
+    std::string dir = (std::filesystem::temp_directory_path() / ("stegopng_bench." + std::to_string(getpid()))).string();
+    std::filesystem::create_directories(dir);
+
+    printf("{\n  \"benchmark\": \"stages\",\n  \"runs\": %d,\n  \"images\": [", runs);
+    std::vector<CorpusSpec> specs = corpusSpecs(large);
+    for (size_t i = 0; i < specs.size(); i++) {
+        const CorpusSpec& spec = specs[i];
+        fprintf(stderr, "%s\n", spec.name.c_str());
+
+        // One run of the largest images already takes seconds
+        int imageRuns = (size_t) spec.width * spec.height > 20000000 ? 1 : runs;
+        StageTimes times = benchStages(spec, imageRuns, dir);
+
+        printf("%s\n    {\"name\": \"%s\", \"width\": %u, \"height\": %u, \"colourType\": %d, \"filters\": \"%s\", "
+               "\"IDATSize\": %zu, \"runs\": %d, \"pngBytes\": %zu, \"messageBytes\": %zu,\n",
+               i == 0 ? "" : ",", spec.name.c_str(), spec.width, spec.height, spec.colourType, filterMixName(spec.filterMix),
+               spec.IDATSize, imageRuns, times.pngBytes, times.messageBytes);
+        printf("     \"stagesMs\": {\"read\": %.3f, \"inflate\": %.3f, \"unfilter\": %.3f, \"embed\": %.3f, "
+               "\"refilter\": %.3f, \"deflate\": %.3f, \"createPNG\": %.3f},\n",
+               times.readMs, times.inflateMs, times.unfilterMs, times.embedMs, times.refilterMs, times.deflateMs, times.createPNGMs);
+        printf("     \"encodeMs\": %.3f, \"pipelinedEncodeMs\": %.3f, \"decodeMs\": %.3f}", times.encodeMs, times.pipelinedEncodeMs,
+               times.decodeMs);
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+
+    std::filesystem::remove_all(dir);
+    return 0;
+}
+
+int writeCorpusCommand(const std::string& dir, bool large) {
+    std::filesystem::create_directories(dir);
+    for (const CorpusSpec& spec : corpusSpecs(large)) {
+        std::vector<uint8_t> png = makeCorpusPNG(spec);
+        std::string path = dir + "/" + spec.name + ".png";
+        std::ofstream(path, std::ios::binary).write((const char *) png.data(), png.size());
+        printf("%s %zu bytes\n", path.c_str(), png.size());
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    std::string command = argc > 1 ? argv[1] : "";
+    if (command == "stages" || command == "corpus") {
+        bool large = false;
+        int runs = NUM_STAGE_RUNS;
+        std::vector<std::string> args;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--large") {
+                large = true;
+            } else if (arg == "--runs" && i + 1 < argc) {
+                runs = std::max(1, std::stoi(argv[++i]));
+            } else {
+                args.push_back(arg);
+            }
+        }
+
+        if (command == "stages") {
+            return benchStagesCommand(large, runs);
+        }
+        if (args.size() != 1) {
+            fprintf(stderr, "usage: %s corpus <dir> [--large]\n", argv[0]);
+            return 1;
+        }
+        return writeCorpusCommand(args[0], large);
+    }
+
+    uint32_t width = argc > 1 ? std::stoul(argv[1]) : 3840;
+    uint32_t height = argc > 2 ? std::stoul(argv[2]) : 2160;
+
+    printf("Filter kernels on a %ux%u image, best of %d runs\n\n", width, height, NUM_RUNS);
+    printf("%-11s %-8s %12s %12s %10s %10s\n", "layout", "kernels", "unfilter ms", "refilter ms", "unfilter x", "refilter x");
+
+    for (const ColourLayout& layout : layouts) {
+        size_t scanlineLen = (size_t) width * layout.bytesPerPixel + 1;
+        std::vector<uint8_t> filtered = makeFilteredImage(width, height, layout.bytesPerPixel);
+
+        const FilterKernels *generic = genericFilterKernels(layout.bytesPerPixel);
+        std::vector<uint8_t> unfiltered = filtered;
+        unfilterImage(generic, unfiltered, scanlineLen);
+        std::vector<uint8_t> refiltered = unfiltered;
+        refilterImage(generic, refiltered, unfiltered, scanlineLen);
+
+        const FilterKernels *candidates[] = {
+            generic,
+            filterKernelsFor(FILTER_ISA_SCALAR, layout.bytesPerPixel),
+            filterKernels(layout.bytesPerPixel)
+        };
+
+        double baseUnfilterMs = 0;
+        double baseRefilterMs = 0;
+        for (const FilterKernels *kernels : candidates) {
+            double unfilterMs;
+            double refilterMs;
+            timeKernels(kernels, filtered, unfiltered, refiltered, scanlineLen, &unfilterMs, &refilterMs);
+
+            if (kernels == generic) {
+                baseUnfilterMs = unfilterMs;
+                baseRefilterMs = refilterMs;
+            }
+
+            printf("%-11s %-8s %12.2f %12.2f %9.2fx %9.2fx\n", layout.name, kernels->name, unfilterMs, refilterMs,
+                   baseUnfilterMs / unfilterMs, baseRefilterMs / refilterMs);
+        }
+    }
+
+    int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    printf("\nWhole-image refilter in row bands\n\n");
+    printf("%-11s %8s %12s %10s\n", "layout", "threads", "refilter ms", "speedup");
+
+    for (const ColourLayout& layout : layouts) {
+        size_t scanlineLen = (size_t) width * layout.bytesPerPixel + 1;
+        std::vector<uint8_t> filtered = makeFilteredImage(width, height, layout.bytesPerPixel);
+
+        const FilterKernels *generic = genericFilterKernels(layout.bytesPerPixel);
+        std::vector<uint8_t> unfiltered = filtered;
+        unfilterImage(generic, unfiltered, scanlineLen);
+        std::vector<uint8_t> refiltered = unfiltered;
+        refilterImage(generic, refiltered, unfiltered, scanlineLen);
+
+        double baseMs = 0;
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            double ms = timeBandRefilter(unfiltered, refiltered, filtered, scanlineLen, layout.bytesPerPixel, threads);
+            if (threads == 1) {
+                baseMs = ms;
+            }
+            printf("%-11s %8d %12.2f %9.2fx\n", layout.name, threads, ms, baseMs / ms);
+        }
+    }
+
+    benchCodecs(width, height, maxThreads);
+    benchBitPack(width, height);
+}
@@ -0,0 +1,230 @@
+#include <cstring>
+#include "bitpack.h"
+
+#if defined(__x86_64__)
+#define BITPACK_BMI2
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// The low bit of each of the eight samples in a word
+static const uint64_t SAMPLE_LSBS = 0x0101010101010101ULL;
+
+// Words are handled as little endian, so sample k is byte k of the word
+static inline uint64_t loadSamples(const uint8_t *samples) {
+    uint64_t word;
+    memcpy(&word, samples, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline void storeSamples(uint8_t *samples, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(samples, &word, sizeof(word));
+}
+
+// A group's K bytes as one big endian number, and back
+template <int K>
+static inline uint64_t loadGroupBytes(const uint8_t *bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < K; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+template <int K>
+static inline void storeGroupBytes(uint8_t *bytes, uint64_t value) {
+    for (int i = K - 1; i >= 0; i--) {
+        bytes[i] = value;
+        value >>= 8;
+    }
+}
+
+template <int K>
+void embedGroupsBitwise(uint8_t *samples, const uint8_t *bytes, size_t numGroups) {
+    for (size_t i = 0; i < numGroups * 8 * K; i++) {
+        int bit = (bytes[i / 8] >> (7 - (i % 8))) & 1;
+        int shift = K - 1 - (i % K);
+        samples[i / K] = (samples[i / K] & ~(1 << shift)) | (bit << shift);
+    }
+}
+
+template <int K>
+void extractGroupsBitwise(const uint8_t *samples, uint8_t *bytes, size_t numGroups) {
+    memset(bytes, 0, numGroups * K);
+    for (size_t i = 0; i < numGroups * 8 * K; i++) {
+        int bit = (samples[i / K] >> (K - 1 - (i % K))) & 1;
+        bytes[i / 8] |= bit << (7 - (i % 8));
+    }
+}
+
+// Each byte spread over the low bits of a word, most significant bit first
+struct SpreadTable {
+    uint64_t words[256];
+
+    SpreadTable() {
+        for (int byte = 0; byte < 256; byte++) {
+            uint64_t word = 0;
+            for (int k = 0; k < 8; k++) {
+                word |= (uint64_t) ((byte >> (7 - k)) & 1) << (8 * k);
+            }
+            words[byte] = word;
+        }
+    }
+};
+
+static const SpreadTable spreadTable;
+
+void embedGroupsPortable1(uint8_t *samples, const uint8_t *bytes, size_t numGroups) {
+    for (size_t i = 0; i < numGroups; i++, samples += 8) {
+        storeSamples(samples, (loadSamples(samples) & ~SAMPLE_LSBS) | spreadTable.words[bytes[i]]);
+    }
+}
+
+void extractGroupsPortable1(const uint8_t *samples, uint8_t *bytes, size_t numGroups) {
+    for (size_t i = 0; i < numGroups; i++, samples += 8) {
+        // Sample k's bit lands on bit 63 - k of the product, and no two
+        // partial products overlap, so there are no carries to spoil it
+        bytes[i] = ((loadSamples(samples) & SAMPLE_LSBS) * 0x8040201008040201ULL) >> 56;
+    }
+}
+
+// Deeper embedding moves each sample's K bits with a shift of the group
+// value, unrolled as K is fixed
+template <int K>
+void embedGroupsPortable(uint8_t *samples, const uint8_t *bytes, size_t numGroups) {
+    const uint64_t fieldMask = (1 << K) - 1;
+    const uint64_t laneMask = fieldMask * SAMPLE_LSBS;
+
+    for (size_t i = 0; i < numGroups; i++, samples += 8, bytes += K) {
+        uint64_t value = loadGroupBytes<K>(bytes);
+        uint64_t spread = 0;
+        for (int j = 0; j < 8; j++) {
+            spread |= ((value >> (K * (7 - j))) & fieldMask) << (8 * j);
+        }
+        storeSamples(samples, (loadSamples(samples) & ~laneMask) | spread);
+    }
+}
+
+template <int K>
+void extractGroupsPortable(const uint8_t *samples, uint8_t *bytes, size_t numGroups) {
+    const uint64_t fieldMask = (1 << K) - 1;
+
+    for (size_t i = 0; i < numGroups; i++, samples += 8, bytes += K) {
+        uint64_t word = loadSamples(samples);
+        uint64_t value = 0;
+        for (int j = 0; j < 8; j++) {
+            value = (value << K) | ((word >> (8 * j)) & fieldMask);
+        }
+        storeGroupBytes<K>(bytes, value);
+    }
+}
+
+#ifdef BITPACK_BMI2
+
+// pdep and pext work least significant bits first, so the word is byte
+// swapped to put the group's top bits in the first sample
+template <int K>
+__attribute__((target("bmi2")))
+void embedGroupsBMI2(uint8_t *samples, const uint8_t *bytes, size_t numGroups) {
+    const uint64_t laneMask = ((1 << K) - 1) * SAMPLE_LSBS;
+
+    for (size_t i = 0; i < numGroups; i++, samples += 8, bytes += K) {
+        uint64_t bits = __builtin_bswap64(_pdep_u64(loadGroupBytes<K>(bytes), laneMask));
+        storeSamples(samples, (loadSamples(samples) & ~laneMask) | bits);
+    }
+}
+
+template <int K>
+__attribute__((target("bmi2")))
+void extractGroupsBMI2(const uint8_t *samples, uint8_t *bytes, size_t numGroups) {
+    const uint64_t laneMask = ((1 << K) - 1) * SAMPLE_LSBS;
+
+    for (size_t i = 0; i < numGroups; i++, samples += 8, bytes += K) {
+        storeGroupBytes<K>(bytes, _pext_u64(__builtin_bswap64(loadSamples(samples)), laneMask));
+    }
+}
+
+#endif
+
+static const BitPackKernels bitwiseKernels = {
+    "bitwise",
+    {NULL, embedGroupsBitwise<1>, embedGroupsBitwise<2>, embedGroupsBitwise<3>, embedGroupsBitwise<4>},
+    {NULL, extractGroupsBitwise<1>, extractGroupsBitwise<2>, extractGroupsBitwise<3>, extractGroupsBitwise<4>}
+};
+
+static const BitPackKernels portableKernels = {
+    "portable",
+    {NULL, embedGroupsPortable1, embedGroupsPortable<2>, embedGroupsPortable<3>, embedGroupsPortable<4>},
+    {NULL, extractGroupsPortable1, extractGroupsPortable<2>, extractGroupsPortable<3>, extractGroupsPortable<4>}
+};
+
+#ifdef BITPACK_BMI2
+
+// AMD parts before Zen 3 (family 0x19) run pdep and pext as microcode, taking
+// hundreds of cycles, where Intel and later AMD take a few
+static bool pdepIsMicrocoded() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx) || ebx != signature_AMD_ebx || ecx != signature_AMD_ecx || edx != signature_AMD_edx) {
+        return false;
+    }
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return true;
+    }
+    unsigned int family = (eax >> 8) & 0xf;
+    if (family == 0xf) {
+        family += (eax >> 20) & 0xff;
+    }
+    return family < 0x19;
+}
+
+#endif
+
+const BitPackKernels *bitPackKernels() {
+    // pdep and pext pull ahead at two or more bits per sample, where the
+    // portable kernels shift each field separately. A single bit is one table
+    // lookup or multiply either way, so it stays portable.
+    static const BitPackKernels *kernels = []() {
+#ifdef BITPACK_BMI2
+        const BitPackKernels *bmi2 = bmi2BitPackKernels();
+        if (bmi2 != NULL && !pdepIsMicrocoded()) {
+            static const BitPackKernels mixedKernels = {
+                "auto",
+                {NULL, portableKernels.embed[1], bmi2->embed[2], bmi2->embed[3], bmi2->embed[4]},
+                {NULL, portableKernels.extract[1], bmi2->extract[2], bmi2->extract[3], bmi2->extract[4]}
+            };
+            return &mixedKernels;
+        }
+#endif
+        return &portableKernels;
+    }();
+    return kernels;
+}
+
+const BitPackKernels *bmi2BitPackKernels() {
+#ifdef BITPACK_BMI2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2")) {
+        static const BitPackKernels bmi2Kernels = {
+            "bmi2",
+            {NULL, embedGroupsBMI2<1>, embedGroupsBMI2<2>, embedGroupsBMI2<3>, embedGroupsBMI2<4>},
+            {NULL, extractGroupsBMI2<1>, extractGroupsBMI2<2>, extractGroupsBMI2<3>, extractGroupsBMI2<4>}
+        };
+        return &bmi2Kernels;
+    }
+#endif
+    return NULL;
+}
+
+const BitPackKernels *portableBitPackKernels() {
+    return &portableKernels;
+}
+
+const BitPackKernels *bitwiseBitPackKernels() {
+    return &bitwiseKernels;
+}
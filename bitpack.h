@@ -0,0 +1,30 @@
+#include <cstdint>
+#include <cstddef>
+#ifndef BITPACK_H
+#define BITPACK_H
+
+const int MAX_BITS_PER_SAMPLE = 4;
+
+// Move message bytes in and out of the low bits of samples a group at a
+// time. With k bits per sample a group is eight samples holding k bytes, and
+// the first sample takes the most significant bits.
+typedef void (*EmbedGroupsKernel)(uint8_t *samples, const uint8_t *bytes, size_t numGroups);
+typedef void (*ExtractGroupsKernel)(const uint8_t *samples, uint8_t *bytes, size_t numGroups);
+
+// Kernels indexed by bits per sample. Index 0 has no kernel.
+typedef struct BitPackKernels {
+    const char *name;
+    EmbedGroupsKernel embed[MAX_BITS_PER_SAMPLE + 1];
+    ExtractGroupsKernel extract[MAX_BITS_PER_SAMPLE + 1];
+} BitPackKernels;
+
+// Kernels the encoder and decoder use
+const BitPackKernels *bitPackKernels();
+// Word-at-a-time kernels that build anywhere
+const BitPackKernels *portableBitPackKernels();
+// pdep and pext versions, or NULL where the CPU lacks BMI2
+const BitPackKernels *bmi2BitPackKernels();
+// One bit per step, kept as the reference the others must match
+const BitPackKernels *bitwiseBitPackKernels();
+
+#endif
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "bufferpool.h"
+#include "stegoerror.h"
+
+// Past these a buffer handed back is freed instead of kept
+const size_t MAX_POOLED_BUFFERS = 16;
+const size_t MAX_POOLED_BYTES = 64 * 1024 * 1024;
+const size_t MAX_POOLED_STREAMS = 4;
+
+typedef struct BufferPool {
+    std::vector<std::vector<uint8_t>> buffers;
+    size_t bytes = 0;
+} BufferPool;
+
+// z_stream comes first, so a stream pointer handed out converts back
+typedef struct PooledStream {
+    z_stream stream;
+    bool isDeflate;
+    int level;
+    int windowBits;
+    int strategy;
+} PooledStream;
+
+struct StreamPool {
+    std::vector<PooledStream *> streams;
+
+    ~StreamPool() {
+        for (PooledStream *pooled : streams) {
+            if (pooled->isDeflate) {
+                deflateEnd(&pooled->stream);
+            } else {
+                inflateEnd(&pooled->stream);
+            }
+            delete pooled;
+        }
+    }
+};
+
+static thread_local BufferPool bufferPool;
+static thread_local StreamPool streamPool;
+
+void giveStream(PooledStream *pooled);
+
+std::vector<uint8_t> takeBuffer(size_t len) {
+    std::vector<std::vector<uint8_t>>& buffers = bufferPool.buffers;
+    if (len == 0) {
+        return std::vector<uint8_t>();
+    }
+
+    // The smallest buffer that fits, or failing that the largest, which
+    // grows in place
+    size_t best = buffers.size();
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (best == buffers.size()) {
+            best = i;
+            continue;
+        }
+
+        size_t capacity = buffers[i].capacity();
+        size_t bestCapacity = buffers[best].capacity();
+        bool fits = capacity >= len;
+        bool bestFits = bestCapacity >= len;
+        if ((fits && (!bestFits || capacity < bestCapacity)) || (!fits && !bestFits && capacity > bestCapacity)) {
+            best = i;
+        }
+    }
+
+    if (best == buffers.size()) {
+        return std::vector<uint8_t>(len);
+    }
+
+    std::vector<uint8_t> buffer = std::move(buffers[best]);
+    buffers.erase(buffers.begin() + best);
+    bufferPool.bytes -= buffer.capacity();
+    buffer.resize(len);
+    return buffer;
+}
+
+void giveBuffer(std::vector<uint8_t>&& buffer) {
+    size_t capacity = buffer.capacity();
+    if (capacity == 0 || bufferPool.buffers.size() >= MAX_POOLED_BUFFERS || bufferPool.bytes + capacity > MAX_POOLED_BYTES) {
+        return;
+    }
+
+    // Kept at full size, so taking it back never has to zero new bytes
+    buffer.resize(capacity);
+    bufferPool.bytes += capacity;
+    bufferPool.buffers.push_back(std::move(buffer));
+}
+
+PooledBuffer::PooledBuffer(size_t len, bool zeroed) : buffer(takeBuffer(len)) {
+    if (zeroed) {
+        memset(buffer.data(), 0, len);
+    }
+}
+
+PooledBuffer::~PooledBuffer() {
+    giveBuffer(std::move(buffer));
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept : buffer(std::move(other.buffer)) {
+    other.buffer = std::vector<uint8_t>();
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        giveBuffer(std::move(buffer));
+        buffer = std::move(other.buffer);
+        other.buffer = std::vector<uint8_t>();
+    }
+    return *this;
+}
+
+z_stream *takeDeflateStream(int level, int windowBits, int strategy) {
+    std::vector<PooledStream *>& streams = streamPool.streams;
+    for (size_t i = 0; i < streams.size(); i++) {
+        PooledStream *pooled = streams[i];
+        if (pooled->isDeflate && pooled->level == level && pooled->windowBits == windowBits && pooled->strategy == strategy) {
+            streams.erase(streams.begin() + i);
+            return &pooled->stream;
+        }
+    }
+
+    PooledStream *pooled = new PooledStream();
+    pooled->isDeflate = true;
+    pooled->level = level;
+    pooled->windowBits = windowBits;
+    pooled->strategy = strategy;
+
+    int ret = deflateInit2(&pooled->stream, level, Z_DEFLATED, windowBits, 8, strategy);
+    if (ret != Z_OK) {
+        delete pooled;
+        throw StegoError(std::string("Error with deflateInit2: ") + std::to_string(ret));
+    }
+    return &pooled->stream;
+}
+
+void giveDeflateStream(z_stream *stream) {
+    deflateReset(stream);
+    giveStream(reinterpret_cast<PooledStream *>(stream));
+}
+
+z_stream *takeInflateStream() {
+    std::vector<PooledStream *>& streams = streamPool.streams;
+    for (size_t i = 0; i < streams.size(); i++) {
+        if (!streams[i]->isDeflate) {
+            PooledStream *pooled = streams[i];
+            streams.erase(streams.begin() + i);
+            return &pooled->stream;
+        }
+    }
+
+    PooledStream *pooled = new PooledStream();
+    pooled->isDeflate = false;
+
+    int ret = inflateInit(&pooled->stream);
+    if (ret != Z_OK) {
+        delete pooled;
+        throw StegoError(std::string("Error with inflateInit: ") + std::to_string(ret));
+    }
+    return &pooled->stream;
+}
+
+void giveInflateStream(z_stream *stream) {
+    inflateReset(stream);
+    giveStream(reinterpret_cast<PooledStream *>(stream));
+}
+
+void giveStream(PooledStream *pooled) {
+    std::vector<PooledStream *>& streams = streamPool.streams;
+    if (streams.size() < MAX_POOLED_STREAMS) {
+        streams.push_back(pooled);
+        return;
+    }
+
+    // Full, so the oldest stream makes way for this one
+    PooledStream *oldest = streams.front();
+    streams.erase(streams.begin());
+    streams.push_back(pooled);
+    if (oldest->isDeflate) {
+        deflateEnd(&oldest->stream);
+    } else {
+        inflateEnd(&oldest->stream);
+    }
+    delete oldest;
+}
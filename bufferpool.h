@@ -0,0 +1,48 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <zlib.h>
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+// Buffers and zlib streams handed back after one image are kept for the
+// next image on the same thread, so a worker processing a steady stream of
+// similarly sized images stops going to the heap. Each thread has pools of
+// its own, so nothing is locked, and pools are bounded so one huge image
+// does not pin its memory for the life of the thread.
+
+// A buffer of len bytes with whatever contents it last had
+std::vector<uint8_t> takeBuffer(size_t len);
+void giveBuffer(std::vector<uint8_t>&& buffer);
+
+// A buffer from the pool that goes back to it when it goes out of scope.
+// Moving one moves its buffer, so rows can be swapped without copying.
+class PooledBuffer {
+public:
+    explicit PooledBuffer(size_t len, bool zeroed = false);
+    ~PooledBuffer();
+
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    uint8_t *data() {
+        return buffer.data();
+    }
+    size_t size() const {
+        return buffer.size();
+    }
+
+private:
+    std::vector<uint8_t> buffer;
+};
+
+// Initialised streams, reset before they are handed out. A stream that
+// failed part way through can be given back, as resetting clears it.
+z_stream *takeDeflateStream(int level, int windowBits, int strategy);
+void giveDeflateStream(z_stream *stream);
+z_stream *takeInflateStream();
+void giveInflateStream(z_stream *stream);
+
+#endif
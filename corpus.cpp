@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+#include "corpus.h"
+#include "filter.h"
+#include "pngfile.h"
+#include "stegoerror.h"
+
+static const uint8_t PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+std::vector<uint8_t> makeCorpusPixels(const CorpusSpec& spec, size_t scanlineLen, int bytesPerPixel);
+void filterCorpusPixels(const CorpusSpec& spec, std::vector<uint8_t>& data, size_t scanlineLen, int bytesPerPixel);
+
+std::vector<CorpusSpec> corpusSpecs(bool large) {
+    std::vector<CorpusSpec> specs;
+
+    // Size sweep, RGBA with every filter type in turn
+    specs.push_back({"vga-rgba", 640, 480, 6, FILTER_MIX_CYCLE, 65536});
+    specs.push_back({"1080p-rgba", 1920, 1080, 6, FILTER_MIX_CYCLE, 65536});
+    specs.push_back({"4k-rgba", 3840, 2160, 6, FILTER_MIX_CYCLE, 65536});
+    if (large) {
+        specs.push_back({"24mp-rgba", 6000, 4000, 6, FILTER_MIX_CYCLE, 65536});
+        specs.push_back({"100mp-rgba", 12240, 8160, 6, FILTER_MIX_CYCLE, 65536});
+    }
+
+    // Colour types at 1080p
+    specs.push_back({"1080p-gray", 1920, 1080, 0, FILTER_MIX_CYCLE, 65536});
+    specs.push_back({"1080p-gray-alpha", 1920, 1080, 4, FILTER_MIX_CYCLE, 65536});
+    specs.push_back({"1080p-rgb", 1920, 1080, 2, FILTER_MIX_CYCLE, 65536});
+
+    // Filter mixes on 1080p RGB
+    static const char *filterNames[] = {"none", "sub", "up", "avg", "paeth"};
+    for (int filterType = 0; filterType < 5; filterType++) {
+        specs.push_back({std::string("1080p-rgb-") + filterNames[filterType], 1920, 1080, 2, filterType, 65536});
+    }
+    specs.push_back({"1080p-rgb-adaptive", 1920, 1080, 2, FILTER_MIX_ADAPTIVE, 65536});
+
+    // IDAT chunking on 1080p RGB, from many small chunks to a single one
+    specs.push_back({"1080p-rgb-idat8k", 1920, 1080, 2, FILTER_MIX_CYCLE, 8192});
+    specs.push_back({"1080p-rgb-idat1m", 1920, 1080, 2, FILTER_MIX_CYCLE, 1024 * 1024});
+    specs.push_back({"1080p-rgb-idat1", 1920, 1080, 2, FILTER_MIX_CYCLE, 0});
+
+    return specs;
+}
+
+std::vector<uint8_t> makeCorpusPNG(const CorpusSpec& spec) {
+    int bytesPerPixel = corpusBytesPerPixel(spec.colourType);
+    size_t scanlineLen = (size_t) spec.width * bytesPerPixel + 1;
+
+    std::vector<uint8_t> data = makeCorpusPixels(spec, scanlineLen, bytesPerPixel);
+    filterCorpusPixels(spec, data, scanlineLen, bytesPerPixel);
+
+    uLongf compressedLen = compressBound(data.size());
+    std::vector<uint8_t> compressedData(compressedLen);
+    if (compress2(compressedData.data(), &compressedLen, data.data(), data.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+        throw StegoError("Could not compress the " + spec.name + " corpus image");
+    }
+
+    uint8_t header[13];
+    header[0] = spec.width >> 24;
+    header[1] = spec.width >> 16;
+    header[2] = spec.width >> 8;
+    header[3] = spec.width;
+    header[4] = spec.height >> 24;
+    header[5] = spec.height >> 16;
+    header[6] = spec.height >> 8;
+    header[7] = spec.height;
+    header[8] = 8;
+    header[9] = spec.colourType;
+    // Deflate compression, adaptive filtering, no interlacing
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+
+    std::vector<uint8_t> png;
+    PNGWriter writer(&png, spec.IDATSize == 0 ? std::max((size_t) compressedLen, (size_t) 1) : spec.IDATSize);
+    writer.copyBytes(PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+    writer.writeChunk("IHDR", header, sizeof(header));
+    writer.writeIDATs(compressedData.data(), compressedLen);
+    writer.writeChunk("IEND", NULL, 0);
+    return png;
+}
+
+const char *filterMixName(int filterMix) {
+    static const char *names[] = {"none", "sub", "up", "avg", "paeth", "cycle", "adaptive"};
+    return names[filterMix];
+}
+
+int corpusBytesPerPixel(int colourType) {
+    switch (colourType) {
+        case 0:
+            return 1;
+        case 2:
+            return 3;
+        case 4:
+            return 2;
+        case 6:
+            return 4;
+        default:
+            throw StegoError("Corpus images are gray, RGB, gray+alpha or RGBA");
+    }
+}
+
+// Unfiltered rows of diagonal gradients, a different slope per channel,
+// plus low-bit noise from a generator seeded by the size and layout
+std::vector<uint8_t> makeCorpusPixels(const CorpusSpec& spec, size_t scanlineLen, int bytesPerPixel) {
+    std::vector<uint8_t> data(scanlineLen * spec.height);
+
+    uint32_t seed = spec.width * 2654435761u ^ spec.height * 40503u ^ spec.colourType;
+    for (uint32_t row = 0; row < spec.height; row++) {
+        uint8_t *scanline = &data[row * scanlineLen];
+        scanline[0] = 0;
+        for (size_t i = 1; i < scanlineLen; i++) {
+            size_t x = (i - 1) / bytesPerPixel;
+            int channel = (i - 1) % bytesPerPixel;
+            seed = seed * 1103515245 + 12345;
+            scanline[i] = (x * (channel + 1) + row * (3 - channel % 3)) / 16 + ((seed >> 16) & 3);
+        }
+    }
+    return data;
+}
+
+void filterCorpusPixels(const CorpusSpec& spec, std::vector<uint8_t>& data, size_t scanlineLen, int bytesPerPixel) {
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
+    std::vector<uint8_t> origScanline(scanlineLen);
+    std::vector<uint8_t> origPrevScanline(scanlineLen, 0);
+    std::vector<uint8_t> candidate(scanlineLen);
+
+    // Top down, keeping each row unfiltered for the row below
+    for (uint32_t row = 0; row < spec.height; row++) {
+        uint8_t *scanline = &data[row * scanlineLen];
+        memcpy(origScanline.data(), scanline, scanlineLen);
+
+        if (spec.filterMix == FILTER_MIX_ADAPTIVE) {
+            adaptiveFilterScanline(kernels, scanline, origScanline.data(), origPrevScanline.data(), candidate.data(), scanlineLen);
+        } else {
+            scanline[0] = spec.filterMix == FILTER_MIX_CYCLE ? row % 5 : spec.filterMix;
+            refilterScanline(kernels, scanline, origScanline.data(), origPrevScanline.data(), scanlineLen);
+        }
+
+        std::swap(origScanline, origPrevScanline);
+    }
+}
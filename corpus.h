@@ -0,0 +1,36 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#ifndef CORPUS_H
+#define CORPUS_H
+
+// Filter mixes beyond the five single PNG filter types 0 to 4
+const int FILTER_MIX_CYCLE = 5;
+const int FILTER_MIX_ADAPTIVE = 6;
+
+// One synthetic image. The same spec always gives the same bytes.
+typedef struct CorpusSpec {
+    std::string name;
+    uint32_t width;
+    uint32_t height;
+    int colourType;
+    // A single filter type for every row, rows cycling through all five, or
+    // each row's best filter by minimum sum of absolute differences
+    int filterMix;
+    // Largest IDAT chunk, 0 for the whole stream in one chunk
+    size_t IDATSize;
+} CorpusSpec;
+
+// Sizes from VGA to 4K, each colour type, each filter mix and a range of
+// IDAT chunk sizes. With large set, the size sweep goes on to 100 MP.
+std::vector<CorpusSpec> corpusSpecs(bool large);
+
+// 8-bit PNG of smooth gradients with a little noise, compressed at the
+// default zlib level
+std::vector<uint8_t> makeCorpusPNG(const CorpusSpec& spec);
+
+const char *filterMixName(int filterMix);
+int corpusBytesPerPixel(int colourType);
+
+#endif
@@ -0,0 +1,818 @@
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <future>
+#include "filter.h"
+#include "stegoerror.h"
+#include "threadpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FILTER_X86
+#include <immintrin.h>
+#endif
+
+void processFilter(std::vector<uint8_t>& data, size_t scanlineLen, int bytesPerPixel) {
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
+
+    // The row above the first scanline is treated as all zeroes
+    std::vector<uint8_t> zeroScanline(scanlineLen, 0);
+
+    for (size_t i = 0; i < data.size(); i += scanlineLen) {
+        const uint8_t *prevScanline = (i == 0) ? zeroScanline.data() : &data[i - scanlineLen];
+        unfilterScanline(kernels, &data[i], prevScanline, scanlineLen);
+    }
+}
+
+void unfilterScanline(const FilterKernels *kernels, uint8_t *scanline, const uint8_t *prevScanline, size_t scanlineLen) {
+    // Skip over the filter byte of both lines
+    uint8_t *line = scanline + 1;
+    const uint8_t *prevLine = prevScanline + 1;
+    size_t len = scanlineLen - 1;
+
+    switch (scanline[0]) {
+        case 0:
+            break;
+        case 1:
+        case 2:
+        case 3:
+        case 4:
+            kernels->unfilter[scanline[0]](line, prevLine, len, kernels->bytesPerPixel);
+            break;
+        default:
+            throw StegoError(std::string("Unimplemented filter type while unfiltering: ") + std::to_string(scanline[0]));
+    }
+}
+
+void processFilterSub(uint8_t *line, const uint8_t *, size_t len, int bytesPerPixel) {
+    // start on 2nd image pixel
+    for (size_t i = 0; i < len; i++) {
+        if (i < (size_t) bytesPerPixel) {
+            continue;
+        }
+
+        uint8_t prevPixel = line[i - bytesPerPixel];
+        line[i] += prevPixel;
+    }
+}
+
+void processFilterUp(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t prevPixelUp = prevLine[i];
+        line[i] += prevPixelUp;
+    }
+}
+
+void processFilterAvg(uint8_t *line, const uint8_t *prevLine, size_t len, int bytesPerPixel) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t average;
+        uint8_t prevPixelUp = prevLine[i];
+
+        if (i < (size_t) bytesPerPixel) {
+            average = prevPixelUp / 2;
+        } else {
+            uint8_t prevPixel = line[i - bytesPerPixel];
+            average = (prevPixel + prevPixelUp) / 2;
+        } 
+
+        line[i] += average;
+    }
+}
+
+uint8_t paethPredictor(uint8_t left, uint8_t above, uint8_t upperLeft) {
+    int p = left + above - upperLeft;
+    int pLeft = abs(p - left);
+    int pAbove = abs(p - above);
+    int pUpperLeft = abs(p - upperLeft);
+
+    if (pLeft <= pAbove && pLeft <= pUpperLeft) {
+        return left;
+    } else if (pAbove <= pUpperLeft) {
+        return above;
+    } else {
+        return upperLeft;
+    }
+}
+
+void processFilterPaeth(uint8_t *line, const uint8_t *prevLine, size_t len, int bytesPerPixel) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t prevPixel;
+        uint8_t prevPixelUpLeft;
+        uint8_t prevPixelUp = prevLine[i];
+
+        if (i < (size_t) bytesPerPixel) {
+            prevPixel = 0;
+            prevPixelUpLeft = 0;
+        } else {
+            prevPixel = line[i - bytesPerPixel];
+            prevPixelUpLeft = prevLine[i - bytesPerPixel];
+        }
+
+        line[i] += paethPredictor(prevPixel, prevPixelUp, prevPixelUpLeft);
+    }
+}
+
+void refilter(std::vector<uint8_t>& data, size_t scanlineLen, int bytesPerPixel, int threads) {
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
+    size_t numRows = data.size() / scanlineLen;
+    if (numRows == 0) {
+        return;
+    }
+
+    // Each row only needs itself and the row above as they were before
+    // refiltering, so rows are split into bands refiltered bottom up in
+    // place. The one row a band needs from the band above is saved first.
+    size_t numBands = std::min((size_t) std::max(threads, 1), numRows);
+    size_t bandRows = (numRows + numBands - 1) / numBands;
+    numBands = (numRows + bandRows - 1) / bandRows;
+
+    std::vector<uint8_t> edgeScanlines(numBands * scanlineLen, 0);
+    for (size_t band = 1; band < numBands; band++) {
+        memcpy(&edgeScanlines[band * scanlineLen], &data[(band * bandRows - 1) * scanlineLen], scanlineLen);
+    }
+
+    auto refilterBand = [&](size_t band) {
+        size_t firstRow = band * bandRows;
+        size_t endRow = std::min(firstRow + bandRows, numRows);
+        std::vector<uint8_t> origScanline(scanlineLen);
+
+        for (size_t row = endRow; row-- > firstRow;) {
+            uint8_t *scanline = &data[row * scanlineLen];
+            const uint8_t *origPrevScanline = (row == firstRow) ? &edgeScanlines[band * scanlineLen] : scanline - scanlineLen;
+            memcpy(origScanline.data(), scanline, scanlineLen);
+            refilterScanline(kernels, scanline, origScanline.data(), origPrevScanline, scanlineLen);
+        }
+    };
+
+    if (numBands == 1) {
+        refilterBand(0);
+        return;
+    }
+
+    std::vector<std::future<void>> bands;
+    for (size_t band = 0; band < numBands; band++) {
+        bands.push_back(ThreadPool::shared().submit([&refilterBand, band]() { refilterBand(band); }));
+    }
+    // Every band is waited for before any error is passed on, since they
+    // all share this frame
+    for (std::future<void>& result : bands) {
+        result.wait();
+    }
+    for (std::future<void>& result : bands) {
+        result.get();
+    }
+}
+
+void refilterScanline(const FilterKernels *kernels, uint8_t *scanline, const uint8_t *origScanline, const uint8_t *origPrevScanline, size_t scanlineLen) {
+    uint8_t *line = scanline + 1;
+    const uint8_t *origLine = origScanline + 1;
+    const uint8_t *origPrevLine = origPrevScanline + 1;
+    size_t len = scanlineLen - 1;
+
+    switch (scanline[0]) {
+        case 0:
+            break;
+        case 1:
+        case 2:
+        case 3:
+        case 4:
+            kernels->refilter[scanline[0]](line, origLine, origPrevLine, len, kernels->bytesPerPixel);
+            break;
+        default:
+            throw StegoError(std::string("Unimplemented filter type while refiltering: ") + std::to_string(scanline[0]));
+    }
+}
+
+void adaptiveFilterScanline(const FilterKernels *kernels, uint8_t *scanline, const uint8_t *origScanline, const uint8_t *origPrevScanline,
+                            uint8_t *candidate, size_t scanlineLen) {
+    uint64_t bestSum = UINT64_MAX;
+
+    for (uint8_t filterType = 0; filterType < 5; filterType++) {
+        memcpy(candidate, origScanline, scanlineLen);
+        candidate[0] = filterType;
+        refilterScanline(kernels, candidate, origScanline, origPrevScanline, scanlineLen);
+
+        // Bytes are summed as signed differences, so rows close to zero win
+        uint64_t sum = 0;
+        for (size_t i = 1; i < scanlineLen; i++) {
+            sum += abs((int8_t) candidate[i]);
+        }
+
+        if (sum < bestSum) {
+            bestSum = sum;
+            memcpy(scanline, candidate, scanlineLen);
+        }
+    }
+}
+
+void refilterSub(uint8_t *line, const uint8_t *origLine, const uint8_t *, size_t len, int bytesPerPixel) {
+    // start on 2nd image pixel
+    for (size_t i = 0; i < len; i++) {
+        if (i < (size_t) bytesPerPixel) {
+            continue;
+        }
+
+        uint8_t prevPixel = origLine[i - bytesPerPixel];
+        line[i] -= prevPixel;
+    }
+}
+
+void refilterUp(uint8_t *line, const uint8_t *, const uint8_t *origPrevLine, size_t len, int) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t prevPixelUp = origPrevLine[i];
+        line[i] -= prevPixelUp;
+    }
+}
+
+void refilterAvg(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int bytesPerPixel) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t average;
+        uint8_t prevPixelUp = origPrevLine[i];
+
+        if (i < (size_t) bytesPerPixel) {
+            average = prevPixelUp / 2;
+        } else {
+            uint8_t prevPixel = origLine[i - bytesPerPixel];
+            average = (prevPixel + prevPixelUp) / 2;
+        } 
+
+        line[i] -= average;
+    }
+}
+
+void refilterPaeth(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int bytesPerPixel) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t prevPixel;
+        uint8_t prevPixelUpLeft;
+        uint8_t prevPixelUp = origPrevLine[i];
+
+        if (i < (size_t) bytesPerPixel) {
+            prevPixel = 0;
+            prevPixelUpLeft = 0;
+        } else {
+            prevPixel = origLine[i - bytesPerPixel];
+            prevPixelUpLeft = origPrevLine[i - bytesPerPixel];
+        }
+
+        line[i] -= paethPredictor(prevPixel, prevPixelUp, prevPixelUpLeft);
+    }
+}
+
+// Kernels specialised on the bytes per pixel of the image. With the pixel
+// width known at compile time the loops can be unrolled and vectorised, and
+// the first pixel, which has no left neighbour, is handled before the main
+// loop instead of being tested for on every byte. That loop still stops at
+// len, so a row shorter than a pixel is never written past.
+
+template <int BPP>
+static void processFilterSub(uint8_t *line, const uint8_t *, size_t len, int) {
+    // start on 2nd image pixel
+    for (size_t i = BPP; i < len; i++) {
+        line[i] += line[i - BPP];
+    }
+}
+
+template <int BPP>
+static void processFilterUp(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    for (size_t i = 0; i < len; i++) {
+        line[i] += prevLine[i];
+    }
+}
+
+template <int BPP>
+static void processFilterAvg(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    for (size_t i = 0; i < std::min<size_t>(BPP, len); i++) {
+        line[i] += prevLine[i] / 2;
+    }
+
+    for (size_t i = BPP; i < len; i++) {
+        line[i] += (line[i - BPP] + prevLine[i]) / 2;
+    }
+}
+
+template <int BPP>
+static void processFilterPaeth(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    // With no left or upper left pixel the predictor is always the one above
+    for (size_t i = 0; i < std::min<size_t>(BPP, len); i++) {
+        line[i] += prevLine[i];
+    }
+
+    for (size_t i = BPP; i < len; i++) {
+        line[i] += paethPredictor(line[i - BPP], prevLine[i], prevLine[i - BPP]);
+    }
+}
+
+template <int BPP>
+static void refilterSub(uint8_t *line, const uint8_t *origLine, const uint8_t *, size_t len, int) {
+    // start on 2nd image pixel
+    for (size_t i = BPP; i < len; i++) {
+        line[i] -= origLine[i - BPP];
+    }
+}
+
+template <int BPP>
+static void refilterUp(uint8_t *line, const uint8_t *, const uint8_t *origPrevLine, size_t len, int) {
+    for (size_t i = 0; i < len; i++) {
+        line[i] -= origPrevLine[i];
+    }
+}
+
+template <int BPP>
+static void refilterAvg(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    for (size_t i = 0; i < std::min<size_t>(BPP, len); i++) {
+        line[i] -= origPrevLine[i] / 2;
+    }
+
+    for (size_t i = BPP; i < len; i++) {
+        line[i] -= (origLine[i - BPP] + origPrevLine[i]) / 2;
+    }
+}
+
+template <int BPP>
+static void refilterPaeth(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    // With no left or upper left pixel the predictor is always the one above
+    for (size_t i = 0; i < std::min<size_t>(BPP, len); i++) {
+        line[i] -= origPrevLine[i];
+    }
+
+    for (size_t i = BPP; i < len; i++) {
+        line[i] -= paethPredictor(origLine[i - BPP], origPrevLine[i], origPrevLine[i - BPP]);
+    }
+}
+
+#ifdef FILTER_X86
+
+// Unfiltering Avg and Paeth depends on the pixel just reconstructed to the
+// left, so the SIMD versions work one pixel at a time with all channels in
+// one register. That only beats the specialised scalar kernels for wide
+// pixels, and never for Sub, which the compiler already does well once the
+// pixel width is fixed. Refiltering has no such dependency and runs a full
+// register of bytes per step for any layout.
+
+// A 3 byte pixel is assembled byte by byte so it never touches memory past
+// its end. Copying it into a partly written word instead stalls on store
+// forwarding.
+template <int BPP>
+static inline __m128i loadPixel(const uint8_t *p) {
+    uint32_t v = 0;
+    if constexpr (BPP == 4) {
+        memcpy(&v, p, 4);
+    } else {
+        for (int i = 0; i < BPP; i++) {
+            v |= (uint32_t) p[i] << (8 * i);
+        }
+    }
+    return _mm_cvtsi32_si128(v);
+}
+
+template <int BPP>
+static inline void storePixel(uint8_t *p, __m128i v) {
+    uint32_t x = _mm_cvtsi128_si32(v);
+    if constexpr (BPP == 4) {
+        memcpy(p, &x, 4);
+    } else {
+        for (int i = 0; i < BPP; i++) {
+            p[i] = x >> (8 * i);
+        }
+    }
+}
+
+static inline __m128i select128(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Paeth choice on 16-bit lanes given the three distances, breaking ties in
+// favour of left, then above, then upper left like paethPredictor
+static inline __m128i paethSelect16(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc) {
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i aboveOrUpperLeft = select128(_mm_cmpeq_epi16(smallest, pb), b, c);
+    return select128(_mm_cmpeq_epi16(smallest, pa), a, aboveOrUpperLeft);
+}
+
+static inline __m128i abs16SSE2(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i abs16SSSE3(__m128i x) {
+    return _mm_abs_epi16(x);
+}
+
+static inline __m128i paeth16SSE2(__m128i a, __m128i b, __m128i c) {
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    return paethSelect16(a, b, c, abs16SSE2(pa), abs16SSE2(pb), abs16SSE2(pc));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i paeth16SSSE3(__m128i a, __m128i b, __m128i c) {
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    return paethSelect16(a, b, c, abs16SSSE3(pa), abs16SSSE3(pb), abs16SSSE3(pc));
+}
+
+// Average of two byte vectors rounded down, as the Avg filter needs
+static inline __m128i avgFloor128(__m128i a, __m128i b) {
+    __m128i roundedUp = _mm_avg_epu8(a, b);
+    return _mm_sub_epi8(roundedUp, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+template <int BPP>
+static void processFilterUpSSE2(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i filtered = _mm_loadu_si128((const __m128i *) (line + i));
+        __m128i above = _mm_loadu_si128((const __m128i *) (prevLine + i));
+        _mm_storeu_si128((__m128i *) (line + i), _mm_add_epi8(filtered, above));
+    }
+
+    processFilterUp<BPP>(line + i, prevLine + i, len - i, BPP);
+}
+
+template <int BPP>
+static void processFilterAvgSSE2(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    __m128i left = _mm_setzero_si128();
+    for (size_t i = 0; i < len; i += BPP) {
+        __m128i above = loadPixel<BPP>(prevLine + i);
+        left = _mm_add_epi8(loadPixel<BPP>(line + i), avgFloor128(left, above));
+        storePixel<BPP>(line + i, left);
+    }
+}
+
+template <int BPP>
+static void processFilterPaethSSE2(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lowByte = _mm_set1_epi16(0xFF);
+    __m128i left = zero;
+    __m128i upperLeft = zero;
+
+    for (size_t i = 0; i < len; i += BPP) {
+        __m128i above = _mm_unpacklo_epi8(loadPixel<BPP>(prevLine + i), zero);
+        __m128i filtered = _mm_unpacklo_epi8(loadPixel<BPP>(line + i), zero);
+
+        __m128i predicted = paeth16SSE2(left, above, upperLeft);
+        left = _mm_and_si128(_mm_add_epi16(filtered, predicted), lowByte);
+        storePixel<BPP>(line + i, _mm_packus_epi16(left, left));
+
+        upperLeft = above;
+    }
+}
+
+template <int BPP>
+__attribute__((target("ssse3")))
+static void processFilterPaethSSSE3(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lowByte = _mm_set1_epi16(0xFF);
+    __m128i left = zero;
+    __m128i upperLeft = zero;
+
+    for (size_t i = 0; i < len; i += BPP) {
+        __m128i above = _mm_unpacklo_epi8(loadPixel<BPP>(prevLine + i), zero);
+        __m128i filtered = _mm_unpacklo_epi8(loadPixel<BPP>(line + i), zero);
+
+        __m128i predicted = paeth16SSSE3(left, above, upperLeft);
+        left = _mm_and_si128(_mm_add_epi16(filtered, predicted), lowByte);
+        storePixel<BPP>(line + i, _mm_packus_epi16(left, left));
+
+        upperLeft = above;
+    }
+}
+
+template <int BPP>
+__attribute__((target("avx2")))
+static void processFilterUpAVX2(uint8_t *line, const uint8_t *prevLine, size_t len, int) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i filtered = _mm256_loadu_si256((const __m256i *) (line + i));
+        __m256i above = _mm256_loadu_si256((const __m256i *) (prevLine + i));
+        _mm256_storeu_si256((__m256i *) (line + i), _mm256_add_epi8(filtered, above));
+    }
+
+    processFilterUp<BPP>(line + i, prevLine + i, len - i, BPP);
+}
+
+// The refilter kernels below handle the first pixel, which has no left
+// neighbour, with the scalar kernel and vectorise the rest of the line.
+
+template <int BPP>
+static void refilterSubSSE2(uint8_t *line, const uint8_t *origLine, const uint8_t *, size_t len, int) {
+    size_t i = BPP;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (line + i));
+        __m128i left = _mm_loadu_si128((const __m128i *) (origLine + i - BPP));
+        _mm_storeu_si128((__m128i *) (line + i), _mm_sub_epi8(x, left));
+    }
+
+    for (; i < len; i++) {
+        line[i] -= origLine[i - BPP];
+    }
+}
+
+template <int BPP>
+static void refilterUpSSE2(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (line + i));
+        __m128i above = _mm_loadu_si128((const __m128i *) (origPrevLine + i));
+        _mm_storeu_si128((__m128i *) (line + i), _mm_sub_epi8(x, above));
+    }
+
+    refilterUp<BPP>(line + i, origLine + i, origPrevLine + i, len - i, BPP);
+}
+
+template <int BPP>
+static void refilterAvgSSE2(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    refilterAvg<BPP>(line, origLine, origPrevLine, std::min<size_t>(BPP, len), BPP);
+
+    size_t i = BPP;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (line + i));
+        __m128i left = _mm_loadu_si128((const __m128i *) (origLine + i - BPP));
+        __m128i above = _mm_loadu_si128((const __m128i *) (origPrevLine + i));
+        _mm_storeu_si128((__m128i *) (line + i), _mm_sub_epi8(x, avgFloor128(left, above)));
+    }
+
+    for (; i < len; i++) {
+        line[i] -= (origLine[i - BPP] + origPrevLine[i]) / 2;
+    }
+}
+
+static inline __m128i paethPredictSSE2(__m128i a, __m128i b, __m128i c) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = paeth16SSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i hi = paeth16SSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    return _mm_packus_epi16(lo, hi);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i paethPredictSSSE3(__m128i a, __m128i b, __m128i c) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = paeth16SSSE3(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i hi = paeth16SSSE3(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    return _mm_packus_epi16(lo, hi);
+}
+
+template <int BPP>
+static void refilterPaethSSE2(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    refilterPaeth<BPP>(line, origLine, origPrevLine, std::min<size_t>(BPP, len), BPP);
+
+    size_t i = BPP;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (line + i));
+        __m128i left = _mm_loadu_si128((const __m128i *) (origLine + i - BPP));
+        __m128i above = _mm_loadu_si128((const __m128i *) (origPrevLine + i));
+        __m128i upperLeft = _mm_loadu_si128((const __m128i *) (origPrevLine + i - BPP));
+        _mm_storeu_si128((__m128i *) (line + i), _mm_sub_epi8(x, paethPredictSSE2(left, above, upperLeft)));
+    }
+
+    for (; i < len; i++) {
+        line[i] -= paethPredictor(origLine[i - BPP], origPrevLine[i], origPrevLine[i - BPP]);
+    }
+}
+
+template <int BPP>
+__attribute__((target("ssse3")))
+static void refilterPaethSSSE3(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    refilterPaeth<BPP>(line, origLine, origPrevLine, std::min<size_t>(BPP, len), BPP);
+
+    size_t i = BPP;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (line + i));
+        __m128i left = _mm_loadu_si128((const __m128i *) (origLine + i - BPP));
+        __m128i above = _mm_loadu_si128((const __m128i *) (origPrevLine + i));
+        __m128i upperLeft = _mm_loadu_si128((const __m128i *) (origPrevLine + i - BPP));
+        _mm_storeu_si128((__m128i *) (line + i), _mm_sub_epi8(x, paethPredictSSSE3(left, above, upperLeft)));
+    }
+
+    for (; i < len; i++) {
+        line[i] -= paethPredictor(origLine[i - BPP], origPrevLine[i], origPrevLine[i - BPP]);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i select256(__m256i mask, __m256i a, __m256i b) {
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avgFloor256(__m256i a, __m256i b) {
+    __m256i roundedUp = _mm256_avg_epu8(a, b);
+    return _mm256_sub_epi8(roundedUp, _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i paeth16AVX2(__m256i a, __m256i b, __m256i c) {
+    __m256i pa = _mm256_sub_epi16(b, c);
+    __m256i pb = _mm256_sub_epi16(a, c);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+    pa = _mm256_abs_epi16(pa);
+    pb = _mm256_abs_epi16(pb);
+
+    __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+    __m256i aboveOrUpperLeft = select256(_mm256_cmpeq_epi16(smallest, pb), b, c);
+    return select256(_mm256_cmpeq_epi16(smallest, pa), a, aboveOrUpperLeft);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i paethPredictAVX2(__m256i a, __m256i b, __m256i c) {
+    // unpack and pack both work within 128-bit lanes, so byte order survives
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = paeth16AVX2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+    __m256i hi = paeth16AVX2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+    return _mm256_packus_epi16(lo, hi);
+}
+
+template <int BPP>
+__attribute__((target("avx2")))
+static void refilterSubAVX2(uint8_t *line, const uint8_t *origLine, const uint8_t *, size_t len, int) {
+    size_t i = BPP;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (line + i));
+        __m256i left = _mm256_loadu_si256((const __m256i *) (origLine + i - BPP));
+        _mm256_storeu_si256((__m256i *) (line + i), _mm256_sub_epi8(x, left));
+    }
+
+    for (; i < len; i++) {
+        line[i] -= origLine[i - BPP];
+    }
+}
+
+template <int BPP>
+__attribute__((target("avx2")))
+static void refilterUpAVX2(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (line + i));
+        __m256i above = _mm256_loadu_si256((const __m256i *) (origPrevLine + i));
+        _mm256_storeu_si256((__m256i *) (line + i), _mm256_sub_epi8(x, above));
+    }
+
+    refilterUp<BPP>(line + i, origLine + i, origPrevLine + i, len - i, BPP);
+}
+
+template <int BPP>
+__attribute__((target("avx2")))
+static void refilterAvgAVX2(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    refilterAvg<BPP>(line, origLine, origPrevLine, std::min<size_t>(BPP, len), BPP);
+
+    size_t i = BPP;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (line + i));
+        __m256i left = _mm256_loadu_si256((const __m256i *) (origLine + i - BPP));
+        __m256i above = _mm256_loadu_si256((const __m256i *) (origPrevLine + i));
+        _mm256_storeu_si256((__m256i *) (line + i), _mm256_sub_epi8(x, avgFloor256(left, above)));
+    }
+
+    for (; i < len; i++) {
+        line[i] -= (origLine[i - BPP] + origPrevLine[i]) / 2;
+    }
+}
+
+template <int BPP>
+__attribute__((target("avx2")))
+static void refilterPaethAVX2(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int) {
+    refilterPaeth<BPP>(line, origLine, origPrevLine, std::min<size_t>(BPP, len), BPP);
+
+    size_t i = BPP;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (line + i));
+        __m256i left = _mm256_loadu_si256((const __m256i *) (origLine + i - BPP));
+        __m256i above = _mm256_loadu_si256((const __m256i *) (origPrevLine + i));
+        __m256i upperLeft = _mm256_loadu_si256((const __m256i *) (origPrevLine + i - BPP));
+        _mm256_storeu_si256((__m256i *) (line + i), _mm256_sub_epi8(x, paethPredictAVX2(left, above, upperLeft)));
+    }
+
+    for (; i < len; i++) {
+        line[i] -= paethPredictor(origLine[i - BPP], origPrevLine[i], origPrevLine[i - BPP]);
+    }
+}
+
+#endif
+
+static FilterISA detectFilterISA() {
+#ifdef FILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FILTER_ISA_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return FILTER_ISA_SSSE3;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return FILTER_ISA_SSE2;
+    }
+#endif
+    return FILTER_ISA_SCALAR;
+}
+
+// Builds the kernel tables for one pixel width
+template <int BPP>
+static const FilterKernels *kernelsForLayout(FilterISA isa) {
+    static const FilterKernels scalarKernels = {
+        FILTER_ISA_SCALAR, "scalar", BPP,
+        {NULL, processFilterSub<BPP>, processFilterUp<BPP>, processFilterAvg<BPP>, processFilterPaeth<BPP>},
+        {NULL, refilterSub<BPP>, refilterUp<BPP>, refilterAvg<BPP>, refilterPaeth<BPP>}
+    };
+
+#ifdef FILTER_X86
+    // Where per-pixel unfiltering beats the scalar kernels, as measured by
+    // stegopng_bench
+    const bool avgSIMD = BPP == 4;
+    const bool paethSIMD = BPP >= 3;
+
+    static const FilterKernels sse2Kernels = {
+        FILTER_ISA_SSE2, "sse2", BPP,
+        {NULL,
+         processFilterSub<BPP>,
+         processFilterUpSSE2<BPP>,
+         avgSIMD ? processFilterAvgSSE2<BPP> : processFilterAvg<BPP>,
+         paethSIMD ? processFilterPaethSSE2<BPP> : processFilterPaeth<BPP>},
+        {NULL, refilterSubSSE2<BPP>, refilterUpSSE2<BPP>, refilterAvgSSE2<BPP>, refilterPaethSSE2<BPP>}
+    };
+
+    static const FilterKernels ssse3Kernels = {
+        FILTER_ISA_SSSE3, "ssse3", BPP,
+        {NULL,
+         sse2Kernels.unfilter[1],
+         sse2Kernels.unfilter[2],
+         sse2Kernels.unfilter[3],
+         paethSIMD ? processFilterPaethSSSE3<BPP> : processFilterPaeth<BPP>},
+        {NULL, refilterSubSSE2<BPP>, refilterUpSSE2<BPP>, refilterAvgSSE2<BPP>, refilterPaethSSSE3<BPP>}
+    };
+
+    // Per-pixel unfiltering gains nothing from wider registers, so AVX2 only
+    // replaces the kernels that work across the whole line
+    static const FilterKernels avx2Kernels = {
+        FILTER_ISA_AVX2, "avx2", BPP,
+        {NULL,
+         ssse3Kernels.unfilter[1],
+         processFilterUpAVX2<BPP>,
+         ssse3Kernels.unfilter[3],
+         ssse3Kernels.unfilter[4]},
+        {NULL, refilterSubAVX2<BPP>, refilterUpAVX2<BPP>, refilterAvgAVX2<BPP>, refilterPaethAVX2<BPP>}
+    };
+
+    switch (isa) {
+        case FILTER_ISA_AVX2:
+            return &avx2Kernels;
+        case FILTER_ISA_SSSE3:
+            return &ssse3Kernels;
+        case FILTER_ISA_SSE2:
+            return &sse2Kernels;
+        default:
+            break;
+    }
+#endif
+
+    return &scalarKernels;
+}
+
+const FilterKernels *filterKernelsFor(FilterISA isa, int bytesPerPixel) {
+    static const FilterISA supported = detectFilterISA();
+    if (isa > supported) {
+        isa = supported;
+    }
+
+    switch (bytesPerPixel) {
+        case 1:
+            return kernelsForLayout<1>(isa);
+        case 2:
+            return kernelsForLayout<2>(isa);
+        case 3:
+            return kernelsForLayout<3>(isa);
+        case 4:
+            return kernelsForLayout<4>(isa);
+        default:
+            throw StegoError(std::string("Unsupported bytes per pixel: ") + std::to_string(bytesPerPixel));
+    }
+}
+
+const FilterKernels *filterKernels(int bytesPerPixel) {
+    return filterKernelsFor(FILTER_ISA_AVX2, bytesPerPixel);
+}
+
+const FilterKernels *genericFilterKernels(int bytesPerPixel) {
+    static const FilterKernels kernels[] = {
+        {FILTER_ISA_SCALAR, "generic", 1,
+         {NULL, processFilterSub, processFilterUp, processFilterAvg, processFilterPaeth},
+         {NULL, refilterSub, refilterUp, refilterAvg, refilterPaeth}},
+        {FILTER_ISA_SCALAR, "generic", 2,
+         {NULL, processFilterSub, processFilterUp, processFilterAvg, processFilterPaeth},
+         {NULL, refilterSub, refilterUp, refilterAvg, refilterPaeth}},
+        {FILTER_ISA_SCALAR, "generic", 3,
+         {NULL, processFilterSub, processFilterUp, processFilterAvg, processFilterPaeth},
+         {NULL, refilterSub, refilterUp, refilterAvg, refilterPaeth}},
+        {FILTER_ISA_SCALAR, "generic", 4,
+         {NULL, processFilterSub, processFilterUp, processFilterAvg, processFilterPaeth},
+         {NULL, refilterSub, refilterUp, refilterAvg, refilterPaeth}}
+    };
+
+    if (bytesPerPixel < 1 || bytesPerPixel > 4) {
+        throw StegoError(std::string("Unsupported bytes per pixel: ") + std::to_string(bytesPerPixel));
+    }
+    return &kernels[bytesPerPixel - 1];
+}
@@ -0,0 +1,60 @@
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#ifndef FILTER_H
+#define FILTER_H
+
+typedef void (*UnfilterKernel)(uint8_t *line, const uint8_t *prevLine, size_t len, int bytesPerPixel);
+typedef void (*RefilterKernel)(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int bytesPerPixel);
+
+// Instruction sets the filter kernels are built for, in increasing order
+enum FilterISA {
+    FILTER_ISA_SCALAR = 0,
+    FILTER_ISA_SSE2,
+    FILTER_ISA_SSSE3,
+    FILTER_ISA_AVX2
+};
+
+// Unfilter and refilter kernels for one pixel width, indexed by PNG filter
+// type. Type 0 (None) has no kernel.
+typedef struct FilterKernels {
+    FilterISA isa;
+    const char *name;
+    int bytesPerPixel;
+    UnfilterKernel unfilter[5];
+    RefilterKernel refilter[5];
+} FilterKernels;
+
+// Best kernels the running CPU supports, specialised for the pixel width.
+// Looked up once per image.
+const FilterKernels *filterKernels(int bytesPerPixel);
+// Kernels for a specific instruction set, capped at what the CPU supports
+const FilterKernels *filterKernelsFor(FilterISA isa, int bytesPerPixel);
+// The scalar kernels that take the pixel width at runtime, kept as the
+// reference the specialised ones must match
+const FilterKernels *genericFilterKernels(int bytesPerPixel);
+
+void processFilter(std::vector<uint8_t>& data, size_t scanlineLen, int bytesPerPixel);
+void unfilterScanline(const FilterKernels *kernels, uint8_t *scanline, const uint8_t *prevScanline, size_t scanlineLen);
+void processFilterSub(uint8_t *line, const uint8_t *prevLine, size_t len, int bytesPerPixel);
+void processFilterUp(uint8_t *line, const uint8_t *prevLine, size_t len, int bytesPerPixel);
+void processFilterAvg(uint8_t *line, const uint8_t *prevLine, size_t len, int bytesPerPixel);
+uint8_t paethPredictor(uint8_t left, uint8_t above, uint8_t upperLeft);
+void processFilterPaeth(uint8_t *line, const uint8_t *prevLine, size_t len, int bytesPerPixel);
+
+// Refilters a whole image of unfiltered rows, split into row bands across
+// the shared thread pool when given more than one thread. Only the benchmark
+// holds whole images; the encoder refilters the rows it streams in bands of
+// its own, see refilterBand in stego.cpp.
+void refilter(std::vector<uint8_t>& data, size_t scanlineLen, int bytesPerPixel, int threads = 1);
+void refilterScanline(const FilterKernels *kernels, uint8_t *scanline, const uint8_t *origScanline, const uint8_t *origPrevScanline, size_t scanlineLen);
+// Filters an unfiltered row with whichever type gives the minimum sum of
+// absolute differences, using candidate as scratch space for the trials
+void adaptiveFilterScanline(const FilterKernels *kernels, uint8_t *scanline, const uint8_t *origScanline, const uint8_t *origPrevScanline,
+                            uint8_t *candidate, size_t scanlineLen);
+void refilterSub(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int bytesPerPixel);
+void refilterUp(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int bytesPerPixel);
+void refilterAvg(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int bytesPerPixel);
+void refilterPaeth(uint8_t *line, const uint8_t *origLine, const uint8_t *origPrevLine, size_t len, int bytesPerPixel);
+
+#endif
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "protocol.h"
+
+// Drives a running stegopng server from several connections at once and
+// reports request latency percentiles:
+//   stegopng_load <socket> <encode|decode> <image> [connections] [requests per connection]
+// Encodes write to <image>.load<connection>.png.
+
+typedef struct ConnectionStats {
+    std::vector<double> latenciesMs;
+    size_t numErrors;
+    std::string firstError;
+} ConnectionStats;
+
+int connectToServer(const char *socketPath) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *) &address, sizeof(address)) < 0) {
+        fprintf(stderr, "Could not connect to %s: %s\n", socketPath, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+void runConnection(const char *socketPath, const BatchJob& job, int numRequests, ConnectionStats *stats) {
+    int fd = connectToServer(socketPath);
+    std::vector<uint8_t> request = encodeRequest(job);
+    std::vector<uint8_t> response;
+
+    for (int i = 0; i < numRequests; i++) {
+        auto start = std::chrono::steady_clock::now();
+        writeFrame(fd, request);
+        if (!readFrame(fd, &response)) {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(1);
+        }
+        auto end = std::chrono::steady_clock::now();
+        stats->latenciesMs.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+
+        BatchResult result = decodeResponse(response);
+        if (!result.ok) {
+            if (stats->numErrors == 0) {
+                stats->firstError = result.error;
+            }
+            stats->numErrors++;
+        }
+    }
+
+    close(fd);
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t index = std::min(sorted.size() - 1, (size_t) (p / 100 * sorted.size()));
+    return sorted[index];
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <socket> <encode|decode> <image> [connections] [requests per connection]\n", argv[0]);
+        return 1;
+    }
+
+    const char *socketPath = argv[1];
+    std::string op = argv[2];
+    // The server resolves paths from its own working directory
+    std::string image = std::filesystem::absolute(argv[3]).string();
+    int numConnections = argc > 4 ? std::stoi(argv[4]) : 4;
+    int numRequests = argc > 5 ? std::stoi(argv[5]) : 100;
+
+    std::vector<ConnectionStats> stats(numConnections, {{}, 0, ""});
+    std::vector<std::thread> connections;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < numConnections; c++) {
+        BatchJob job;
+        job.lineNum = 0;
+        job.mode = op == "encode" ? ENCODE : DECODE;
+        job.encodingOption = PLAINTEXT_MODE;
+        job.inputFile = image;
+        if (job.mode == ENCODE) {
+            job.message = "load test " + std::to_string(c);
+            job.outputFile = image + ".load" + std::to_string(c) + ".png";
+        }
+
+        connections.emplace_back(runConnection, socketPath, job, numRequests, &stats[c]);
+    }
+    for (std::thread& connection : connections) {
+        connection.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::vector<double> latencies;
+    size_t numErrors = 0;
+    for (const ConnectionStats& connection : stats) {
+        latencies.insert(latencies.end(), connection.latenciesMs.begin(), connection.latenciesMs.end());
+        if (connection.numErrors > 0 && numErrors == 0) {
+            fprintf(stderr, "First error: %s\n", connection.firstError.c_str());
+        }
+        numErrors += connection.numErrors;
+    }
+    if (latencies.empty()) {
+        return 0;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("%zu %s requests over %d connections, %zu errors\n", latencies.size(), op.c_str(), numConnections, numErrors);
+    printf("%.1f requests/s\n", latencies.size() / seconds);
+    printf("p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  max %.3f ms\n", percentile(latencies, 50), percentile(latencies, 90),
+           percentile(latencies, 99), latencies.back());
+    return numErrors == 0 ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include "pdeflate.h"
+#include "bufferpool.h"
+#include "stegoerror.h"
+
+void submitDeflateBlock(ParallelDeflater *deflater, bool last);
+void writeDeflatedBlock(ParallelDeflater *deflater);
+DeflatedBlock deflateBlock(const std::vector<uint8_t>& input, const std::vector<uint8_t>& dictionary, int level, int strategy, bool last);
+void zlibHeader(int level, int strategy, uint8_t header[2]);
+void writeStoredBlockHeader(StoredDeflater *deflater);
+void writeAdlerTrailer(DeflateSink& sink, uLong adler);
+
+void initParallelDeflater(ParallelDeflater *deflater, ThreadPool *pool, int threads, int level, int strategy, DeflateSink sink) {
+    deflater->pool = pool;
+    deflater->level = level;
+    deflater->strategy = strategy;
+    // Keep the pool busy while finished blocks are being written out
+    deflater->maxInFlight = 2 * (size_t) std::max(threads, 1);
+    deflater->sink = sink;
+    deflater->block.clear();
+    deflater->block.reserve(PARALLEL_DEFLATE_BLOCK_SIZE);
+    deflater->dictionary.clear();
+    deflater->pending.clear();
+    deflater->adler = adler32(0, NULL, 0);
+
+    uint8_t header[2];
+    zlibHeader(level, strategy, header);
+    deflater->sink(header, sizeof(header));
+}
+
+void parallelDeflateWrite(ParallelDeflater *deflater, const uint8_t *data, size_t len) {
+    deflater->block.insert(deflater->block.end(), data, data + len);
+
+    if (deflater->block.size() >= PARALLEL_DEFLATE_BLOCK_SIZE) {
+        submitDeflateBlock(deflater, false);
+    }
+}
+
+void finishParallelDeflater(ParallelDeflater *deflater) {
+    submitDeflateBlock(deflater, true);
+
+    while (!deflater->pending.empty()) {
+        writeDeflatedBlock(deflater);
+    }
+
+    writeAdlerTrailer(deflater->sink, deflater->adler);
+}
+
+void writeAdlerTrailer(DeflateSink& sink, uLong adler) {
+    uint32_t adlerBigEndian = __builtin_bswap32((uint32_t) adler);
+    sink(reinterpret_cast<uint8_t *>(&adlerBigEndian), sizeof(adlerBigEndian));
+}
+
+void submitDeflateBlock(ParallelDeflater *deflater, bool last) {
+    if (deflater->pending.size() >= deflater->maxInFlight) {
+        writeDeflatedBlock(deflater);
+    }
+
+    std::vector<uint8_t> dictionary = deflater->dictionary;
+    int level = deflater->level;
+    int strategy = deflater->strategy;
+
+    // The tail of this block primes the one after it
+    std::vector<uint8_t>& nextDictionary = deflater->dictionary;
+    nextDictionary.insert(nextDictionary.end(), deflater->block.begin(), deflater->block.end());
+    if (nextDictionary.size() > DEFLATE_WINDOW_SIZE) {
+        nextDictionary.erase(nextDictionary.begin(), nextDictionary.end() - DEFLATE_WINDOW_SIZE);
+    }
+
+    std::vector<uint8_t> block;
+    block.swap(deflater->block);
+    deflater->block.reserve(PARALLEL_DEFLATE_BLOCK_SIZE);
+
+    deflater->pending.push_back(deflater->pool->submit(
+        [block = std::move(block), dictionary = std::move(dictionary), level, strategy, last]() {
+            return deflateBlock(block, dictionary, level, strategy, last);
+        }));
+}
+
+void writeDeflatedBlock(ParallelDeflater *deflater) {
+    DeflatedBlock block = deflater->pending.front().get();
+    deflater->pending.pop_front();
+
+    deflater->adler = adler32_combine(deflater->adler, block.adler, block.inputLen);
+    deflater->sink(block.data.data(), block.data.size());
+}
+
+DeflatedBlock deflateBlock(const std::vector<uint8_t>& input, const std::vector<uint8_t>& dictionary, int level, int strategy, bool last) {
+    DeflatedBlock block;
+    block.adler = adler32(adler32(0, NULL, 0), input.data(), input.size());
+    block.inputLen = input.size();
+
+    // Negative window bits give raw deflate with no zlib header or trailer.
+    // Each worker thread keeps its stream between blocks, as setting one up
+    // costs far more than resetting it.
+    z_stream *deflateStream = takeDeflateStream(level, -15, strategy);
+
+    if (!dictionary.empty()) {
+        deflateSetDictionary(deflateStream, dictionary.data(), dictionary.size());
+    }
+
+    // Room for the sync flush marker on top of the worst case
+    block.data.resize(deflateBound(deflateStream, input.size()) + 16);
+
+    deflateStream->avail_in = input.size();
+    deflateStream->next_in = const_cast<uint8_t *>(input.data());
+    deflateStream->avail_out = block.data.size();
+    deflateStream->next_out = block.data.data();
+
+    // A sync flush ends the block on a byte boundary without marking it as
+    // the last, so the next block's raw deflate can follow straight on
+    int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+    int ret = deflate(deflateStream, flush);
+    bool failed = (last && ret != Z_STREAM_END) || (!last && ret != Z_OK) || deflateStream->avail_in != 0;
+    block.data.resize(block.data.size() - deflateStream->avail_out);
+    giveDeflateStream(deflateStream);
+    if (failed) {
+        throw StegoError(std::string("Error: deflate returned ") + std::to_string(ret));
+    }
+
+    return block;
+}
+
+void zlibHeader(int level, int strategy, uint8_t header[2]) {
+    if (level == Z_DEFAULT_COMPRESSION) {
+        level = 6;
+    }
+
+    // Deflate with a 32 KiB window, and the same level hint zlib would give
+    uint8_t levelFlags;
+    if (level < 2 || strategy >= Z_HUFFMAN_ONLY) {
+        levelFlags = 0;
+    } else if (level < 6) {
+        levelFlags = 1;
+    } else if (level == 6) {
+        levelFlags = 2;
+    } else {
+        levelFlags = 3;
+    }
+
+    header[0] = 0x78;
+    header[1] = levelFlags << 6;
+    // Check bits make the header a multiple of 31
+    header[1] += 31 - ((header[0] * 256 + header[1]) % 31);
+}
+
+std::vector<uint8_t> parallelDeflate(const uint8_t *data, size_t len, size_t scanlineLen, int threads, int level, int strategy) {
+    std::vector<uint8_t> compressedData;
+
+    ParallelDeflater deflater;
+    initParallelDeflater(&deflater, &ThreadPool::shared(), threads, level, strategy, [&compressedData](const uint8_t *out, size_t outLen) {
+        compressedData.insert(compressedData.end(), out, out + outLen);
+    });
+
+    for (size_t i = 0; i < len; i += scanlineLen) {
+        parallelDeflateWrite(&deflater, data + i, std::min(scanlineLen, len - i));
+    }
+
+    finishParallelDeflater(&deflater);
+    return compressedData;
+}
+
+void initStoredDeflater(StoredDeflater *deflater, size_t totalLen, DeflateSink sink) {
+    deflater->sink = sink;
+    deflater->remaining = totalLen;
+    deflater->blockRemaining = 0;
+    deflater->adler = adler32(0, NULL, 0);
+
+    uint8_t header[2];
+    zlibHeader(0, Z_DEFAULT_STRATEGY, header);
+    deflater->sink(header, sizeof(header));
+
+    // Even empty data needs one final block
+    if (totalLen == 0) {
+        writeStoredBlockHeader(deflater);
+    }
+}
+
+void storedDeflateWrite(StoredDeflater *deflater, const uint8_t *data, size_t len) {
+    if (len > deflater->remaining) {
+        throw StegoError("Error: more data written than the stored stream was sized for");
+    }
+
+    deflater->adler = adler32(deflater->adler, data, len);
+
+    while (len > 0) {
+        if (deflater->blockRemaining == 0) {
+            writeStoredBlockHeader(deflater);
+        }
+
+        size_t copyLen = std::min(len, deflater->blockRemaining);
+        deflater->sink(data, copyLen);
+        deflater->blockRemaining -= copyLen;
+        deflater->remaining -= copyLen;
+        data += copyLen;
+        len -= copyLen;
+    }
+}
+
+void finishStoredDeflater(StoredDeflater *deflater) {
+    if (deflater->remaining != 0 || deflater->blockRemaining != 0) {
+        throw StegoError(std::string("Error: stored stream ended ") + std::to_string(deflater->remaining) + " bytes short");
+    }
+
+    writeAdlerTrailer(deflater->sink, deflater->adler);
+}
+
+void writeStoredBlockHeader(StoredDeflater *deflater) {
+    uint16_t blockLen = std::min(deflater->remaining, STORED_BLOCK_MAX_SIZE);
+    bool last = blockLen == deflater->remaining;
+
+    // BFINAL then BTYPE 00 in the low bits, padded to a byte, followed by
+    // the length and its one's complement, both little endian
+    uint8_t header[5];
+    header[0] = last ? 1 : 0;
+    header[1] = blockLen & 0xFF;
+    header[2] = blockLen >> 8;
+    header[3] = ~blockLen & 0xFF;
+    header[4] = (uint16_t) ~blockLen >> 8;
+
+    deflater->sink(header, sizeof(header));
+    deflater->blockRemaining = blockLen;
+}
+
+std::vector<uint8_t> storedDeflate(const uint8_t *data, size_t len) {
+    std::vector<uint8_t> compressedData;
+    size_t numBlocks = std::max((size_t) 1, (len + STORED_BLOCK_MAX_SIZE - 1) / STORED_BLOCK_MAX_SIZE);
+    compressedData.reserve(2 + len + numBlocks * 5 + 4);
+
+    StoredDeflater deflater;
+    initStoredDeflater(&deflater, len, [&compressedData](const uint8_t *out, size_t outLen) {
+        compressedData.insert(compressedData.end(), out, out + outLen);
+    });
+    storedDeflateWrite(&deflater, data, len);
+    finishStoredDeflater(&deflater);
+    return compressedData;
+}
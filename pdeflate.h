@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <vector>
+#include <zlib.h>
+#include "threadpool.h"
+#ifndef PDEFLATE_H
+#define PDEFLATE_H
+
+// Input is cut into blocks of at least this many bytes, always on a write
+// boundary so blocks hold whole scanlines
+const size_t PARALLEL_DEFLATE_BLOCK_SIZE = 128 * 1024;
+// Deflate looks back at most 32 KiB, so that much of the previous block
+// primes the next one
+const size_t DEFLATE_WINDOW_SIZE = 32 * 1024;
+
+typedef std::function<void(const uint8_t *data, size_t len)> DeflateSink;
+
+typedef struct DeflatedBlock {
+    std::vector<uint8_t> data;
+    uLong adler;
+    size_t inputLen;
+} DeflatedBlock;
+
+// Builds one zlib stream pigz style: blocks are compressed independently on
+// a thread pool as raw deflate ending in a sync flush, each primed with the
+// tail of the block before, then joined in order behind a zlib header and
+// trailed by the adler32 of the whole input, combined from per-block sums.
+typedef struct ParallelDeflater {
+    ThreadPool *pool;
+    int level;
+    int strategy;
+    size_t maxInFlight;
+    DeflateSink sink;
+    std::vector<uint8_t> block;
+    std::vector<uint8_t> dictionary;
+    std::deque<std::future<DeflatedBlock>> pending;
+    uLong adler;
+} ParallelDeflater;
+
+void initParallelDeflater(ParallelDeflater *deflater, ThreadPool *pool, int threads, int level, int strategy, DeflateSink sink);
+void parallelDeflateWrite(ParallelDeflater *deflater, const uint8_t *data, size_t len);
+void finishParallelDeflater(ParallelDeflater *deflater);
+
+// Compresses a whole buffer of scanlines into one zlib stream
+std::vector<uint8_t> parallelDeflate(const uint8_t *data, size_t len, size_t scanlineLen, int threads, int level, int strategy);
+
+// Deflate stored blocks hold at most this many bytes
+const size_t STORED_BLOCK_MAX_SIZE = 65535;
+
+// Wraps data in a zlib stream of stored blocks without compressing it, for
+// images that are decoded straight away. The total length is known up front,
+// so each block header is written as soon as its first byte arrives and
+// the data is only copied once, into the sink.
+typedef struct StoredDeflater {
+    DeflateSink sink;
+    size_t remaining;
+    size_t blockRemaining;
+    uLong adler;
+} StoredDeflater;
+
+void initStoredDeflater(StoredDeflater *deflater, size_t totalLen, DeflateSink sink);
+void storedDeflateWrite(StoredDeflater *deflater, const uint8_t *data, size_t len);
+void finishStoredDeflater(StoredDeflater *deflater);
+
+std::vector<uint8_t> storedDeflate(const uint8_t *data, size_t len);
+
+#endif
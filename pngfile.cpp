@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "pngfile.h"
+#include "stegoerror.h"
+
+static const uint8_t PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+uint32_t readBigEndian32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+MappedPNG::MappedPNG(const char *path, StegoStats *stats) : mapped(NULL), mappedSize(0), isMapped(false) {
+    StageTimer timer(stats, STAGE_READ);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw StegoError(std::string("Could not open input file: ") + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        throw StegoError(std::string("Could not read input file: ") + path);
+    }
+    if ((size_t) info.st_size < sizeof(PNG_SIGNATURE)) {
+        close(fd);
+        throw StegoError("File is not a PNG");
+    }
+
+    mappedSize = info.st_size;
+    void *map = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping holds its own reference to the file
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw StegoError(std::string("Could not map input file: ") + strerror(errno));
+    }
+    mapped = (const uint8_t *) map;
+    isMapped = true;
+    madvise(map, mappedSize, MADV_SEQUENTIAL);
+    addStageBytes(stats, STAGE_READ, mappedSize, 0);
+    noteStageBuffer(stats, STAGE_READ, mappedSize);
+
+    try {
+        walkChunks();
+    } catch (...) {
+        munmap(map, mappedSize);
+        throw;
+    }
+}
+
+MappedPNG::MappedPNG(const uint8_t *data, size_t len, StegoStats *stats) : mapped(data), mappedSize(len), isMapped(false) {
+    StageTimer timer(stats, STAGE_READ);
+    addStageBytes(stats, STAGE_READ, len, 0);
+    if (len < sizeof(PNG_SIGNATURE)) {
+        throw StegoError("File is not a PNG");
+    }
+    walkChunks();
+}
+
+MappedPNG::~MappedPNG() {
+    if (isMapped) {
+        munmap((void *) mapped, mappedSize);
+    }
+}
+
+const uint8_t *MappedPNG::data() const {
+    return mapped;
+}
+
+size_t MappedPNG::size() const {
+    return mappedSize;
+}
+
+const std::vector<PNGChunk>& MappedPNG::chunks() const {
+    return chunkList;
+}
+
+const std::vector<size_t>& MappedPNG::IDATChunks() const {
+    return IDATList;
+}
+
+void MappedPNG::walkChunks() {
+    if (memcmp(mapped, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)) != 0) {
+        throw StegoError("File is not a PNG");
+    }
+
+    // Length, type, data and CRC: each step jumps a whole chunk
+    size_t pos = sizeof(PNG_SIGNATURE);
+    while (pos < mappedSize) {
+        if (mappedSize - pos < 12) {
+            throw StegoError("PNG is truncated inside a chunk header");
+        }
+
+        PNGChunk chunk;
+        chunk.offset = pos;
+        chunk.len = readBigEndian32(mapped + pos);
+        memcpy(chunk.type, mapped + pos + 4, 4);
+        chunk.type[4] = '\0';
+        chunk.data = mapped + pos + 8;
+
+        if (chunk.len > mappedSize - pos - 12) {
+            throw StegoError(std::string("PNG is truncated inside the ") + chunk.type + " chunk");
+        }
+
+        if (chunkIs(chunk, "IDAT")) {
+            IDATList.push_back(chunkList.size());
+        } else {
+            checkCRC(chunk);
+        }
+        chunkList.push_back(chunk);
+        pos += (size_t) chunk.len + 12;
+
+        if (chunkIs(chunk, "IEND")) {
+            break;
+        }
+    }
+
+    if (chunkList.empty() || !chunkIs(chunkList[0], "IHDR")) {
+        throw StegoError("PNG does not start with an IHDR chunk");
+    }
+}
+
+void MappedPNG::checkCRC(const PNGChunk& chunk) const {
+    // The CRC covers the type and data
+    const uint8_t *typeStart = chunk.data - 4;
+    uint32_t crc = crc32(0, typeStart, chunk.len + 4);
+    if (crc != readBigEndian32(chunk.data + chunk.len)) {
+        throw StegoError(std::string("CRC mismatch in the ") + chunk.type + " chunk at offset " + std::to_string(chunk.offset));
+    }
+}
+
+void checkIDATSize(size_t IDATSize) {
+    // PNG chunk lengths are limited to 2^31 - 1
+    if (IDATSize == 0 || IDATSize > 0x7fffffff) {
+        throw StegoError("IDAT size must be between 1 and 2147483647 bytes");
+    }
+}
+
+PNGWriter::PNGWriter(const char *path, size_t IDATSize, StegoStats *stats)
+    : path(path), fd(-1), memoryOutput(NULL), maxIDATSize(IDATSize), stats(stats) {
+    StageTimer timer(stats, STAGE_WRITE);
+    checkIDATSize(IDATSize);
+
+    // Unique per process and writer, so concurrent encodes to different
+    // outputs in one directory do not collide
+    static std::atomic<unsigned> writerCount(0);
+    tempPath = this->path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(writerCount++);
+
+    fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        throw StegoError(std::string("Could not open output file: ") + path + ": " + strerror(errno));
+    }
+}
+
+PNGWriter::PNGWriter(std::vector<uint8_t> *output, size_t IDATSize, StegoStats *stats)
+    : fd(-1), memoryOutput(output), maxIDATSize(IDATSize), stats(stats) {
+    checkIDATSize(IDATSize);
+}
+
+PNGWriter::~PNGWriter() {
+    // Not committed, so the encode failed part way through
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!tempPath.empty()) {
+        unlink(tempPath.c_str());
+    }
+}
+
+size_t PNGWriter::IDATSize() const {
+    return maxIDATSize;
+}
+
+void PNGWriter::writeChunk(const char *type, const uint8_t *data, size_t len) {
+    uint8_t header[8];
+    header[0] = len >> 24;
+    header[1] = len >> 16;
+    header[2] = len >> 8;
+    header[3] = len;
+    memcpy(header + 4, type, 4);
+
+    uint32_t crc = crc32(0, header + 4, 4);
+    if (len > 0) {
+        // A NULL buffer would reset the CRC
+        crc = crc32(crc, data, len);
+    }
+    uint8_t trailer[4] = {(uint8_t) (crc >> 24), (uint8_t) (crc >> 16), (uint8_t) (crc >> 8), (uint8_t) crc};
+
+    struct iovec parts[3] = {{header, sizeof(header)}, {(void *) data, len}, {trailer, sizeof(trailer)}};
+    writeAll(parts, 3);
+}
+
+void PNGWriter::writeIDATs(const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t chunkLen = std::min(len, maxIDATSize);
+        writeChunk("IDAT", data, chunkLen);
+        data += chunkLen;
+        len -= chunkLen;
+    }
+}
+
+void PNGWriter::copyChunks(const MappedPNG& png, const std::vector<const PNGChunk *>& chunks) {
+    // Neighbouring chunks are contiguous in the input, so runs of them go
+    // out as a single span
+    std::vector<struct iovec> parts;
+    for (const PNGChunk *chunk : chunks) {
+        const uint8_t *start = png.data() + chunk->offset;
+        size_t len = (size_t) chunk->len + 12;
+        if (!parts.empty() && (const uint8_t *) parts.back().iov_base + parts.back().iov_len == start) {
+            parts.back().iov_len += len;
+        } else {
+            parts.push_back({(void *) start, len});
+        }
+    }
+
+    for (size_t i = 0; i < parts.size(); i += IOV_MAX) {
+        writeAll(&parts[i], std::min(parts.size() - i, (size_t) IOV_MAX));
+    }
+}
+
+void PNGWriter::copyBytes(const uint8_t *data, size_t len) {
+    struct iovec part = {(void *) data, len};
+    writeAll(&part, 1);
+}
+
+void PNGWriter::finish() {
+    if (fd < 0) {
+        return;
+    }
+
+    StageTimer timer(stats, STAGE_WRITE);
+    // No fsync: the rename only has to keep readers from seeing a partial
+    // file, not survive a power cut
+    int ret = close(fd);
+    fd = -1;
+    if (ret < 0) {
+        int error = errno;
+        unlink(tempPath.c_str());
+        tempPath.clear();
+        throw StegoError(std::string("Could not write output file: ") + path + ": " + strerror(error));
+    }
+}
+
+void PNGWriter::commit() {
+    if (memoryOutput != NULL) {
+        return;
+    }
+
+    finish();
+    StageTimer timer(stats, STAGE_WRITE);
+    if (rename(tempPath.c_str(), path.c_str()) < 0) {
+        int error = errno;
+        unlink(tempPath.c_str());
+        tempPath.clear();
+        throw StegoError(std::string("Could not write output file: ") + path + ": " + strerror(error));
+    }
+    tempPath.clear();
+}
+
+void PNGWriter::writeAll(struct iovec *parts, size_t numParts) {
+    StageTimer timer(stats, STAGE_WRITE);
+    if (stats != NULL) {
+        size_t len = 0;
+        for (size_t i = 0; i < numParts; i++) {
+            len += parts[i].iov_len;
+        }
+        addStageBytes(stats, STAGE_WRITE, len, len);
+    }
+
+    if (memoryOutput != NULL) {
+        for (size_t i = 0; i < numParts; i++) {
+            const uint8_t *start = (const uint8_t *) parts[i].iov_base;
+            memoryOutput->insert(memoryOutput->end(), start, start + parts[i].iov_len);
+        }
+        noteStageBuffer(stats, STAGE_WRITE, memoryOutput->capacity());
+        return;
+    }
+
+    while (numParts > 0) {
+        ssize_t ret = writev(fd, parts, numParts);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            throw StegoError(std::string("Could not write output file: ") + path + ": " + strerror(errno));
+        }
+
+        // Skip over whatever a short write did get out
+        size_t written = ret;
+        while (numParts > 0 && written >= parts->iov_len) {
+            written -= parts->iov_len;
+            parts++;
+            numParts--;
+        }
+        if (numParts > 0) {
+            parts->iov_base = (uint8_t *) parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+}
+
+void writeLeadingChunks(PNGWriter& writer, const MappedPNG& png) {
+    const PNGChunk& firstIDAT = png.chunks()[png.IDATChunks()[0]];
+    writer.copyBytes(png.data(), firstIDAT.offset);
+}
+
+void writeTrailingChunks(PNGWriter& writer, const MappedPNG& png) {
+    // Chunks stranded between IDATs move to after the new ones, as IDATs
+    // have to be consecutive
+    std::vector<const PNGChunk *> trailing;
+    for (size_t i = png.IDATChunks()[0]; i < png.chunks().size(); i++) {
+        if (!chunkIs(png.chunks()[i], "IDAT")) {
+            trailing.push_back(&png.chunks()[i]);
+        }
+    }
+    writer.copyChunks(png, trailing);
+
+    if (trailing.empty() || !chunkIs(*trailing.back(), "IEND")) {
+        writer.writeChunk("IEND", NULL, 0);
+    }
+}
+
+bool chunkIs(const PNGChunk& chunk, const char *type) {
+    return memcmp(chunk.type, type, 4) == 0;
+}
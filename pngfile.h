@@ -0,0 +1,97 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include "stats.h"
+#ifndef PNGFILE_H
+#define PNGFILE_H
+
+typedef struct PNGChunk {
+    char type[5];
+    // Where the chunk's length field starts in the file
+    size_t offset;
+    uint32_t len;
+    const uint8_t *data;
+} PNGChunk;
+
+// A PNG memory mapped read only, or viewed in a caller's buffer that must
+// outlive it, with its chunks indexed by following their length fields. Opening touches only the chunk headers: small chunks have
+// their CRCs checked straight away, while IDAT chunks are checked by
+// checkCRC as they are consumed, so large images open without reading the
+// image data. Opening counts as the read stage in any stats given.
+class MappedPNG {
+public:
+    explicit MappedPNG(const char *path, StegoStats *stats = NULL);
+    MappedPNG(const uint8_t *data, size_t len, StegoStats *stats = NULL);
+    ~MappedPNG();
+
+    MappedPNG(const MappedPNG&) = delete;
+    MappedPNG& operator=(const MappedPNG&) = delete;
+
+    const uint8_t *data() const;
+    size_t size() const;
+    const std::vector<PNGChunk>& chunks() const;
+    // Positions in chunks() of the IDAT chunks, in file order
+    const std::vector<size_t>& IDATChunks() const;
+
+    void checkCRC(const PNGChunk& chunk) const;
+
+private:
+    void walkChunks();
+
+    const uint8_t *mapped;
+    size_t mappedSize;
+    bool isMapped;
+    std::vector<PNGChunk> chunkList;
+    std::vector<size_t> IDATList;
+};
+
+// Writes a PNG into a temporary file next to the destination and renames it
+// into place on commit, so a failed or interrupted encode never leaves a
+// partial image behind. Given a vector instead it appends to that, and
+// commit does nothing. Chunks go out with one writev each, their CRC worked
+// out over the whole data in one call, and IDAT data is split into chunks of
+// at most IDATSize bytes. Everything it does counts as the write stage in any
+// stats given.
+class PNGWriter {
+public:
+    PNGWriter(const char *path, size_t IDATSize, StegoStats *stats = NULL);
+    PNGWriter(std::vector<uint8_t> *output, size_t IDATSize, StegoStats *stats = NULL);
+    ~PNGWriter();
+
+    PNGWriter(const PNGWriter&) = delete;
+    PNGWriter& operator=(const PNGWriter&) = delete;
+
+    size_t IDATSize() const;
+
+    void writeChunk(const char *type, const uint8_t *data, size_t len);
+    void writeIDATs(const uint8_t *data, size_t len);
+    // Copies chunks from an input PNG byte for byte, CRCs included
+    void copyChunks(const MappedPNG& png, const std::vector<const PNGChunk *>& chunks);
+    void copyBytes(const uint8_t *data, size_t len);
+    // Closes the temporary file, reporting any error writing it, but leaves
+    // it unrenamed. Lets several outputs be checked before any is committed.
+    void finish();
+    void commit();
+
+private:
+    void writeAll(struct iovec *parts, size_t numParts);
+
+    std::string path;
+    std::string tempPath;
+    int fd;
+    std::vector<uint8_t> *memoryOutput;
+    size_t maxIDATSize;
+    StegoStats *stats;
+};
+
+// The signature and every chunk before the first IDAT
+void writeLeadingChunks(PNGWriter& writer, const MappedPNG& png);
+// Every non-IDAT chunk after the first IDAT, ending with IEND
+void writeTrailingChunks(PNGWriter& writer, const MappedPNG& png);
+
+bool chunkIs(const PNGChunk& chunk, const char *type);
+uint32_t readBigEndian32(const uint8_t *p);
+
+#endif
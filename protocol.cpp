@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "protocol.h"
+
+bool readFully(int fd, uint8_t *data, size_t len, bool eofAllowed);
+void writeFully(int fd, const uint8_t *data, size_t len);
+void appendUint32(std::vector<uint8_t>& out, uint32_t value);
+void appendString(std::vector<uint8_t>& out, const std::string& str);
+uint32_t readUint32(const std::vector<uint8_t>& payload, size_t *pos);
+std::string readString(const std::vector<uint8_t>& payload, size_t *pos);
+
+bool readFrame(int fd, std::vector<uint8_t> *payload) {
+    uint8_t header[4];
+    if (!readFully(fd, header, sizeof(header), true)) {
+        return false;
+    }
+
+    uint32_t len = ((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) | ((uint32_t) header[2] << 8) | header[3];
+    if (len > MAX_FRAME_SIZE) {
+        throw StegoError("Frame of " + std::to_string(len) + " bytes is too large");
+    }
+
+    payload->resize(len);
+    readFully(fd, payload->data(), len, false);
+    return true;
+}
+
+void writeFrame(int fd, const std::vector<uint8_t>& payload) {
+    std::vector<uint8_t> frame;
+    frame.reserve(4 + payload.size());
+    appendUint32(frame, payload.size());
+    frame.insert(frame.end(), payload.begin(), payload.end());
+    writeFully(fd, frame.data(), frame.size());
+}
+
+bool readFully(int fd, uint8_t *data, size_t len, bool eofAllowed) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = read(fd, data + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            throw StegoError(std::string("Socket read failed: ") + strerror(errno));
+        } else if (ret == 0) {
+            if (done == 0 && eofAllowed) {
+                return false;
+            }
+            throw StegoError("Connection closed in the middle of a frame");
+        }
+        done += ret;
+    }
+    return true;
+}
+
+void writeFully(int fd, const uint8_t *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        // No SIGPIPE if the client has gone away, just an error
+        ssize_t ret = send(fd, data + done, len - done, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            throw StegoError(std::string("Socket write failed: ") + strerror(errno));
+        }
+        done += ret;
+    }
+}
+
+std::vector<uint8_t> encodeRequest(const BatchJob& job) {
+    std::vector<uint8_t> payload;
+    payload.push_back(job.mode);
+    payload.push_back(job.encodingOption);
+    appendString(payload, job.inputFile);
+    appendString(payload, job.message);
+    appendString(payload, job.outputFile);
+    appendString(payload, job.inputKeyFile);
+    appendString(payload, job.outputKeyFile);
+    return payload;
+}
+
+BatchJob decodeRequest(const std::vector<uint8_t>& payload) {
+    if (payload.size() < 2) {
+        throw StegoError("Request is too short");
+    }
+
+    BatchJob job;
+    job.lineNum = 0;
+    job.mode = payload[0];
+    job.encodingOption = payload[1];
+    if ((job.mode != ENCODE && job.mode != DECODE) || (job.encodingOption != PLAINTEXT_MODE && job.encodingOption != AES_MODE && job.encodingOption != AES_DERIVED_MODE)) {
+        throw StegoError("Unknown request op or mode");
+    }
+
+    size_t pos = 2;
+    job.inputFile = readString(payload, &pos);
+    job.message = readString(payload, &pos);
+    job.outputFile = readString(payload, &pos);
+    job.inputKeyFile = readString(payload, &pos);
+    job.outputKeyFile = readString(payload, &pos);
+    return job;
+}
+
+std::vector<uint8_t> encodeResponse(const BatchResult& result) {
+    std::vector<uint8_t> payload;
+    payload.push_back(result.ok ? 0 : 1);
+    appendString(payload, result.ok ? result.output : result.error);
+    return payload;
+}
+
+BatchResult decodeResponse(const std::vector<uint8_t>& payload) {
+    if (payload.empty()) {
+        throw StegoError("Response is empty");
+    }
+
+    size_t pos = 1;
+    std::string text = readString(payload, &pos);
+    if (payload[0] == 0) {
+        return {true, text, "", StegoStats()};
+    }
+    return {false, "", text, StegoStats()};
+}
+
+void appendUint32(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+void appendString(std::vector<uint8_t>& out, const std::string& str) {
+    appendUint32(out, str.size());
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+uint32_t readUint32(const std::vector<uint8_t>& payload, size_t *pos) {
+    if (*pos + 4 > payload.size()) {
+        throw StegoError("Payload ended in the middle of a length");
+    }
+
+    const uint8_t *p = &payload[*pos];
+    *pos += 4;
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+std::string readString(const std::vector<uint8_t>& payload, size_t *pos) {
+    uint32_t len = readUint32(payload, pos);
+    if (len > payload.size() - *pos) {
+        throw StegoError("Payload ended in the middle of a string");
+    }
+
+    std::string str(payload.begin() + *pos, payload.begin() + *pos + len);
+    *pos += len;
+    return str;
+}
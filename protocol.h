@@ -0,0 +1,30 @@
+#include <cstdint>
+#include <vector>
+#include "batch.h"
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Requests and responses on the server socket are frames: a 4 byte big
+// endian payload length, then the payload.
+//
+// Request payload: op (1 byte, ENCODE or DECODE), mode (1 byte,
+// PLAINTEXT_MODE, AES_MODE or AES_DERIVED_MODE), then five strings, each a 4 byte big endian
+// length and its bytes: input, message, output, key input and key output.
+// Strings a request does not use are empty.
+//
+// Response payload: status (1 byte, 0 for success), then one string holding
+// the decoded message or output file on success, or the error.
+
+// Frames larger than this are refused rather than allocated
+const uint32_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+// Returns false if the other end closed the connection before a new frame
+bool readFrame(int fd, std::vector<uint8_t> *payload);
+void writeFrame(int fd, const std::vector<uint8_t>& payload);
+
+std::vector<uint8_t> encodeRequest(const BatchJob& job);
+BatchJob decodeRequest(const std::vector<uint8_t>& payload);
+std::vector<uint8_t> encodeResponse(const BatchResult& result);
+BatchResult decodeResponse(const std::vector<uint8_t>& payload);
+
+#endif
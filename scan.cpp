@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "scan.h"
+#include "batch.h"
+#include "threadpool.h"
+
+typedef struct ScanResult {
+    bool ok;
+    MessageHeader header;
+    std::string message;
+    std::string error;
+    // Only filled in when the scan collects stats
+    StegoStats stats;
+} ScanResult;
+
+bool isPNGPath(const std::filesystem::path& path);
+ScanResult scanFile(const std::string& path, bool extract, const StegoOptions& options);
+void writeScanResult(std::ostream& out, const std::string& path, bool extract, bool withStats, const ScanResult& result);
+
+ScanSummary runScan(const char *root, int threads, bool extract, const StegoOptions& options, std::ostream& out) {
+    // Directories that cannot be opened are skipped rather than ending the
+    // scan
+    std::error_code error;
+    std::filesystem::recursive_directory_iterator walk(root, std::filesystem::directory_options::skip_permission_denied, error);
+    if (error) {
+        throw StegoError(std::string("Could not scan ") + root + ": " + error.message());
+    }
+
+    // Probing never hands work to the shared pool, so files can go straight
+    // to a pool of their own
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    ThreadPool pool(threads);
+    bool collectStats = options.stats != NULL;
+    StegoOptions fileOptions = options;
+    fileOptions.stats = NULL;
+
+    // As with a batch, a bounded number of files are queued ahead of the one
+    // being written, so a huge tree is never held in memory
+    size_t maxInFlight = 4 * (size_t) threads;
+    std::deque<std::pair<std::string, std::future<ScanResult>>> pending;
+    ScanSummary summary = {0, 0, 0};
+
+    auto writeNext = [&]() {
+        ScanResult result = pending.front().second.get();
+        writeScanResult(out, pending.front().first, extract, collectStats, result);
+        summary.numFound += result.ok && result.header.found ? 1 : 0;
+        summary.numFailed += result.ok ? 0 : 1;
+        if (collectStats) {
+            mergeStats(options.stats, result.stats);
+        }
+        pending.pop_front();
+    };
+
+    for (; walk != std::filesystem::recursive_directory_iterator(); walk.increment(error)) {
+        if (error) {
+            break;
+        }
+        if (!walk->is_regular_file(error) || !isPNGPath(walk->path())) {
+            continue;
+        }
+
+        std::string path = walk->path().string();
+        summary.numFiles++;
+        pending.emplace_back(path, pool.submit([path, extract, fileOptions, collectStats]() {
+            StegoStats stats;
+            StegoOptions statsOptions = fileOptions;
+            statsOptions.stats = collectStats ? &stats : NULL;
+            ScanResult result = scanFile(path, extract, statsOptions);
+            result.stats = stats;
+            return result;
+        }));
+        if (pending.size() >= maxInFlight) {
+            writeNext();
+        }
+    }
+
+    while (!pending.empty()) {
+        writeNext();
+    }
+    if (error) {
+        throw StegoError(std::string("Scan of ") + root + " stopped early: " + error.message());
+    }
+    return summary;
+}
+
+bool isPNGPath(const std::filesystem::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    return extension == ".png";
+}
+
+ScanResult scanFile(const std::string& path, bool extract, const StegoOptions& options) {
+    ScanResult result;
+    result.ok = true;
+    result.header = {false, 0, 0, 0};
+    try {
+        std::vector<uint8_t> message;
+        result.header = probeMessage(path.c_str(), extract ? &message : NULL, options);
+        result.message.assign(message.begin(), message.end());
+    } catch (const std::exception& e) {
+        result.ok = false;
+        result.error = e.what();
+    }
+    return result;
+}
+
+// Files with no tagged message are left out, so the output lists only what
+// needs a closer look
+void writeScanResult(std::ostream& out, const std::string& path, bool extract, bool withStats, const ScanResult& result) {
+    if (result.ok && !result.header.found) {
+        return;
+    }
+
+    out << "{\"path\": \"" << escapeJSON(path) << '"';
+    if (result.ok) {
+        out << ", \"version\": " << result.header.version << ", \"bitsPerSample\": " << result.header.bitsPerSample
+            << ", \"length\": " << result.header.length;
+        if (extract) {
+            out << ", " << payloadJSON("message", result.message);
+        }
+    } else {
+        out << ", \"error\": \"" << escapeJSON(result.error) << '"';
+    }
+    if (withStats) {
+        out << ", \"stats\": " << statsJSON(result.stats);
+    }
+    out << "}\n";
+}
@@ -0,0 +1,22 @@
+#include <cstddef>
+#include <ostream>
+#include "stego.h"
+#ifndef SCAN_H
+#define SCAN_H
+
+typedef struct ScanSummary {
+    size_t numFiles;
+    size_t numFound;
+    size_t numFailed;
+} ScanSummary;
+
+// Probes every .png file under root on a pool of threads and writes a JSON
+// line for each one holding a tagged message, or that could not be read, in
+// the order the walk found them. Only the rows the header spans are
+// inflated, unless extract asks for the messages too, written as
+// message_base64 when they are not valid UTF-8. With stats in the
+// options, each line carries its file's stats and the options' stats get
+// the sum.
+ScanSummary runScan(const char *root, int threads, bool extract, const StegoOptions& options, std::ostream& out);
+
+#endif
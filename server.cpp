@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+#include "batch.h"
+#include "protocol.h"
+#include "threadpool.h"
+
+// Connections served at once. Past this, new ones wait in the listen
+// backlog until an open one closes, so idle clients cannot start an
+// unbounded number of threads.
+#define MAX_CONNECTIONS 256
+
+typedef struct ConnectionLimit {
+    std::mutex mutex;
+    std::condition_variable released;
+    int numOpen = 0;
+} ConnectionLimit;
+
+void serveConnection(int fd, ThreadPool *pool, StegoOptions options, ConnectionLimit *limit);
+void removeStaleSocket(const char *socketPath);
+void handleStopSignal(int signal);
+
+// Kept for the signal handler, which removes the socket file on the way out
+static char boundSocketPath[sizeof(sockaddr_un::sun_path)];
+
+int runServer(const char *socketPath, int threads, const StegoOptions& options) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        throw StegoError(std::string("Socket path is too long: ") + socketPath);
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw StegoError(std::string("Could not create socket: ") + strerror(errno));
+    }
+
+    removeStaleSocket(socketPath);
+    if (bind(listener, (sockaddr *) &address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        close(listener);
+        throw StegoError(std::string("Could not listen on ") + socketPath + ": " + strerror(errno));
+    }
+
+    strcpy(boundSocketPath, socketPath);
+    signal(SIGINT, handleStopSignal);
+    signal(SIGTERM, handleStopSignal);
+
+    // Requests from every connection share one pool, and each request
+    // compresses on a single thread, handles an AES pair one image at a time
+    // and does not pipeline its stages, as requests already run side by side
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    ThreadPool pool(threads);
+    StegoOptions jobOptions = options;
+    jobOptions.threads = 1;
+    jobOptions.concurrentAES = false;
+    jobOptions.pipelineStages = false;
+    // Stats are filled in by a single command, not gathered across requests
+    jobOptions.stats = NULL;
+
+    std::cerr << "Listening on " << socketPath << " with " << threads << " workers\n";
+
+    ConnectionLimit limit;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(limit.mutex);
+            limit.released.wait(lock, [&limit]() { return limit.numOpen < MAX_CONNECTIONS; });
+        }
+
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            close(listener);
+            throw StegoError(std::string("accept failed: ") + strerror(errno));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(limit.mutex);
+            limit.numOpen++;
+        }
+        try {
+            std::thread(serveConnection, fd, &pool, jobOptions, &limit).detach();
+        } catch (const std::system_error& e) {
+            std::cerr << "Dropping connection: " << e.what() << '\n';
+            close(fd);
+            std::lock_guard<std::mutex> lock(limit.mutex);
+            limit.numOpen--;
+        }
+    }
+}
+
+// A socket file left behind by a previous server would block the bind, but
+// anything else at the path is left alone and the bind reports it
+void removeStaleSocket(const char *socketPath) {
+    struct stat info;
+    if (lstat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(socketPath);
+    }
+}
+
+void serveConnection(int fd, ThreadPool *pool, StegoOptions options, ConnectionLimit *limit) {
+    try {
+        std::vector<uint8_t> request;
+        while (readFrame(fd, &request)) {
+            BatchResult result;
+            try {
+                BatchJob job = decodeRequest(request);
+                result = pool->submit([job, options]() { return runBatchJob(job, options); }).get();
+            } catch (const std::exception& e) {
+                // Anything a request throws, such as running out of memory,
+                // fails that request rather than the server
+                result = {false, "", e.what(), StegoStats()};
+            }
+
+            writeFrame(fd, encodeResponse(result));
+        }
+    } catch (const std::exception& e) {
+        // The connection is unusable after a broken frame, so it is dropped
+        std::cerr << "Dropping connection: " << e.what() << '\n';
+    }
+
+    close(fd);
+    std::lock_guard<std::mutex> lock(limit->mutex);
+    limit->numOpen--;
+    limit->released.notify_one();
+}
+
+void handleStopSignal(int signal) {
+    unlink(boundSocketPath);
+    _exit(0);
+}
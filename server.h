@@ -0,0 +1,10 @@
+#include "stego.h"
+#ifndef SERVER_H
+#define SERVER_H
+
+// Serves encode and decode requests on a Unix domain socket until killed,
+// running them on one worker pool shared by every connection. The
+// protocol is described in protocol.h.
+int runServer(const char *socketPath, int threads, const StegoOptions& options);
+
+#endif
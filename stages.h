@@ -0,0 +1,26 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "pngfile.h"
+#ifndef STAGES_H
+#define STAGES_H
+
+// zlib settings and filter choice behind an encoder profile
+typedef struct EncoderSettings {
+    int level;
+    int strategy;
+    bool adaptiveFilter;
+} EncoderSettings;
+
+EncoderSettings encoderSettings(int profile);
+
+// Each step of an encode done over the whole image in one pass. The encoder
+// streams scanlines through the same steps instead, and stegopng_bench uses
+// these to time each step on its own.
+std::vector<uint8_t> readIDATData(const MappedPNG& png);
+std::vector<uint8_t> decompressIDATChunk(const std::vector<uint8_t>& compressedData, size_t maxOutputLen);
+void embedMessage(std::vector<uint8_t>& data, unsigned char *message, int msgLen, size_t scanlineLen);
+std::vector<uint8_t> compressIDATChunk(const std::vector<uint8_t>& decompressedData, size_t scanlineLen, int threads, const EncoderSettings& settings);
+void createPNG(const std::vector<uint8_t>& compressedData, const MappedPNG& png, char *outputFileString, size_t IDATSize);
+
+#endif
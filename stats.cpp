@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <ctime>
+#include "stats.h"
+
+static const char *stageNames[NUM_STEGO_STAGES] = {
+    "read", "inflate", "unfilter", "embed", "extract", "refilter", "deflate", "write", "encrypt", "decrypt", "other"
+};
+
+// Innermost running timer on this thread, which a nested timer reports its
+// time to so it is not counted twice
+static thread_local StageTimer *activeTimer = NULL;
+
+double clockMs(clockid_t clock) {
+    timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+void StageTimer::start(StegoStage stage) {
+    this->stage = stage;
+    parent = activeTimer;
+    activeTimer = this;
+    childWallMs = 0;
+    childCpuMs = 0;
+    startWallMs = clockMs(CLOCK_MONOTONIC);
+    startCpuMs = clockMs(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void StageTimer::stop() {
+    double wallMs = clockMs(CLOCK_MONOTONIC) - startWallMs;
+    double cpuMs = clockMs(CLOCK_THREAD_CPUTIME_ID) - startCpuMs;
+
+    StageStats& stageStats = stats->stages[stage];
+    stageStats.calls++;
+    stageStats.wallMs += wallMs - childWallMs;
+    stageStats.cpuMs += cpuMs - childCpuMs;
+
+    activeTimer = parent;
+    if (parent != NULL) {
+        parent->childWallMs += wallMs;
+        parent->childCpuMs += cpuMs;
+    }
+}
+
+void mergeStats(StegoStats *into, const StegoStats& from) {
+    for (int i = 0; i < NUM_STEGO_STAGES; i++) {
+        StageStats& total = into->stages[i];
+        const StageStats& stage = from.stages[i];
+        total.calls += stage.calls;
+        total.wallMs += stage.wallMs;
+        total.cpuMs += stage.cpuMs;
+        total.bytesIn += stage.bytesIn;
+        total.bytesOut += stage.bytesOut;
+        if (stage.peakBufferBytes > total.peakBufferBytes) {
+            total.peakBufferBytes = stage.peakBufferBytes;
+        }
+    }
+}
+
+std::string statsJSON(const StegoStats& stats) {
+    double wallMs = 0;
+    double cpuMs = 0;
+    std::string stages;
+    char field[512];
+
+    for (int i = 0; i < NUM_STEGO_STAGES; i++) {
+        const StageStats& stage = stats.stages[i];
+        if (stage.calls == 0) {
+            continue;
+        }
+        wallMs += stage.wallMs;
+        cpuMs += stage.cpuMs;
+
+        snprintf(field, sizeof(field),
+                 "%s\"%s\": {\"calls\": %llu, \"wallMs\": %.3f, \"cpuMs\": %.3f, \"bytesIn\": %llu, \"bytesOut\": %llu, \"peakBufferBytes\": %llu}",
+                 stages.empty() ? "" : ", ", stageNames[i], (unsigned long long) stage.calls, stage.wallMs, stage.cpuMs,
+                 (unsigned long long) stage.bytesIn, (unsigned long long) stage.bytesOut, (unsigned long long) stage.peakBufferBytes);
+        stages += field;
+    }
+
+    snprintf(field, sizeof(field), "{\"wallMs\": %.3f, \"cpuMs\": %.3f, \"stages\": {", wallMs, cpuMs);
+    return field + stages + "}}";
+}
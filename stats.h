@@ -0,0 +1,123 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#ifndef STATS_H
+#define STATS_H
+
+// Steps an encode or decode is broken down into for --stats
+enum StegoStage {
+    STAGE_READ,
+    STAGE_INFLATE,
+    STAGE_UNFILTER,
+    STAGE_EMBED,
+    STAGE_EXTRACT,
+    STAGE_REFILTER,
+    STAGE_DEFLATE,
+    STAGE_WRITE,
+    STAGE_ENCRYPT,
+    STAGE_DECRYPT,
+    // Everything outside the other stages, such as parsing the IHDR and
+    // setting up streams
+    STAGE_OTHER,
+    NUM_STEGO_STAGES
+};
+
+typedef struct StageStats {
+    uint64_t calls = 0;
+    double wallMs = 0;
+    double cpuMs = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    // Largest buffers the stage held at once, not counting zlib's own state
+    uint64_t peakBufferBytes = 0;
+} StageStats;
+
+// Filled in by an encode or decode given one in its options. Time spent in
+// a stage never includes another stage it calls into, so the stages add up
+// to the whole operation. CPU time is the calling thread's, which leaves out
+// the workers of a parallel deflate.
+typedef struct StegoStats {
+    StageStats stages[NUM_STEGO_STAGES];
+} StegoStats;
+
+// Adds the time from construction to destruction to a stage. With no stats
+// to fill in it does nothing, so stages cost a pointer check when --stats is
+// off.
+class StageTimer {
+public:
+    StageTimer(StegoStats *stats, StegoStage stage) : stats(stats) {
+        if (stats != NULL) {
+            start(stage);
+        }
+    }
+
+    ~StageTimer() {
+        if (stats != NULL) {
+            stop();
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    void start(StegoStage stage);
+    void stop();
+
+    StegoStats *stats;
+    StegoStage stage;
+    StageTimer *parent;
+    double startWallMs;
+    double startCpuMs;
+    double childWallMs;
+    double childCpuMs;
+};
+
+inline void addStageBytes(StegoStats *stats, StegoStage stage, uint64_t bytesIn, uint64_t bytesOut) {
+    if (stats != NULL) {
+        stats->stages[stage].bytesIn += bytesIn;
+        stats->stages[stage].bytesOut += bytesOut;
+    }
+}
+
+inline void noteStageBuffer(StegoStats *stats, StegoStage stage, uint64_t bytes) {
+    if (stats != NULL && bytes > stats->stages[stage].peakBufferBytes) {
+        stats->stages[stage].peakBufferBytes = bytes;
+    }
+}
+
+// Reports how far an encode or decode has got, in compressed image data
+// read. Every image of a call adds to the same total as it is opened, so in
+// AES and shard modes the total can still grow while the first images are
+// read. The callback runs on whichever thread reads an image, so it must be
+// safe to call from several at once.
+typedef struct StegoProgress {
+    void (*callback)(uint64_t done, uint64_t total, void *user) = NULL;
+    void *user = NULL;
+    std::atomic<uint64_t> done{0};
+    std::atomic<uint64_t> total{0};
+} StegoProgress;
+
+inline void addProgressTotal(StegoProgress *progress, uint64_t bytes) {
+    if (progress != NULL) {
+        progress->total += bytes;
+    }
+}
+
+inline void advanceProgress(StegoProgress *progress, uint64_t bytes) {
+    if (progress != NULL) {
+        uint64_t done = progress->done += bytes;
+        if (progress->callback != NULL) {
+            progress->callback(done, progress->total, progress->user);
+        }
+    }
+}
+
+// Sums calls, times and bytes, and keeps the larger peak
+void mergeStats(StegoStats *into, const StegoStats& from);
+
+// One line of JSON with the totals and each stage that ran
+std::string statsJSON(const StegoStats& stats);
+
+#endif
@@ -1,20 +1,70 @@
-#include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <cstdint>
 #include <cstdio>
+#include <climits>
+#include <exception>
+#include <functional>
+#include <memory>
 #include <zlib.h>
 #include <string>
+#include <thread>
 #include <openssl/evp.h>
 #include <openssl/aes.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
+#include <openssl/kdf.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 #include "stego.h"
-
-#define PNG_MAGIC 0x0a1a0a0d474e5089
+#include "filter.h"
+#include "pdeflate.h"
+#include "bitpack.h"
+#include "pngfile.h"
+#include "stages.h"
+#include "bufferpool.h"
+#include "threadpool.h"
+
+
+// Every message starts with a header at one bit per sample: a magic tag, the
+// header version, the bits per sample the message itself uses, and its
+// length as a big endian 32-bit number
+#define STEGO_HEADER_SIZE 10
+#define STEGO_HEADER_BITS (STEGO_HEADER_SIZE * 8)
+#define STEGO_HEADER_VERSION 1
+static const uint8_t STEGO_MAGIC[4] = {0x89, 'S', 'T', 'G'};
+
+// AES-256-CBC. In the derived key mode the payload image holds a random
+// salt and the IV ahead of the ciphertext, and the key comes from the key
+// image's pixels through HKDF, so the key image is only ever read.
+#define AES_KEY_SIZE 32
+#define AES_IV_SIZE 16
+#define DERIVED_SALT_SIZE 16
+static const char DERIVED_KEY_INFO[] = "stegopng aes-256-cbc key";
+
+// A shard's message starts with a header of its own: a magic tag, the
+// header version, the shard's index and the shard count, the whole
+// message's length as two big endian 32-bit halves, and its SHA-256
+#define SHARD_HEADER_SIZE 53
+#define SHARD_HEADER_VERSION 1
+static const uint8_t SHARD_MAGIC[4] = {'S', 'H', 'R', 'D'};
+
+// A pipelined encode passes rows between its threads in batches of about
+// PIPELINE_BATCH_BYTES, through a ring of PIPELINE_SLOTS batches. Images with
+// less pixel data than PIPELINE_MIN_BYTES encode on one thread, as starting
+// the stage threads would cost more than overlapping the stages saves.
+#define PIPELINE_BATCH_BYTES 65536
+#define PIPELINE_SLOTS 8
+#define PIPELINE_MIN_BYTES (8 * 1024 * 1024)
+
+// With more than one thread, embedded rows are refiltered in bands of about
+// this many bytes split across the shared pool
+#define REFILTER_BAND_BYTES (1024 * 1024)
 
 typedef struct ChunkIHDR {
     uint32_t width;
@@ -26,654 +76,2035 @@ typedef struct ChunkIHDR {
     uint8_t enlacementMethod;
 } ChunkIHDR;
 
-std::vector<uint8_t> steganographer(int mode, char *inputFile, unsigned char *message, int msgLen, char *outputFile);
+// Inflates the IDAT stream one scanline at a time, feeding zlib the next
+// IDAT chunk straight out of the mapped file only when the current one runs
+// dry. The stream comes from this thread's pool and goes back on
+// endIDATInflater.
+typedef struct IDATInflater {
+    const MappedPNG *png;
+    size_t nextIDAT;
+    z_stream *stream;
+    bool streamEnded;
+    StegoStats *stats;
+    // IDAT bytes not yet fed to zlib, reported as done when the inflater ends
+    // so a decode that stops early still finishes its progress
+    StegoProgress *progress;
+    uint64_t progressLeft;
+} IDATInflater;
+
+// Deflates refiltered scanlines and writes out an IDAT chunk each time the
+// output buffer, sized to the writer's IDAT size, fills up. With more than
+// one thread the rows go to a parallel deflater instead, or with level 0 to
+// a stored block writer, and stream stays NULL. The stream and buffer come
+// from this thread's pools and go back on endIDATDeflater.
+typedef struct IDATDeflater {
+    PNGWriter *writer;
+    z_stream *stream;
+    std::vector<uint8_t> buffer;
+    size_t bufferUsed;
+    bool isParallel;
+    ParallelDeflater parallel;
+    bool isStored;
+    StoredDeflater stored;
+    StegoStats *stats;
+} IDATDeflater;
+
+// Tracks how far into the header and message the embedding has got, so bits
+// can be written one scanline at a time. bitIndex counts the header's bits
+// and then the message's.
+typedef struct MessageEmbedder {
+    const BitPackKernels *kernels;
+    uint8_t header[STEGO_HEADER_SIZE];
+    const uint8_t *message;
+    size_t msgLen;
+    int bitsPerSample;
+    size_t bitIndex;
+    size_t numBits;
+} MessageEmbedder;
+
+// Embedded rows waiting to be refiltered together, so the refilter can be
+// split across the shared pool. Row 0 of embedded is the row above the band,
+// so the band's row i is embedded row i + 1. With one thread a band is a
+// single row and the refilter runs on the caller.
+typedef struct RefilterBand {
+    const FilterKernels *kernels;
+    size_t scanlineLen;
+    bool adaptiveFilter;
+    int threads;
+    size_t maxRows;
+    size_t numRows;
+    uint8_t *embedded;
+    uint8_t *candidate;
+} RefilterBand;
+
+// Row batches shared by the three threads of a pipelined encode. A slot goes
+// from the inflate thread, which fills it with filtered rows, to the embed
+// thread, which refilters them in place, to the caller's thread, which
+// deflates them and so frees the slot for inflate again. Each cursor counts
+// the batches one stage has finished and only that stage writes it, so the
+// ring needs no locks.
+typedef struct StageRing {
+    uint8_t *rows;
+    size_t scanlineLen;
+    size_t batchRows;
+    uint32_t height;
+    uint64_t numBatches;
+    std::atomic<uint64_t> inflated;
+    std::atomic<uint64_t> embedded;
+    std::atomic<uint64_t> deflated;
+    // Set by a failing stage so the others stop waiting on it
+    std::atomic<bool> cancelled;
+} StageRing;
+
+// Collects header and then message bits one scanline at a time, the
+// counterpart of MessageEmbedder. Only the first header byte is read at
+// first, as images from before the header had a magic tag start with a one
+// byte length instead.
+typedef struct MessageExtractor {
+    const BitPackKernels *kernels;
+    size_t numSamples;
+    uint8_t header[STEGO_HEADER_SIZE];
+    size_t headerIndex;
+    size_t headerBits;
+    bool haveHeader;
+    std::vector<uint8_t> message;
+    int bitsPerSample;
+    size_t bitIndex;
+    size_t numBits;
+} MessageExtractor;
+
+std::vector<uint8_t> steganographer(int mode, char *inputFile, unsigned char *message, int msgLen, char *outputFile, const StegoOptions& options = StegoOptions());
+std::vector<uint8_t> steganographer(int mode, const MappedPNG& png, const unsigned char *message, int msgLen, PNGWriter *writer, const StegoOptions& options);
+void runAESPipelines(const StegoOptions& options, const std::function<void(const StegoOptions&)>& payload,
+                     const std::function<void(const StegoOptions&)>& key);
+void runPipelines(const StegoOptions& options, bool concurrent, size_t count, const std::function<void(size_t, const StegoOptions&)>& pipeline);
+void writeBigEndian32(uint8_t *p, uint32_t value);
+size_t shardRoom(const std::string& inputFile, int bitsPerSample);
+EVP_CIPHER_CTX *cipherContext();
+std::vector<uint8_t> encryptMessage(const unsigned char *message, int msgLen, unsigned char *keyMessage, StegoStats *stats);
+std::string decryptMessage(const std::vector<uint8_t>& ciphertext, const std::vector<uint8_t>& keyMessage, StegoStats *stats);
+std::vector<uint8_t> encryptWithKey(const unsigned char *message, int msgLen, const unsigned char *key, const unsigned char *iv);
+std::string decryptWithKey(const uint8_t *ciphertext, size_t ciphertextLen, const unsigned char *key, const unsigned char *iv);
+void hashImagePixels(const MappedPNG& png, unsigned char *digest, StegoStats *stats, StegoProgress *progress);
+void deriveImageKey(const unsigned char *pixelHash, const unsigned char *salt, unsigned char *key);
+std::vector<uint8_t> encryptDerived(const MappedPNG& keyPng, const unsigned char *message, int msgLen, StegoStats *stats, StegoProgress *progress);
+std::string decryptDerived(const std::vector<uint8_t>& payload, const unsigned char *pixelHash, StegoStats *stats);
+
+void parseIHDR(const PNGChunk& header, ChunkIHDR *chunk);
+int bytesPerPixelOf(const ChunkIHDR *chunk);
+std::vector<uint8_t> storeIDATChunk(const std::vector<uint8_t>& decompressedData);
+
+void initIDATInflater(IDATInflater *inflater, const MappedPNG& png, StegoStats *stats, StegoProgress *progress);
+void clearIDATInflater(IDATInflater *inflater);
+bool feedIDATChunk(IDATInflater *inflater);
+bool inflateScanline(IDATInflater *inflater, uint8_t *scanline, size_t scanlineLen);
+void endIDATInflater(IDATInflater *inflater);
+
+int resolveThreads(int threads);
+void initIDATDeflater(IDATDeflater *deflater, PNGWriter *writer, size_t imageDataLen, int threads, const EncoderSettings& settings, StegoStats *stats);
+void deflateScanline(IDATDeflater *deflater, const uint8_t *scanline, size_t scanlineLen);
+void finishIDATDeflater(IDATDeflater *deflater);
+void clearIDATDeflater(IDATDeflater *deflater);
+void endIDATDeflater(IDATDeflater *deflater);
+void writeDeflatedIDAT(IDATDeflater *deflater);
+void bufferDeflatedIDAT(IDATDeflater *deflater, const uint8_t *data, size_t len);
+
+void encodeScanlines(IDATInflater *inflater, IDATDeflater *deflater, MessageEmbedder *embedder, const FilterKernels *kernels, uint32_t height, size_t scanlineLen, bool adaptiveFilter,
+                     int threads, StegoStats *stats);
+bool embedRow(MessageEmbedder *embedder, const uint8_t *origScanline, uint8_t *embeddedScanline, size_t scanlineLen, StegoStats *stats);
+size_t refilterBandRows(size_t scanlineLen, int threads);
+void initRefilterBand(RefilterBand *band, const FilterKernels *kernels, size_t scanlineLen, bool adaptiveFilter, int threads, size_t maxRows, uint8_t *embedded,
+                      uint8_t *candidate);
+uint8_t *nextBandRow(RefilterBand *band);
+void refilterBand(RefilterBand *band, uint8_t *filteredRows, StegoStats *stats);
+void deflateRows(IDATDeflater *deflater, const uint8_t *rows, size_t numRows, size_t scanlineLen);
+bool usePipelinedEncode(const StegoOptions& options, uint32_t height, size_t scanlineLen);
+void encodeScanlinesPipelined(IDATInflater *inflater, IDATDeflater *deflater, MessageEmbedder *embedder, const FilterKernels *kernels, uint32_t height,
+                              size_t scanlineLen, bool adaptiveFilter, int threads, StegoStats *stats);
+void inflateStage(StageRing *ring, IDATInflater *inflater);
+void embedStage(StageRing *ring, MessageEmbedder *embedder, const FilterKernels *kernels, bool adaptiveFilter, int threads, StegoStats *stats);
+void deflateStage(StageRing *ring, IDATDeflater *deflater);
+bool waitForStage(const StageRing *ring, const std::atomic<uint64_t>& cursor, uint64_t target);
+uint8_t *batchRows(StageRing *ring, uint64_t batch, size_t *numRows);
+
+bool messageFits(int msgLen, size_t numSamples, int bitsPerSample);
+size_t maxMessageLen(size_t numSamples, int bitsPerSample);
+void initMessageEmbedder(MessageEmbedder *embedder, const unsigned char *message, int msgLen, int bitsPerSample);
+void embedScanline(MessageEmbedder *embedder, uint8_t *scanline, size_t scanlineLen);
+void embedBits(const BitPackKernels *kernels, int depth, const uint8_t *data, size_t numBits, size_t *bitIndex, uint8_t **samples, size_t *numSamples);
+void initMessageExtractor(MessageExtractor *extractor, size_t numSamples);
+bool extractScanline(MessageExtractor *extractor, const uint8_t *scanline, size_t scanlineLen);
+void extractBits(const BitPackKernels *kernels, int depth, uint8_t *data, size_t numBits, size_t *bitIndex, const uint8_t **samples, size_t *numSamples);
+void readMessageHeader(MessageExtractor *extractor);
+void startMessage(MessageExtractor *extractor, int bitsPerSample, size_t msgLen, const uint8_t *readSoFar, size_t readSoFarLen);
+bool hasTaggedHeader(const MessageExtractor *extractor);
+std::vector<uint8_t> extractedMessage(MessageExtractor *extractor);
+
+std::vector<uint8_t> decodeMessage(IDATInflater *inflater, const FilterKernels *kernels, size_t scanlineLen, uint32_t height, StegoStats *stats);
+
+// Each entry point counts its own work outside the stages as other
+void encodePlaintext(char *inputFile, unsigned char *message, int msgLen, char *outputFile, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    steganographer(ENCODE, inputFile, message, msgLen, outputFile, options);
+}
 
-bool isFilePng(std::ifstream& img);
-void parseIHDR(std::ifstream& img, ChunkIHDR *chunk);
-int findIDAT(std::ifstream& img, uint32_t *sizeIDAT);
-std::vector<uint8_t> readIDATChunk(std::ifstream& img, size_t len);
-std::vector<uint8_t> decompressIDATChunk(std::vector<uint8_t> compressedData, int maxOutputLen);
-std::vector<uint8_t> compressIDATChunk(std::vector<uint8_t> decompressedData);
+std::string decodePlaintext(char *inputFile, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    std::vector<uint8_t> outputVec = steganographer(DECODE, inputFile, NULL, 0, NULL, options);
+    std::string outputStr(outputVec.begin(), outputVec.end());
+    return outputStr;
+}
 
-void processFilter(std::vector<uint8_t>& data, int scanlineLen, int bytesPerPixel);
-void processFilterSub(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel);
-void processFilterUp(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel);
-void processFilterAvg(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel);
-uint8_t paethPredictor(uint8_t left, uint8_t above, uint8_t upperLeft);
-void processFilterPaeth(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel);
+// Resets the cipher context and reports the first queued OpenSSL error
+void handleEVPErrors(EVP_CIPHER_CTX *ctx) {
+    EVP_CIPHER_CTX_reset(ctx);
 
-void refilter(std::vector<uint8_t>& data, int scanlineLen, int bytesPerPixel);
-void refilterSub(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel);
-void refilterUp(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel);
-void refilterAvg(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel);
-void refilterPaeth(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel);
+    char reason[256];
+    ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+    ERR_clear_error();
+    throw StegoError(std::string("OpenSSL error: ") + reason);
+}
 
-void embedMessage(std::vector<uint8_t>& data, unsigned char *message, int msgLen, int scanlineLen);
-void createPNG(std::vector<uint8_t> compressedData, char *originalFileName, std::ifstream& img, int IDATDataStartPos, uint32_t originalIDATChunkSize, int maxOutputLen, char *outputFileString);
-void readRestIDATs(std::vector<uint8_t>& compressedData, std::ifstream& img);
-std::vector<uint8_t> decodeMessage(std::vector<uint8_t>& decompressedData, int scanlineLen);
+void encodeAES(char *inputFile, unsigned char *message, int msgLen, char *outputFile, char *inputKeyFile, char *outputKeyFile, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    unsigned char keyMessage[48];
+    std::vector<uint8_t> ciphertext = encryptMessage(message, msgLen, keyMessage, options.stats);
 
-void encodePlaintext(char *inputFile, unsigned char *message, int msgLen, char *outputFile) {
-    steganographer(ENCODE, inputFile, message, msgLen, outputFile);
+    runAESPipelines(options, [&](const StegoOptions& payloadOptions) {
+        steganographer(ENCODE, inputFile, (unsigned char *) ciphertext.data(), ciphertext.size(), outputFile, payloadOptions);
+    }, [&](const StegoOptions& keyOptions) {
+        steganographer(ENCODE, inputKeyFile, keyMessage, sizeof(keyMessage), outputKeyFile, keyOptions);
+    });
 }
 
-std::string decodePlaintext(char *inputFile) {
-    std::vector<uint8_t> outputVec = steganographer(DECODE, inputFile, NULL, 0, NULL);
-    std::string outputStr(outputVec.begin(), outputVec.end());
-    return outputStr;
+std::string decodeAES(char *inputFile, char *inputKeyFile, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    std::vector<uint8_t> ciphertext;
+    std::vector<uint8_t> keyMessageVector;
+    runAESPipelines(options, [&](const StegoOptions& payloadOptions) {
+        ciphertext = steganographer(DECODE, inputFile, NULL, 0, NULL, payloadOptions);
+    }, [&](const StegoOptions& keyOptions) {
+        keyMessageVector = steganographer(DECODE, inputKeyFile, NULL, 0, NULL, keyOptions);
+    });
+    return decryptMessage(ciphertext, keyMessageVector, options.stats);
 }
 
-void handleEVPErrors(void) {
-    ERR_print_errors_fp(stderr);
-    abort();
+std::vector<uint8_t> encodePlaintextBuffer(const uint8_t *png, size_t pngLen, const unsigned char *message, int msgLen, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    MappedPNG input(png, pngLen, options.stats);
+    std::vector<uint8_t> output;
+    PNGWriter writer(&output, options.IDATSize, options.stats);
+    steganographer(ENCODE, input, message, msgLen, &writer, options);
+    return output;
 }
 
-void encodeAES(char *inputFile, unsigned char *message, int msgLen, char *outputFile, char *inputKeyFile, char *outputKeyFile) {
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int ciphertext_len;
-    std::vector<uint8_t> ciphertext(msgLen + EVP_CIPHER_block_size(EVP_aes_256_cbc()));
-    unsigned char key[32]; // 256 bits
-    unsigned char iv[16];
+std::string decodePlaintextBuffer(const uint8_t *png, size_t pngLen, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    MappedPNG input(png, pngLen, options.stats);
+    std::vector<uint8_t> outputVec = steganographer(DECODE, input, NULL, 0, NULL, options);
+    return std::string(outputVec.begin(), outputVec.end());
+}
+
+void encodeAESBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen, const unsigned char *message, int msgLen,
+                     std::vector<uint8_t> *output, std::vector<uint8_t> *keyOutput, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    unsigned char keyMessage[48];
+    std::vector<uint8_t> ciphertext = encryptMessage(message, msgLen, keyMessage, options.stats);
+
+    runAESPipelines(options, [&](const StegoOptions& payloadOptions) {
+        *output = encodePlaintextBuffer(png, pngLen, ciphertext.data(), ciphertext.size(), payloadOptions);
+    }, [&](const StegoOptions& keyOptions) {
+        *keyOutput = encodePlaintextBuffer(keyPng, keyPngLen, keyMessage, sizeof(keyMessage), keyOptions);
+    });
+}
+
+std::string decodeAESBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    std::vector<uint8_t> ciphertext;
+    std::vector<uint8_t> keyMessageVector;
+    runAESPipelines(options, [&](const StegoOptions& payloadOptions) {
+        MappedPNG input(png, pngLen, payloadOptions.stats);
+        ciphertext = steganographer(DECODE, input, NULL, 0, NULL, payloadOptions);
+    }, [&](const StegoOptions& keyOptions) {
+        MappedPNG keyInput(keyPng, keyPngLen, keyOptions.stats);
+        keyMessageVector = steganographer(DECODE, keyInput, NULL, 0, NULL, keyOptions);
+    });
+    return decryptMessage(ciphertext, keyMessageVector, options.stats);
+}
+
+// The key image is hashed in one read-only pass, then only the payload
+// image is encoded
+void encodeAESDerived(char *inputFile, unsigned char *message, int msgLen, char *outputFile, char *keyFile, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    std::vector<uint8_t> payload;
+    {
+        MappedPNG keyPng(keyFile, options.stats);
+        payload = encryptDerived(keyPng, message, msgLen, options.stats, options.progress);
+    }
+    steganographer(ENCODE, inputFile, payload.data(), payload.size(), outputFile, options);
+}
+
+std::string decodeAESDerived(char *inputFile, char *keyFile, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    std::vector<uint8_t> payload;
+    unsigned char pixelHash[SHA256_DIGEST_LENGTH];
+    runAESPipelines(options, [&](const StegoOptions& payloadOptions) {
+        payload = steganographer(DECODE, inputFile, NULL, 0, NULL, payloadOptions);
+    }, [&](const StegoOptions& keyOptions) {
+        MappedPNG keyPng(keyFile, keyOptions.stats);
+        StageTimer keyTimer(keyOptions.stats, STAGE_DECRYPT);
+        hashImagePixels(keyPng, pixelHash, keyOptions.stats, keyOptions.progress);
+    });
+    return decryptDerived(payload, pixelHash, options.stats);
+}
+
+std::vector<uint8_t> encodeAESDerivedBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen, const unsigned char *message,
+                                            int msgLen, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    MappedPNG keyInput(keyPng, keyPngLen, options.stats);
+    std::vector<uint8_t> payload = encryptDerived(keyInput, message, msgLen, options.stats, options.progress);
+    return encodePlaintextBuffer(png, pngLen, payload.data(), payload.size(), options);
+}
+
+std::string decodeAESDerivedBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    std::vector<uint8_t> payload;
+    unsigned char pixelHash[SHA256_DIGEST_LENGTH];
+    runAESPipelines(options, [&](const StegoOptions& payloadOptions) {
+        MappedPNG input(png, pngLen, payloadOptions.stats);
+        payload = steganographer(DECODE, input, NULL, 0, NULL, payloadOptions);
+    }, [&](const StegoOptions& keyOptions) {
+        MappedPNG keyInput(keyPng, keyPngLen, keyOptions.stats);
+        StageTimer keyTimer(keyOptions.stats, STAGE_DECRYPT);
+        hashImagePixels(keyInput, pixelHash, keyOptions.stats, keyOptions.progress);
+    });
+    return decryptDerived(payload, pixelHash, options.stats);
+}
+
+// The payload and key images share nothing until decryption, so they go
+// through their pipelines side by side
+void runAESPipelines(const StegoOptions& options, const std::function<void(const StegoOptions&)>& payload,
+                     const std::function<void(const StegoOptions&)>& key) {
+    runPipelines(options, options.concurrentAES, 2, [&payload, &key](size_t index, const StegoOptions& pipelineOptions) {
+        if (index == 0) {
+            payload(pipelineOptions);
+        } else {
+            key(pipelineOptions);
+        }
+    });
+}
+
+// Runs whole-image pipelines 1 to count - 1 on the pipeline pool while this
+// thread runs pipeline 0. Each pool pipeline counts into stats of its own,
+// merged in once all are done, so stage times add up every thread's work.
+// The first error by index is passed on once every pipeline has finished.
+void runPipelines(const StegoOptions& options, bool concurrent, size_t count, const std::function<void(size_t, const StegoOptions&)>& pipeline) {
+    if (!concurrent || count < 2 || std::thread::hardware_concurrency() < 2) {
+        for (size_t i = 0; i < count; i++) {
+            pipeline(i, options);
+        }
+        return;
+    }
+
+    std::vector<StegoStats> stats(count);
+    std::vector<StegoOptions> pipelineOptions(count, options);
+    std::vector<std::future<void>> done;
+    for (size_t i = 1; i < count; i++) {
+        pipelineOptions[i].stats = options.stats != NULL ? &stats[i] : NULL;
+        done.push_back(ThreadPool::pipelines().submit([&pipeline, &pipelineOptions, i]() { pipeline(i, pipelineOptions[i]); }));
+    }
+
+    // The pool pipelines refer to this frame, so they all finish first
+    std::exception_ptr error;
+    try {
+        pipeline(0, options);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    for (std::future<void>& pipelineDone : done) {
+        try {
+            pipelineDone.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    if (options.stats != NULL) {
+        for (size_t i = 1; i < count; i++) {
+            mergeStats(options.stats, stats[i]);
+        }
+    }
+}
+
+void writeBigEndian32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// Message bytes a carrier holds past its shard header. A carrier too small
+// for the header is an error here, so capacity and shard agree on it.
+size_t shardRoom(const std::string& inputFile, int bitsPerSample) {
+    size_t carrierCapacity = messageCapacity(inputFile.c_str(), bitsPerSample);
+    if (carrierCapacity < SHARD_HEADER_SIZE) {
+        throw StegoError("Carrier is too small to hold a shard: " + inputFile);
+    }
+    return carrierCapacity - SHARD_HEADER_SIZE;
+}
+
+size_t shardCapacity(const std::vector<std::string>& inputFiles, int bitsPerSample) {
+    size_t capacity = 0;
+    for (const std::string& inputFile : inputFiles) {
+        capacity += shardRoom(inputFile, bitsPerSample);
+    }
+    return capacity;
+}
+
+// Each carrier gets a share of the message in proportion to how much it
+// holds, so the shards take about as long as each other to encode
+void encodeShards(const std::vector<std::string>& inputFiles, const unsigned char *message, size_t msgLen, const std::vector<std::string>& outputFiles,
+                  const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    if (inputFiles.empty() || inputFiles.size() != outputFiles.size()) {
+        throw StegoError("Sharding needs one output per carrier");
+    }
+    if (inputFiles.size() > UINT32_MAX) {
+        throw StegoError("Too many carriers to shard across");
+    }
+
+    std::vector<size_t> capacities;
+    size_t totalCapacity = 0;
+    for (const std::string& inputFile : inputFiles) {
+        capacities.push_back(shardRoom(inputFile, options.bitsPerSample));
+        totalCapacity += capacities.back();
+    }
+    if (msgLen > totalCapacity) {
+        throw StegoError("Message is too long! The carriers hold " + std::to_string(totalCapacity) + " bytes between them");
+    }
+
+    std::vector<size_t> shardLens;
+    size_t assigned = 0;
+    for (size_t capacity : capacities) {
+        // Carriers with no room past their headers can only hold an empty
+        // message, which every shard gets none of
+        if (totalCapacity == 0) {
+            shardLens.push_back(0);
+            continue;
+        }
+        shardLens.push_back(std::min(capacity, (size_t) ((long double) msgLen * capacity / totalCapacity)));
+        assigned += shardLens.back();
+    }
+    // Rounding down leaves a few bytes over, which go wherever there is room
+    for (size_t i = 0; assigned < msgLen; i++) {
+        size_t extra = std::min(msgLen - assigned, capacities[i] - shardLens[i]);
+        shardLens[i] += extra;
+        assigned += extra;
+    }
+
+    uint8_t header[SHARD_HEADER_SIZE];
+    memcpy(header, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+    header[4] = SHARD_HEADER_VERSION;
+    writeBigEndian32(header + 9, inputFiles.size());
+    writeBigEndian32(header + 13, msgLen >> 32);
+    writeBigEndian32(header + 17, msgLen);
+    {
+        StageTimer hashTimer(options.stats, STAGE_ENCRYPT);
+        EVP_Digest(message, msgLen, header + 21, NULL, EVP_sha256(), NULL);
+        addStageBytes(options.stats, STAGE_ENCRYPT, msgLen, 0);
+    }
+
+    std::vector<size_t> offsets(shardLens.size(), 0);
+    for (size_t i = 1; i < shardLens.size(); i++) {
+        offsets[i] = offsets[i - 1] + shardLens[i - 1];
+    }
+
+    // Outputs are only renamed into place once every shard is encoded and
+    // written out, so a failed shard leaves none of them behind
+    std::vector<std::unique_ptr<PNGWriter>> writers(inputFiles.size());
+    runPipelines(options, true, inputFiles.size(), [&](size_t index, const StegoOptions& shardOptions) {
+        std::vector<uint8_t> shard(header, header + SHARD_HEADER_SIZE);
+        writeBigEndian32(shard.data() + 5, index);
+        shard.insert(shard.end(), message + offsets[index], message + offsets[index] + shardLens[index]);
+
+        MappedPNG png(inputFiles[index].c_str(), shardOptions.stats);
+        writers[index].reset(new PNGWriter(outputFiles[index].c_str(), shardOptions.IDATSize, shardOptions.stats));
+        steganographer(ENCODE, png, shard.data(), shard.size(), writers[index].get(), shardOptions);
+    });
+
+    for (std::unique_ptr<PNGWriter>& writer : writers) {
+        writer->finish();
+    }
+    // A rename can still fail, and then the shards already renamed go too
+    for (size_t i = 0; i < writers.size(); i++) {
+        try {
+            writers[i]->commit();
+        } catch (const StegoError&) {
+            for (size_t j = 0; j < i; j++) {
+                remove(outputFiles[j].c_str());
+            }
+            throw;
+        }
+    }
+}
+
+std::string decodeShards(const std::vector<std::string>& inputFiles, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    if (inputFiles.empty()) {
+        throw StegoError("No shards to decode");
+    }
+
+    std::vector<std::vector<uint8_t>> shards(inputFiles.size());
+    runPipelines(options, true, inputFiles.size(), [&](size_t index, const StegoOptions& shardOptions) {
+        shards[index] = steganographer(DECODE, (char *) inputFiles[index].c_str(), NULL, 0, NULL, shardOptions);
+    });
+
+    // Every shard has to agree on the count, length and hash of the message,
+    // and each index has to turn up exactly once
+    const uint8_t *first = NULL;
+    std::vector<size_t> order;
+    for (size_t i = 0; i < shards.size(); i++) {
+        const std::vector<uint8_t>& shard = shards[i];
+        if (shard.size() < SHARD_HEADER_SIZE || memcmp(shard.data(), SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0) {
+            throw StegoError("Image does not hold a shard: " + inputFiles[i]);
+        }
+        if (shard[4] != SHARD_HEADER_VERSION) {
+            throw StegoError("Unsupported shard header version: " + std::to_string(shard[4]));
+        }
+        if (first == NULL) {
+            first = shard.data();
+            uint32_t count = readBigEndian32(first + 9);
+            if (count != shards.size()) {
+                throw StegoError("Message was split into " + std::to_string(count) + " shards, but " + std::to_string(shards.size()) + " were given");
+            }
+            order.assign(count, shards.size());
+        } else if (memcmp(shard.data() + 9, first + 9, SHARD_HEADER_SIZE - 9) != 0) {
+            throw StegoError("Shard belongs to a different message: " + inputFiles[i]);
+        }
+
+        uint32_t index = readBigEndian32(shard.data() + 5);
+        if (index >= order.size()) {
+            throw StegoError("Shard index out of range: " + inputFiles[i]);
+        }
+        if (order[index] != shards.size()) {
+            throw StegoError("Shard " + std::to_string(index) + " given twice: " + inputFiles[order[index]] + " and " + inputFiles[i]);
+        }
+        order[index] = i;
+    }
+
+    size_t msgLen = ((size_t) readBigEndian32(first + 13) << 32) | readBigEndian32(first + 17);
+    std::string message;
+    message.reserve(msgLen);
+    for (size_t i : order) {
+        message.append(shards[i].begin() + SHARD_HEADER_SIZE, shards[i].end());
+    }
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    {
+        StageTimer hashTimer(options.stats, STAGE_DECRYPT);
+        EVP_Digest(message.data(), message.size(), digest, NULL, EVP_sha256(), NULL);
+        addStageBytes(options.stats, STAGE_DECRYPT, message.size(), message.size());
+    }
+    if (message.size() != msgLen || memcmp(digest, first + 21, sizeof(digest)) != 0) {
+        throw StegoError("Reassembled message does not match its hash");
+    }
+    return message;
+}
+
+// One cipher context per thread, reset after each use rather than freed,
+// so a worker does not allocate one per message
+EVP_CIPHER_CTX *cipherContext() {
+    static thread_local std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+    if (!ctx) {
+        throw StegoError("Could not allocate a cipher context");
+    }
+    return ctx.get();
+}
+
+// Encrypts with a fresh random key and IV, which go into keyMessage as
+// 32 bytes of key followed by 16 of IV
+std::vector<uint8_t> encryptMessage(const unsigned char *message, int msgLen, unsigned char *keyMessage, StegoStats *stats) {
+    StageTimer timer(stats, STAGE_ENCRYPT);
+    unsigned char key[AES_KEY_SIZE]; // 256 bits
+    unsigned char iv[AES_IV_SIZE];
 
     if (!RAND_bytes(key, sizeof(key))) {
-        std::cerr << "Error generating random key\n";
-        exit(1);
+        throw StegoError("Error generating random key");
     }
 
     if (!RAND_bytes(iv, sizeof(iv))) {
-        std::cerr << "Error generating random IV\n";
-        exit(1);
+        throw StegoError("Error generating random IV");
     }
-    
-    if(!(ctx = EVP_CIPHER_CTX_new())) {
-        handleEVPErrors();
+
+    std::vector<uint8_t> ciphertext = encryptWithKey(message, msgLen, key, iv);
+
+    memcpy(keyMessage, key, sizeof(key));
+    memcpy(keyMessage + sizeof(key), iv, sizeof(iv));
+    addStageBytes(stats, STAGE_ENCRYPT, msgLen, ciphertext.size());
+    noteStageBuffer(stats, STAGE_ENCRYPT, ciphertext.capacity());
+    return ciphertext;
+}
+
+std::string decryptMessage(const std::vector<uint8_t>& ciphertext, const std::vector<uint8_t>& keyMessageVector, StegoStats *stats) {
+    StageTimer timer(stats, STAGE_DECRYPT);
+    if (keyMessageVector.size() < AES_KEY_SIZE + AES_IV_SIZE) {
+        throw StegoError("Key image does not hold an AES key and IV");
     }
 
+    const unsigned char *key = keyMessageVector.data();
+    const unsigned char *iv = keyMessageVector.data() + AES_KEY_SIZE;
+    std::string plaintext = decryptWithKey(ciphertext.data(), ciphertext.size(), key, iv);
+    addStageBytes(stats, STAGE_DECRYPT, ciphertext.size(), plaintext.size());
+    noteStageBuffer(stats, STAGE_DECRYPT, plaintext.capacity());
+    return plaintext;
+}
+
+std::vector<uint8_t> encryptWithKey(const unsigned char *message, int msgLen, const unsigned char *key, const unsigned char *iv) {
+    EVP_CIPHER_CTX *ctx;
+    int len;
+    int ciphertext_len;
+    std::vector<uint8_t> ciphertext(msgLen + EVP_CIPHER_block_size(EVP_aes_256_cbc()));
+
+    ctx = cipherContext();
+
     if(EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1)
-        handleEVPErrors();
+        handleEVPErrors(ctx);
 
     if(EVP_EncryptUpdate(ctx, (unsigned char *) ciphertext.data(), &len, message, msgLen) != 1) {
-        handleEVPErrors();
+        handleEVPErrors(ctx);
     }
 
     ciphertext_len = len;
     
     if(EVP_EncryptFinal_ex(ctx, (unsigned char *) ciphertext.data() + len, &len) != 1) {     
-        handleEVPErrors();
+        handleEVPErrors(ctx);
     }
 
     ciphertext_len += len;
     ciphertext.resize(ciphertext_len);
 
-    EVP_CIPHER_CTX_free(ctx);
-    
-    unsigned char keyMessage[48];
-    memcpy(keyMessage, key, sizeof(key));
-    memcpy(keyMessage + sizeof(key), iv, sizeof(iv));
-
-    steganographer(ENCODE, inputFile, (unsigned char *) ciphertext.data(), ciphertext_len, outputFile);
-    steganographer(ENCODE, inputKeyFile, keyMessage, 48, outputKeyFile);
+    EVP_CIPHER_CTX_reset(ctx);
+    return ciphertext;
 }
 
-std::string decodeAES(char *inputFile, char *inputKeyFile) {
+std::string decryptWithKey(const uint8_t *ciphertext, size_t ciphertextLen, const unsigned char *key, const unsigned char *iv) {
     EVP_CIPHER_CTX *ctx;
     int len;
     int plaintext_len;
-    std::vector<uint8_t> ciphertext = steganographer(DECODE, inputFile, NULL, 0, NULL);
-    std::vector<uint8_t> keyMessageVector = steganographer(DECODE, inputKeyFile, NULL, 0, NULL);
-    std::vector<uint8_t> plaintext(ciphertext.size() + EVP_CIPHER_block_size(EVP_aes_256_cbc()));
+    std::vector<uint8_t> plaintext(ciphertextLen + EVP_CIPHER_block_size(EVP_aes_256_cbc()));
 
-    unsigned char key[32]; // 256 bits
-    unsigned char iv[16];
-    memcpy(key, keyMessageVector.data(), sizeof(key));
-    memcpy(iv, keyMessageVector.data() + sizeof(key), sizeof(iv));
-
-    if(!(ctx = EVP_CIPHER_CTX_new())) {
-        handleEVPErrors();
-    }
+    ctx = cipherContext();
 
     if(EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1) {
-        handleEVPErrors();
+        handleEVPErrors(ctx);
     }
         
-    if(EVP_DecryptUpdate(ctx, (unsigned char *) plaintext.data(), &len, (unsigned char *) ciphertext.data(), ciphertext.size()) != 1) {
-        handleEVPErrors();
+    if(EVP_DecryptUpdate(ctx, (unsigned char *) plaintext.data(), &len, ciphertext, ciphertextLen) != 1) {
+        handleEVPErrors(ctx);
     }
 
     plaintext_len = len;
     
     if(EVP_DecryptFinal_ex(ctx, (unsigned char *) plaintext.data() + len, &len) != 1) {
-        handleEVPErrors();
+        handleEVPErrors(ctx);
     }
 
     plaintext_len += len;
     plaintext.resize(plaintext_len);
 
-    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_CTX_reset(ctx);
 
     std::string plaintextStr(plaintext.begin(), plaintext.end());
     return plaintextStr;
 }
 
-std::vector<uint8_t> steganographer(int mode, char *inputFile, unsigned char *message, int msgLen, char *outputFile) {
-    std::ifstream img(inputFile, std::ios::binary);
-    if (!isFilePng(img)) {
-        std::cerr << "File is not a PNG\n";
-        exit(1);
+// SHA-256 over the IHDR and the unfiltered rows less their filter bytes, in
+// one streaming pass with nothing written. Re-saving the key image with
+// other filters or compression keeps its key, but changing any pixel does
+// not.
+void hashImagePixels(const MappedPNG& png, unsigned char *digest, StegoStats *stats, StegoProgress *progress) {
+    ChunkIHDR chunkIHDR;
+    parseIHDR(png.chunks()[0], &chunkIHDR);
+    int bytesPerPixel = bytesPerPixelOf(&chunkIHDR);
+
+    if (png.IDATChunks().empty()) {
+        throw StegoError("IDAT Chunk not found");
     }
 
-    ChunkIHDR chunkIHDR;
-    parseIHDR(img, &chunkIHDR);
+    size_t scanlineLen = ((size_t) chunkIHDR.width * bytesPerPixel) + 1;
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
 
-    if (chunkIHDR.colourWidth != 8) {
-        std::cerr << "Please select other PNG image!\n";
-        img.close();
-        exit(1);
+    std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX *)> hash(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if (!hash || EVP_DigestInit_ex(hash.get(), EVP_sha256(), NULL) != 1) {
+        throw StegoError("Could not start hashing the key image");
     }
+    EVP_DigestUpdate(hash.get(), png.chunks()[0].data, png.chunks()[0].len);
+
+    PooledBuffer scanline(scanlineLen);
+    PooledBuffer prevScanline(scanlineLen, true);
+    noteStageBuffer(stats, STAGE_INFLATE, 2 * scanlineLen);
+
+    IDATInflater inflater;
+    clearIDATInflater(&inflater);
+    try {
+        initIDATInflater(&inflater, png, stats, progress);
+        for (uint32_t row = 0; row < chunkIHDR.height; row++) {
+            if (!inflateScanline(&inflater, scanline.data(), scanlineLen)) {
+                throw StegoError("Key image data ended unexpectedly");
+            }
 
-    int bytesPerPixel;
-    switch(chunkIHDR.colourType) {
-        case 0:
-            bytesPerPixel = 1;
-            break;
-        case 2:
-            bytesPerPixel = 3;
-            break;
-        case 4:
-            bytesPerPixel = 2;
-            break;
-        case 6:
-            bytesPerPixel = 4;
-            break;
-        default:
-            std::cerr << "Unimplemented colour type: " << chunkIHDR.colourType << '\n';
-            exit(1);
+            {
+                StageTimer timer(stats, STAGE_UNFILTER);
+                addStageBytes(stats, STAGE_UNFILTER, scanlineLen, scanlineLen);
+                unfilterScanline(kernels, scanline.data(), prevScanline.data(), scanlineLen);
+            }
+
+            EVP_DigestUpdate(hash.get(), scanline.data() + 1, scanlineLen - 1);
+            std::swap(scanline, prevScanline);
+        }
+    } catch (...) {
+        endIDATInflater(&inflater);
+        throw;
+    }
+    endIDATInflater(&inflater);
+
+    EVP_DigestFinal_ex(hash.get(), digest, NULL);
+}
+
+// HKDF-SHA256 with the pixel hash as input key material
+void deriveImageKey(const unsigned char *pixelHash, const unsigned char *salt, unsigned char *key) {
+    std::unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL), EVP_PKEY_CTX_free);
+    size_t keyLen = AES_KEY_SIZE;
+    if (!ctx || EVP_PKEY_derive_init(ctx.get()) <= 0 || EVP_PKEY_CTX_set_hkdf_md(ctx.get(), EVP_sha256()) <= 0 ||
+        EVP_PKEY_CTX_set1_hkdf_salt(ctx.get(), salt, DERIVED_SALT_SIZE) <= 0 ||
+        EVP_PKEY_CTX_set1_hkdf_key(ctx.get(), pixelHash, SHA256_DIGEST_LENGTH) <= 0 ||
+        EVP_PKEY_CTX_add1_hkdf_info(ctx.get(), (const unsigned char *) DERIVED_KEY_INFO, sizeof(DERIVED_KEY_INFO) - 1) <= 0 ||
+        EVP_PKEY_derive(ctx.get(), key, &keyLen) <= 0) {
+        ERR_clear_error();
+        throw StegoError("Could not derive a key from the key image");
+    }
+}
+
+// Salt, IV, then the message encrypted under the key derived from the key
+// image with that salt
+std::vector<uint8_t> encryptDerived(const MappedPNG& keyPng, const unsigned char *message, int msgLen, StegoStats *stats, StegoProgress *progress) {
+    StageTimer timer(stats, STAGE_ENCRYPT);
+    unsigned char pixelHash[SHA256_DIGEST_LENGTH];
+    hashImagePixels(keyPng, pixelHash, stats, progress);
+
+    unsigned char salt[DERIVED_SALT_SIZE];
+    unsigned char iv[AES_IV_SIZE];
+    if (!RAND_bytes(salt, sizeof(salt)) || !RAND_bytes(iv, sizeof(iv))) {
+        throw StegoError("Error generating random salt and IV");
+    }
+
+    unsigned char key[AES_KEY_SIZE];
+    deriveImageKey(pixelHash, salt, key);
+    std::vector<uint8_t> ciphertext = encryptWithKey(message, msgLen, key, iv);
+    OPENSSL_cleanse(key, sizeof(key));
+
+    std::vector<uint8_t> payload;
+    payload.reserve(sizeof(salt) + sizeof(iv) + ciphertext.size());
+    payload.insert(payload.end(), salt, salt + sizeof(salt));
+    payload.insert(payload.end(), iv, iv + sizeof(iv));
+    payload.insert(payload.end(), ciphertext.begin(), ciphertext.end());
+    addStageBytes(stats, STAGE_ENCRYPT, msgLen, payload.size());
+    noteStageBuffer(stats, STAGE_ENCRYPT, ciphertext.capacity() + payload.capacity());
+    return payload;
+}
+
+std::string decryptDerived(const std::vector<uint8_t>& payload, const unsigned char *pixelHash, StegoStats *stats) {
+    StageTimer timer(stats, STAGE_DECRYPT);
+    if (payload.size() < DERIVED_SALT_SIZE + AES_IV_SIZE) {
+        throw StegoError("Image does not hold a salt and IV");
     }
 
-    uint32_t sizeIDAT;
-    if (!findIDAT(img, &sizeIDAT)) {
-        std::cerr << "IDAT Chunk not found\n";
-        img.close();
-        exit(0);
+    const unsigned char *salt = payload.data();
+    const unsigned char *iv = salt + DERIVED_SALT_SIZE;
+    const uint8_t *ciphertext = iv + AES_IV_SIZE;
+    size_t ciphertextLen = payload.size() - DERIVED_SALT_SIZE - AES_IV_SIZE;
+
+    unsigned char key[AES_KEY_SIZE];
+    deriveImageKey(pixelHash, salt, key);
+    std::string plaintext;
+    try {
+        plaintext = decryptWithKey(ciphertext, ciphertextLen, key, iv);
+    } catch (const StegoError& e) {
+        OPENSSL_cleanse(key, sizeof(key));
+        // Almost always the wrong key image, which fails the padding check
+        throw StegoError(std::string("Could not decrypt, check the key image: ") + e.what());
     }
+    OPENSSL_cleanse(key, sizeof(key));
 
-    size_t IDATDataStartPos = img.tellg();
-    std::vector<uint8_t> compressedData = readIDATChunk(img, sizeIDAT);
+    addStageBytes(stats, STAGE_DECRYPT, payload.size(), plaintext.size());
+    noteStageBuffer(stats, STAGE_DECRYPT, plaintext.capacity());
+    return plaintext;
+}
 
-    readRestIDATs(compressedData, img);
+std::vector<uint8_t> steganographer(int mode, char *inputFile, unsigned char *message, int msgLen, char *outputFile, const StegoOptions& options) {
+    // Checks the signature and chunk layout, and that IHDR comes first
+    MappedPNG png(inputFile, options.stats);
+
+    if (mode == DECODE) {
+        return steganographer(DECODE, png, NULL, 0, NULL, options);
+    }
 
-    int maxOutputLen = (chunkIHDR.height * chunkIHDR.width * 4) + chunkIHDR.height;
-    std::vector<uint8_t> decompressedData = decompressIDATChunk(compressedData, maxOutputLen);
+    // Goes to a temporary file until the encode is done
+    PNGWriter writer(outputFile, options.IDATSize, options.stats);
+    steganographer(ENCODE, png, message, msgLen, &writer, options);
+    writer.commit();
+    return {};
+}
+
+std::vector<uint8_t> steganographer(int mode, const MappedPNG& png, const unsigned char *message, int msgLen, PNGWriter *writer, const StegoOptions& options) {
+    ChunkIHDR chunkIHDR;
+    parseIHDR(png.chunks()[0], &chunkIHDR);
+    int bytesPerPixel = bytesPerPixelOf(&chunkIHDR);
+
+    if (png.IDATChunks().empty()) {
+        throw StegoError("IDAT Chunk not found");
+    }
 
     // + 1 for filter byte
-    int scanlineLen = (chunkIHDR.width * bytesPerPixel) + 1;
+    size_t scanlineLen = ((size_t) chunkIHDR.width * bytesPerPixel) + 1;
 
-    processFilter(decompressedData, scanlineLen, bytesPerPixel);
+    // Filter kernels specialised for this pixel layout, picked once per image
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
 
     if (mode == DECODE) {
         //DECODE
-        std::vector<uint8_t> output = decodeMessage(decompressedData, scanlineLen);
-        img.close();
+        IDATInflater inflater;
+        clearIDATInflater(&inflater);
+        std::vector<uint8_t> output;
+        try {
+            initIDATInflater(&inflater, png, options.stats, options.progress);
+            output = decodeMessage(&inflater, kernels, scanlineLen, chunkIHDR.height, options.stats);
+        } catch (...) {
+            endIDATInflater(&inflater);
+            throw;
+        }
+        endIDATInflater(&inflater);
         return output;
     }
 
-    embedMessage(decompressedData, message, msgLen, scanlineLen);
-    refilter(decompressedData, scanlineLen, bytesPerPixel);
+    size_t numSamples = (size_t) chunkIHDR.height * (scanlineLen - 1);
+    if (!messageFits(msgLen, numSamples, options.bitsPerSample)) {
+        throw StegoError("Message is too long!");
+    }
 
-    std::vector<uint8_t> recompressedData = compressIDATChunk(decompressedData);
-    createPNG(recompressedData, inputFile, img, IDATDataStartPos, sizeIDAT, maxOutputLen, outputFile);
+    // Rows are streamed through inflate, unfilter, embed, refilter and deflate
+    // one at a time, so memory use does not grow with the image. A failed
+    // encode frees the streams before passing the error on.
+    IDATInflater inflater;
+    IDATDeflater deflater;
+    MessageEmbedder embedder;
+    clearIDATInflater(&inflater);
+    clearIDATDeflater(&deflater);
+    try {
+        writeLeadingChunks(*writer, png);
+
+        initIDATInflater(&inflater, png, options.stats, options.progress);
+        EncoderSettings settings = encoderSettings(options.profile);
+        int threads = resolveThreads(options.threads);
+        initIDATDeflater(&deflater, writer, (size_t) chunkIHDR.height * scanlineLen, threads, settings, options.stats);
+        initMessageEmbedder(&embedder, message, msgLen, options.bitsPerSample);
+        addStageBytes(options.stats, STAGE_EMBED, embedder.numBits / 8, 0);
+
+        if (usePipelinedEncode(options, chunkIHDR.height, scanlineLen)) {
+            encodeScanlinesPipelined(&inflater, &deflater, &embedder, kernels, chunkIHDR.height, scanlineLen, settings.adaptiveFilter, threads, options.stats);
+        } else {
+            encodeScanlines(&inflater, &deflater, &embedder, kernels, chunkIHDR.height, scanlineLen, settings.adaptiveFilter, threads, options.stats);
+        }
+
+        finishIDATDeflater(&deflater);
+        endIDATDeflater(&deflater);
+        endIDATInflater(&inflater);
+        writeTrailingChunks(*writer, png);
+    } catch (...) {
+        endIDATInflater(&inflater);
+        endIDATDeflater(&deflater);
+        throw;
+    }
 
-    img.close();
     return {};
 }
 
-bool isFilePng(std::ifstream& img) {
-    uint64_t buffer;
-    img.read(reinterpret_cast<char *>(&buffer), 8);
+void parseIHDR(const PNGChunk& header, ChunkIHDR *chunk) {
+    if (header.len != 13) {
+        throw StegoError(std::string("IHDR Chunk not of expected size: ") + std::to_string(header.len));
+    }
 
-    return buffer == PNG_MAGIC;
+    chunk->width = readBigEndian32(header.data);
+    chunk->height = readBigEndian32(header.data + 4);
+    chunk->colourWidth = header.data[8];
+    chunk->colourType = header.data[9];
+    chunk->compressionMethod = header.data[10];
+    chunk->filterMethod = header.data[11];
+    chunk->enlacementMethod = header.data[12];
+
+    // Rows are sized from these, and an empty row would leave the filters
+    // nothing to work on
+    if (chunk->width == 0 || chunk->height == 0 || chunk->width > 0x7fffffff || chunk->height > 0x7fffffff) {
+        throw StegoError("IHDR dimensions must be between 1 and 2^31 - 1: " + std::to_string(chunk->width) + "x" + std::to_string(chunk->height));
+    }
 }
 
-void parseIHDR(std::ifstream& img, ChunkIHDR *chunk) {
-    uint32_t chunkSize;
-    img.read(reinterpret_cast<char *>(&chunkSize), 4);
-    chunkSize = __builtin_bswap32(chunkSize);
+int bytesPerPixelOf(const ChunkIHDR *chunk) {
+    if (chunk->colourWidth != 8) {
+        throw StegoError("Please select other PNG image!");
+    }
+
+    switch(chunk->colourType) {
+        case 0:
+            return 1;
+        case 2:
+            return 3;
+        case 4:
+            return 2;
+        case 6:
+            return 4;
+        default:
+            throw StegoError(std::string("Unimplemented colour type: ") + std::to_string(chunk->colourType));
+    }
+}
 
-    if (chunkSize != 13) {
-        std::cerr << "IHDR Chunk not of expected size: " << chunkSize << '\n';
-        exit(1);
+std::vector<uint8_t> readIDATData(const MappedPNG& png) {
+    std::vector<uint8_t> compressedData;
+    for (size_t index : png.IDATChunks()) {
+        const PNGChunk& chunk = png.chunks()[index];
+        png.checkCRC(chunk);
+        compressedData.insert(compressedData.end(), chunk.data, chunk.data + chunk.len);
     }
-    // Jump over IHDR
-    img.seekg(4, std::ios::cur);
+    return compressedData;
+}
 
-    uint32_t width;
-    uint32_t height;
-    img.read(reinterpret_cast<char *>(&width), 4);
-    img.read(reinterpret_cast<char *>(&height), 4);
-    chunk->width = __builtin_bswap32(width);
-    chunk->height = __builtin_bswap32(height);
-
-    img.read(reinterpret_cast<char *>(&(chunk->colourWidth)), 1);
-    img.read(reinterpret_cast<char *>(&(chunk->colourType)), 1);
-    img.read(reinterpret_cast<char *>(&(chunk->compressionMethod)), 1);
-    img.read(reinterpret_cast<char *>(&(chunk->filterMethod)), 1);
-    img.read(reinterpret_cast<char *>(&(chunk->enlacementMethod)), 1);
-}
-
-int findIDAT(std::ifstream& img, uint32_t *sizeIDAT) {
-    char byte;
-    while(img.get(byte)) {
-        if (byte == 'I') {
-            char buffer[4] = {0};
-            img.read(buffer, 3);
-            
-            if (strcmp(buffer, "DAT") == 0) {
-                img.seekg(-8, std::ios::cur);
-                img.read(reinterpret_cast<char *>(sizeIDAT), 4);
-                *sizeIDAT = __builtin_bswap32(*sizeIDAT);
-                img.seekg(4, std::ios::cur); 
-                return 1;
-            }
-            // Go back 3 bytes in case we get consecutive I
-            img.seekg(-3, std::ios::cur); 
+// Inflates straight into the result, which is sized up front, rather than
+// through a scratch buffer
+std::vector<uint8_t> decompressIDATChunk(const std::vector<uint8_t>& compressedData, size_t maxOutputLen) {
+    std::vector<uint8_t> decompressedData(maxOutputLen);
+
+    z_stream *inflateStream = takeInflateStream();
+    inflateStream->avail_in = compressedData.size();
+    inflateStream->next_in = const_cast<uint8_t *>(compressedData.data());
+    inflateStream->avail_out = decompressedData.size();
+    inflateStream->next_out = decompressedData.data();
+
+    int ret = inflate(inflateStream, Z_SYNC_FLUSH);
+    size_t remainingIn = inflateStream->avail_in;
+    decompressedData.resize(decompressedData.size() - inflateStream->avail_out);
+    giveInflateStream(inflateStream);
+
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+        throw StegoError(std::string("Error: inflate returned ") + std::to_string(ret));
+    }
+    if (remainingIn != 0) {
+        throw StegoError("Error: inflate did not consume all input");
+    }
+    return decompressedData;
+}
+
+void initIDATInflater(IDATInflater *inflater, const MappedPNG& png, StegoStats *stats, StegoProgress *progress) {
+    inflater->png = &png;
+    inflater->nextIDAT = 0;
+    inflater->streamEnded = false;
+    inflater->stats = stats;
+    inflater->progress = progress;
+    inflater->progressLeft = 0;
+    if (progress != NULL) {
+        for (size_t index : png.IDATChunks()) {
+            inflater->progressLeft += png.chunks()[index].len;
         }
+        addProgressTotal(progress, inflater->progressLeft);
     }
 
-    // IDAT not found
-    return 0;
+    inflater->stream = takeInflateStream();
+    inflater->stream->avail_in = 0;
+    feedIDATChunk(inflater);
 }
 
-std::vector<uint8_t> readIDATChunk(std::ifstream& img, size_t len) {
-    std::vector<uint8_t> compressedData(len);
-    img.read(reinterpret_cast<char *>(compressedData.data()), len);
-    return compressedData;
+// Leaves nothing for endIDATInflater to give back, so it is safe to call
+// before initIDATInflater has run
+void clearIDATInflater(IDATInflater *inflater) {
+    inflater->stream = NULL;
+    inflater->progress = NULL;
 }
 
-std::vector<uint8_t> decompressIDATChunk(std::vector<uint8_t> compressedData, int maxOutputLen) {
-    std::vector<uint8_t> decompressedData;
+bool inflateScanline(IDATInflater *inflater, uint8_t *scanline, size_t scanlineLen) {
+    StageTimer timer(inflater->stats, STAGE_INFLATE);
+    addStageBytes(inflater->stats, STAGE_INFLATE, 0, scanlineLen);
+    z_stream *stream = inflater->stream;
+    stream->avail_out = scanlineLen;
+    stream->next_out = scanline;
 
-    z_stream inflateStream;
-    memset(&inflateStream, 0, sizeof(z_stream));
+    while (stream->avail_out > 0) {
+        if (inflater->streamEnded) {
+            return false;
+        }
 
-    inflateStream.avail_in = compressedData.size();
-    inflateStream.next_in = compressedData.data();
+        if (stream->avail_in == 0) {
+            // Current IDAT exhausted, move on to the next one
+            if (!feedIDATChunk(inflater)) {
+                return false;
+            }
+            continue;
+        }
 
-    int ret = inflateInit(&inflateStream) ;
-    if (ret != Z_OK) {
-        std::cerr << "Error with inflateInit: " << ret << '\n';
-        exit(1);
+        int ret = inflate(stream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            inflater->streamEnded = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            throw StegoError(std::string("Error: inflate returned ") + std::to_string(ret));
+        }
     }
 
-    int bufferLen = maxOutputLen;
-    uint8_t *buffer = (uint8_t *) malloc(bufferLen);
+    return true;
+}
 
-    inflateStream.avail_out = bufferLen;
-    inflateStream.next_out = buffer;
+bool feedIDATChunk(IDATInflater *inflater) {
+    const std::vector<size_t>& IDATs = inflater->png->IDATChunks();
+    if (inflater->nextIDAT == IDATs.size()) {
+        return false;
+    }
 
-    ret = inflate(&inflateStream, Z_SYNC_FLUSH);
-    if (ret != Z_OK && ret != Z_STREAM_END) {
-        printf("Error: inflate returned %d\n", ret);
-        free(buffer);
-        inflateEnd(&inflateStream);
-        exit(1);
+    // A chunk's CRC is only checked once inflate is about to read it, so a
+    // decode that stops early never touches the rest of the image data
+    const PNGChunk& chunk = inflater->png->chunks()[IDATs[inflater->nextIDAT++]];
+    inflater->png->checkCRC(chunk);
+    addStageBytes(inflater->stats, STAGE_INFLATE, chunk.len, 0);
+    if (inflater->progress != NULL) {
+        inflater->progressLeft -= chunk.len;
+        advanceProgress(inflater->progress, chunk.len);
     }
+    inflater->stream->next_in = const_cast<uint8_t *>(chunk.data);
+    inflater->stream->avail_in = chunk.len;
+    return true;
+}
 
-    if (inflateStream.avail_in != 0) {
-        printf("Error: inflate did not consume all input\n");
-        free(buffer);
-        inflateEnd(&inflateStream);
-        exit(1);
+void endIDATInflater(IDATInflater *inflater) {
+    if (inflater->progress != NULL && inflater->progressLeft > 0) {
+        advanceProgress(inflater->progress, inflater->progressLeft);
+        inflater->progressLeft = 0;
     }
+    if (inflater->stream != NULL) {
+        giveInflateStream(inflater->stream);
+        inflater->stream = NULL;
+    }
+}
 
-    decompressedData.insert(decompressedData.end(), buffer, buffer + (bufferLen - inflateStream.avail_out));
+int resolveThreads(int threads) {
+    // 0 asks for one thread per core
+    if (threads <= 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return threads;
+}
 
-    inflateEnd(&inflateStream);
-    free(buffer);
-    return decompressedData;
+EncoderSettings encoderSettings(int profile) {
+    switch (profile) {
+        case PROFILE_FAST:
+            // Z_RLE is faster still but cannot match repeats further back
+            // than one byte, which can leave patterned images uncompressed
+            return {1, Z_DEFAULT_STRATEGY, false};
+        case PROFILE_SMALL:
+            return {9, Z_FILTERED, true};
+        case PROFILE_BALANCED:
+            return {Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, false};
+        case PROFILE_STORED:
+            // Level 0 skips deflate and writes stored blocks directly
+            return {0, Z_DEFAULT_STRATEGY, false};
+        default:
+            throw StegoError(std::string("Unknown encoder profile: ") + std::to_string(profile));
+    }
 }
 
-std::vector<uint8_t> compressIDATChunk(std::vector<uint8_t> decompressedData) {
-    std::vector<uint8_t> compressedData;
+void initIDATDeflater(IDATDeflater *deflater, PNGWriter *writer, size_t imageDataLen, int threads, const EncoderSettings& settings, StegoStats *stats) {
+    deflater->writer = writer;
+    deflater->buffer = takeBuffer(writer->IDATSize());
+    deflater->bufferUsed = 0;
+    deflater->isStored = settings.level == 0;
+    deflater->isParallel = !deflater->isStored && threads > 1;
+    deflater->stats = stats;
+    noteStageBuffer(stats, STAGE_DEFLATE, deflater->buffer.size());
+
+    if (deflater->isStored) {
+        initStoredDeflater(&deflater->stored, imageDataLen, [deflater](const uint8_t *data, size_t len) {
+            bufferDeflatedIDAT(deflater, data, len);
+        });
+        return;
+    }
 
-    z_stream deflateStream;
-    memset(&deflateStream, 0, sizeof(z_stream));
+    if (deflater->isParallel) {
+        initParallelDeflater(&deflater->parallel, &ThreadPool::shared(), threads, settings.level, settings.strategy,
+            [deflater](const uint8_t *data, size_t len) {
+                bufferDeflatedIDAT(deflater, data, len);
+            });
+        // Blocks waiting on the pool hold their input and output
+        noteStageBuffer(stats, STAGE_DEFLATE, deflater->buffer.size() + deflater->parallel.maxInFlight * 2 * PARALLEL_DEFLATE_BLOCK_SIZE);
+        return;
+    }
 
-    deflateStream.avail_in = decompressedData.size();
-    deflateStream.next_in = decompressedData.data();
+    deflater->stream = takeDeflateStream(settings.level, 15, settings.strategy);
+}
 
-    int ret = deflateInit(&deflateStream, Z_DEFAULT_COMPRESSION);
-    if (ret != Z_OK) {
-        std::cerr << "Error with deflateInit: " << ret << '\n';
-        exit(1);
+// Leaves nothing for endIDATDeflater to give back, so it is safe to call
+// before initIDATDeflater has run
+void clearIDATDeflater(IDATDeflater *deflater) {
+    deflater->stream = NULL;
+    deflater->bufferUsed = 0;
+}
+
+void endIDATDeflater(IDATDeflater *deflater) {
+    if (deflater->stream != NULL) {
+        giveDeflateStream(deflater->stream);
+        deflater->stream = NULL;
+    }
+    if (deflater->buffer.capacity() > 0) {
+        giveBuffer(std::move(deflater->buffer));
+        deflater->buffer = std::vector<uint8_t>();
     }
+}
 
-    int bufferLen = decompressedData.size();
-    uint8_t *buffer = (uint8_t *) malloc(bufferLen);
+void deflateScanline(IDATDeflater *deflater, const uint8_t *scanline, size_t scanlineLen) {
+    StageTimer timer(deflater->stats, STAGE_DEFLATE);
+    addStageBytes(deflater->stats, STAGE_DEFLATE, scanlineLen, 0);
+    if (deflater->isStored) {
+        storedDeflateWrite(&deflater->stored, scanline, scanlineLen);
+        return;
+    }
 
-    do {
-        deflateStream.avail_out = bufferLen;
-        deflateStream.next_out = buffer;
+    if (deflater->isParallel) {
+        parallelDeflateWrite(&deflater->parallel, scanline, scanlineLen);
+        return;
+    }
+
+    z_stream *stream = deflater->stream;
+    stream->avail_in = scanlineLen;
+    stream->next_in = (Bytef *) scanline;
+
+    while (stream->avail_in > 0) {
+        stream->next_out = deflater->buffer.data() + deflater->bufferUsed;
+        stream->avail_out = deflater->buffer.size() - deflater->bufferUsed;
+        int ret = deflate(stream, Z_NO_FLUSH);
+        deflater->bufferUsed = deflater->buffer.size() - stream->avail_out;
+        if (ret != Z_OK) {
+            throw StegoError(std::string("Error: deflate returned ") + std::to_string(ret));
+        }
+
+        if (deflater->bufferUsed == deflater->buffer.size()) {
+            writeDeflatedIDAT(deflater);
+        }
+    }
+}
+
+void finishIDATDeflater(IDATDeflater *deflater) {
+    StageTimer timer(deflater->stats, STAGE_DEFLATE);
+    if (deflater->isStored) {
+        finishStoredDeflater(&deflater->stored);
+        writeDeflatedIDAT(deflater);
+        return;
+    }
+
+    if (deflater->isParallel) {
+        finishParallelDeflater(&deflater->parallel);
+        writeDeflatedIDAT(deflater);
+        return;
+    }
+
+    z_stream *stream = deflater->stream;
+    int ret;
 
-        ret = deflate(&deflateStream, Z_FINISH);
+    do {
+        stream->next_out = deflater->buffer.data() + deflater->bufferUsed;
+        stream->avail_out = deflater->buffer.size() - deflater->bufferUsed;
+        ret = deflate(stream, Z_FINISH);
+        deflater->bufferUsed = deflater->buffer.size() - stream->avail_out;
         if (ret != Z_OK && ret != Z_STREAM_END) {
-            printf("Error: deflate returned %d\n", ret);
-            free(buffer);
-            deflateEnd(&deflateStream);
-            exit(1);
+            throw StegoError(std::string("Error: deflate returned ") + std::to_string(ret));
         }
 
-        compressedData.insert(compressedData.end(), buffer, buffer + (bufferLen - deflateStream.avail_out));
-    } while (deflateStream.avail_out == 0);
+        writeDeflatedIDAT(deflater);
+    } while (ret != Z_STREAM_END);
+}
 
-    deflateEnd(&deflateStream);
-    free(buffer);
-    return compressedData;
+void writeDeflatedIDAT(IDATDeflater *deflater) {
+    size_t len = deflater->bufferUsed;
+    addStageBytes(deflater->stats, STAGE_DEFLATE, 0, len);
+    if (len > 0) {
+        deflater->writer->writeIDATs(deflater->buffer.data(), len);
+    }
+
+    deflater->bufferUsed = 0;
 }
 
-void processFilter(std::vector<uint8_t>& data, int scanlineLen, int bytesPerPixel) {
-    for (int i = 0; i < data.size(); i += scanlineLen) {
-        switch (data[i]) {
-            case 0:
-                break;
-            case 1:
-                processFilterSub(data, i + 1, scanlineLen, bytesPerPixel);
-                break;
-            case 2:
-                processFilterUp(data, i + 1, scanlineLen, bytesPerPixel);
-                break;
-            case 3:
-                processFilterAvg(data, i + 1, scanlineLen, bytesPerPixel);
-                break;
-            case 4:
-                processFilterPaeth(data, i + 1, scanlineLen, bytesPerPixel);
-                break;
-            default:
-                std::cerr << "Unimplemented filter type while unfiltering: " << (int) data[i] << '\n';
-                exit(1);
+void bufferDeflatedIDAT(IDATDeflater *deflater, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t copyLen = std::min(len, deflater->buffer.size() - deflater->bufferUsed);
+        memcpy(deflater->buffer.data() + deflater->bufferUsed, data, copyLen);
+        deflater->bufferUsed += copyLen;
+        data += copyLen;
+        len -= copyLen;
+
+        if (deflater->bufferUsed == deflater->buffer.size()) {
+            writeDeflatedIDAT(deflater);
         }
     }
 }
 
-void processFilterSub(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel) {
-    // start on 2nd image pixel
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        if (i < startPos + bytesPerPixel) {
+void encodeScanlines(IDATInflater *inflater, IDATDeflater *deflater, MessageEmbedder *embedder, const FilterKernels *kernels, uint32_t height, size_t scanlineLen, bool adaptiveFilter,
+                     int threads, StegoStats *stats) {
+    // Unfiltering needs the original previous row and refiltering needs the
+    // embedded one, which the band keeps above its first row
+    PooledBuffer scanline(scanlineLen);
+    PooledBuffer prevScanline(scanlineLen, true);
+    size_t bandRows = refilterBandRows(scanlineLen, threads);
+    PooledBuffer embeddedRows((bandRows + 1) * scanlineLen, true);
+    PooledBuffer filteredRows(bandRows * scanlineLen);
+    PooledBuffer candidateScanline(adaptiveFilter ? scanlineLen : 0);
+    RefilterBand band;
+    initRefilterBand(&band, kernels, scanlineLen, adaptiveFilter, threads, bandRows, embeddedRows.data(), candidateScanline.data());
+    bool prevRowEmbedded = false;
+    noteStageBuffer(stats, STAGE_INFLATE, 2 * scanlineLen);
+    noteStageBuffer(stats, STAGE_EMBED, embeddedRows.size());
+    noteStageBuffer(stats, STAGE_REFILTER, filteredRows.size() + candidateScanline.size());
+
+    for (uint32_t row = 0; row < height; row++) {
+        if (!inflateScanline(inflater, scanline.data(), scanlineLen)) {
+            throw StegoError("Image data ended unexpectedly");
+        }
+
+        // A row only filters differently if it or the row above it holds
+        // message bits, so past that its original filtered bytes are kept,
+        // unless every row is getting a new filter type
+        if (!adaptiveFilter && embedder->bitIndex == embedder->numBits && !prevRowEmbedded) {
+            if (band.numRows > 0) {
+                size_t numRows = band.numRows;
+                refilterBand(&band, filteredRows.data(), stats);
+                deflateRows(deflater, filteredRows.data(), numRows, scanlineLen);
+            }
+            deflateScanline(deflater, scanline.data(), scanlineLen);
             continue;
         }
 
-        uint8_t prevPixel = data[i - bytesPerPixel];
-        data[i] += prevPixel;
+        {
+            StageTimer timer(stats, STAGE_UNFILTER);
+            addStageBytes(stats, STAGE_UNFILTER, scanlineLen, scanlineLen);
+            unfilterScanline(kernels, scanline.data(), prevScanline.data(), scanlineLen);
+        }
+
+        prevRowEmbedded = embedRow(embedder, scanline.data(), nextBandRow(&band), scanlineLen, stats);
+        if (band.numRows == band.maxRows) {
+            refilterBand(&band, filteredRows.data(), stats);
+            deflateRows(deflater, filteredRows.data(), bandRows, scanlineLen);
+        }
+
+        std::swap(scanline, prevScanline);
     }
+
+    size_t numRows = band.numRows;
+    refilterBand(&band, filteredRows.data(), stats);
+    deflateRows(deflater, filteredRows.data(), numRows, scanlineLen);
 }
 
-void processFilterUp(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel) {
-    if (startPos < len) {
-        return;
+// Encodes with inflate, unfilter and embed, and deflate each on a thread of
+// their own, so a large image takes about as long as its slowest stage
+// rather than all three added up
+bool usePipelinedEncode(const StegoOptions& options, uint32_t height, size_t scanlineLen) {
+    return options.pipelineStages && (size_t) height * scanlineLen >= PIPELINE_MIN_BYTES && std::thread::hardware_concurrency() >= 2;
+}
+
+// The same encode as encodeScanlines with its stages overlapped. The
+// inflater and deflater are set up and ended by the caller, so their pooled
+// streams still come from and go back to the caller's pools. Each stage
+// thread times itself into stats of its own, merged once they are joined.
+void encodeScanlinesPipelined(IDATInflater *inflater, IDATDeflater *deflater, MessageEmbedder *embedder, const FilterKernels *kernels, uint32_t height,
+                              size_t scanlineLen, bool adaptiveFilter, int threads, StegoStats *stats) {
+    StageRing ring;
+    ring.scanlineLen = scanlineLen;
+    ring.batchRows = std::max((size_t) 1, PIPELINE_BATCH_BYTES / scanlineLen);
+    ring.height = height;
+    ring.numBatches = (height + ring.batchRows - 1) / ring.batchRows;
+    ring.inflated = 0;
+    ring.embedded = 0;
+    ring.deflated = 0;
+    ring.cancelled = false;
+    PooledBuffer rows(PIPELINE_SLOTS * ring.batchRows * scanlineLen);
+    ring.rows = rows.data();
+    noteStageBuffer(stats, STAGE_INFLATE, rows.size());
+
+    StegoStats inflateStats;
+    StegoStats embedStats;
+    inflater->stats = stats != NULL ? &inflateStats : NULL;
+
+    // The first stage to fail cancels the others, and its error is the one
+    // passed on
+    std::exception_ptr errors[3];
+    auto runStage = [&ring, &errors](int index, const std::function<void()>& stage) {
+        try {
+            stage();
+        } catch (...) {
+            errors[index] = std::current_exception();
+            ring.cancelled = true;
+        }
+    };
+
+    std::thread inflateThread;
+    std::thread embedThread;
+    try {
+        inflateThread = std::thread(runStage, 0, [&ring, inflater]() {
+            inflateStage(&ring, inflater);
+        });
+        embedThread = std::thread(runStage, 1, [&ring, embedder, kernels, adaptiveFilter, threads, &embedStats, stats]() {
+            embedStage(&ring, embedder, kernels, adaptiveFilter, threads, stats != NULL ? &embedStats : NULL);
+        });
+    } catch (...) {
+        errors[2] = std::current_exception();
+        ring.cancelled = true;
+    }
+    if (!ring.cancelled) {
+        runStage(2, [&ring, deflater]() {
+            deflateStage(&ring, deflater);
+        });
     }
 
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        uint8_t prevPixelUp = data[i - len];
-        data[i] += prevPixelUp;
+    if (inflateThread.joinable()) {
+        inflateThread.join();
+    }
+    if (embedThread.joinable()) {
+        embedThread.join();
+    }
+    inflater->stats = stats;
+    if (stats != NULL) {
+        mergeStats(stats, inflateStats);
+        mergeStats(stats, embedStats);
+    }
+
+    // A stage that stopped because another failed records nothing, so the
+    // first error found is the one that started it
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
     }
 }
 
-void processFilterAvg(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel) {
-    if (startPos < len) {
-        return;
+void inflateStage(StageRing *ring, IDATInflater *inflater) {
+    for (uint64_t batch = 0; batch < ring->numBatches; batch++) {
+        // The slot is free once the batch that last used it is deflated
+        if (batch >= PIPELINE_SLOTS && !waitForStage(ring, ring->deflated, batch - PIPELINE_SLOTS + 1)) {
+            return;
+        }
+
+        size_t numRows;
+        uint8_t *rows = batchRows(ring, batch, &numRows);
+        for (size_t row = 0; row < numRows; row++) {
+            if (!inflateScanline(inflater, rows + row * ring->scanlineLen, ring->scanlineLen)) {
+                throw StegoError("Image data ended unexpectedly");
+            }
+        }
+        ring->inflated.store(batch + 1, std::memory_order_release);
     }
+}
 
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        uint8_t average;
-        uint8_t prevPixelUp = data[i - len];
+void embedStage(StageRing *ring, MessageEmbedder *embedder, const FilterKernels *kernels, bool adaptiveFilter, int threads, StegoStats *stats) {
+    // Each batch is one refilter band, refiltered back into its slot
+    size_t scanlineLen = ring->scanlineLen;
+    PooledBuffer scanline(scanlineLen);
+    PooledBuffer prevScanline(scanlineLen, true);
+    PooledBuffer embeddedRows((ring->batchRows + 1) * scanlineLen, true);
+    PooledBuffer candidateScanline(adaptiveFilter ? scanlineLen : 0);
+    RefilterBand band;
+    initRefilterBand(&band, kernels, scanlineLen, adaptiveFilter, threads, ring->batchRows, embeddedRows.data(), candidateScanline.data());
+    bool prevRowEmbedded = false;
+    bool passThrough = false;
+    noteStageBuffer(stats, STAGE_EMBED, embeddedRows.size());
+    noteStageBuffer(stats, STAGE_REFILTER, candidateScanline.size());
+
+    for (uint64_t batch = 0; batch < ring->numBatches; batch++) {
+        if (!waitForStage(ring, ring->inflated, batch + 1)) {
+            return;
+        }
 
-        if (i < startPos + bytesPerPixel) {
-            average = prevPixelUp / 2;
-        } else {
-            uint8_t prevPixel = data[i - bytesPerPixel];
-            average = (prevPixel + prevPixelUp) / 2;
-        } 
+        size_t numRows;
+        uint8_t *rows = batchRows(ring, batch, &numRows);
+        for (size_t row = 0; row < numRows && !passThrough; row++) {
+            // As in encodeScanlines, rows past the message keep their original
+            // filtered bytes, which are already in the slot
+            if (!adaptiveFilter && embedder->bitIndex == embedder->numBits && !prevRowEmbedded) {
+                passThrough = true;
+                break;
+            }
 
-        data[i] += average;
+            // The refiltered rows replace the originals in the slot, so the
+            // original is unfiltered in a copy
+            memcpy(scanline.data(), rows + row * scanlineLen, scanlineLen);
+            {
+                StageTimer timer(stats, STAGE_UNFILTER);
+                addStageBytes(stats, STAGE_UNFILTER, scanlineLen, scanlineLen);
+                unfilterScanline(kernels, scanline.data(), prevScanline.data(), scanlineLen);
+            }
+
+            prevRowEmbedded = embedRow(embedder, scanline.data(), nextBandRow(&band), scanlineLen, stats);
+            std::swap(scanline, prevScanline);
+        }
+        if (band.numRows > 0) {
+            refilterBand(&band, rows, stats);
+        }
+        ring->embedded.store(batch + 1, std::memory_order_release);
     }
 }
 
-uint8_t paethPredictor(uint8_t left, uint8_t above, uint8_t upperLeft) {
-    int p = left + above - upperLeft;
-    int pLeft = abs(p - left);
-    int pAbove = abs(p - above);
-    int pUpperLeft = abs(p - upperLeft);
+void deflateStage(StageRing *ring, IDATDeflater *deflater) {
+    for (uint64_t batch = 0; batch < ring->numBatches; batch++) {
+        if (!waitForStage(ring, ring->embedded, batch + 1)) {
+            return;
+        }
 
-    if (pLeft <= pAbove && pLeft <= pUpperLeft) {
-        return left;
-    } else if (pAbove <= pUpperLeft) {
-        return above;
-    } else {
-        return upperLeft;
+        size_t numRows;
+        uint8_t *rows = batchRows(ring, batch, &numRows);
+        for (size_t row = 0; row < numRows; row++) {
+            deflateScanline(deflater, rows + row * ring->scanlineLen, ring->scanlineLen);
+        }
+        ring->deflated.store(batch + 1, std::memory_order_release);
     }
 }
 
-void processFilterPaeth(std::vector<uint8_t>& data, int startPos, int len, int bytesPerPixel) {
-    if (startPos < len) {
-        return;
+// Spins for a while, as the other stage is usually about to finish a batch,
+// then yields and finally sleeps so a stage stuck behind a slower one does
+// not hold on to a core. False if another stage has failed.
+bool waitForStage(const StageRing *ring, const std::atomic<uint64_t>& cursor, uint64_t target) {
+    for (int tries = 0; cursor.load(std::memory_order_acquire) < target; tries++) {
+        if (ring->cancelled.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        if (tries >= 1024) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        } else if (tries >= 64) {
+            std::this_thread::yield();
+        }
     }
+    return true;
+}
 
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        uint8_t prevPixel;
-        uint8_t prevPixelUpLeft;
-        uint8_t prevPixelUp = data[i - len];
+// The batch's rows in its slot, with the last batch holding what is left
+uint8_t *batchRows(StageRing *ring, uint64_t batch, size_t *numRows) {
+    size_t firstRow = batch * ring->batchRows;
+    *numRows = std::min(ring->batchRows, (size_t) ring->height - firstRow);
+    return ring->rows + (batch % PIPELINE_SLOTS) * ring->batchRows * ring->scanlineLen;
+}
 
-        if (i < startPos + bytesPerPixel) {
-            prevPixel = 0;
-            prevPixelUpLeft = 0;
-        } else {
-            prevPixel = data[i - bytesPerPixel];
-            prevPixelUpLeft = data[i - len - bytesPerPixel];
-        }
+// Copies the row with whatever message bits fall in it embedded, returning
+// whether any bits went in
+bool embedRow(MessageEmbedder *embedder, const uint8_t *origScanline, uint8_t *embeddedScanline, size_t scanlineLen, StegoStats *stats) {
+    StageTimer timer(stats, STAGE_EMBED);
+    addStageBytes(stats, STAGE_EMBED, 0, scanlineLen);
+    size_t bitIndexBefore = embedder->bitIndex;
+    memcpy(embeddedScanline, origScanline, scanlineLen);
+    embedScanline(embedder, embeddedScanline, scanlineLen);
+    return embedder->bitIndex != bitIndexBefore;
+}
 
-        data[i] += paethPredictor(prevPixel, prevPixelUp, prevPixelUpLeft);
+// Rows in a band, enough for every thread to get a run of its own
+size_t refilterBandRows(size_t scanlineLen, int threads) {
+    if (threads <= 1) {
+        return 1;
     }
+    return std::max((size_t) threads, REFILTER_BAND_BYTES / scanlineLen);
 }
 
-void refilter(std::vector<uint8_t>& data, int scanlineLen, int bytesPerPixel) {
-    uint8_t *orig = (uint8_t *)malloc(data.size());
-    memcpy(orig, data.data(), data.size());
+// embedded holds maxRows + 1 rows, zeroed as the row above the image, and
+// candidate a row when adaptiveFilter is set
+void initRefilterBand(RefilterBand *band, const FilterKernels *kernels, size_t scanlineLen, bool adaptiveFilter, int threads, size_t maxRows, uint8_t *embedded,
+                      uint8_t *candidate) {
+    band->kernels = kernels;
+    band->scanlineLen = scanlineLen;
+    band->adaptiveFilter = adaptiveFilter;
+    band->threads = threads;
+    band->maxRows = maxRows;
+    band->numRows = 0;
+    band->embedded = embedded;
+    band->candidate = candidate;
+}
 
-    for (int i = 0; i < data.size(); i += scanlineLen) {
-        switch (data[i]) {
-            case 0:
-                break;
-            case 1:
-                refilterSub(data, orig, i + 1, scanlineLen, bytesPerPixel);
-                break;
-            case 2:
-                refilterUp(data, orig, i + 1, scanlineLen, bytesPerPixel);
-                break;
-            case 3:
-                refilterAvg(data, orig,  i + 1, scanlineLen, bytesPerPixel);
-                break;
-            case 4:
-                refilterPaeth(data, orig, i + 1, scanlineLen, bytesPerPixel);
-                break;
-            default:
-                std::cerr << "Unimplemented filter type while refiltering: " << (int) data[i] << '\n';
-                exit(1);
+// Where the band's next embedded row goes
+uint8_t *nextBandRow(RefilterBand *band) {
+    band->numRows++;
+    return band->embedded + band->numRows * band->scanlineLen;
+}
+
+// Refilters the band's rows into filteredRows and empties it, keeping its
+// last embedded row as the one above the next band. A row only needs itself
+// and the row above as embedded, so the band is split into runs of rows
+// refiltered side by side on the shared pool.
+void refilterBand(RefilterBand *band, uint8_t *filteredRows, StegoStats *stats) {
+    size_t scanlineLen = band->scanlineLen;
+    size_t numRows = band->numRows;
+    if (numRows == 0) {
+        return;
+    }
+    StageTimer timer(stats, STAGE_REFILTER);
+    addStageBytes(stats, STAGE_REFILTER, numRows * scanlineLen, numRows * scanlineLen);
+
+    auto refilterRows = [band, filteredRows, scanlineLen](size_t firstRow, size_t endRow, uint8_t *candidate) {
+        for (size_t row = firstRow; row < endRow; row++) {
+            const uint8_t *embedded = band->embedded + (row + 1) * scanlineLen;
+            uint8_t *filtered = filteredRows + row * scanlineLen;
+            if (band->adaptiveFilter) {
+                adaptiveFilterScanline(band->kernels, filtered, embedded, embedded - scanlineLen, candidate, scanlineLen);
+            } else {
+                memcpy(filtered, embedded, scanlineLen);
+                refilterScanline(band->kernels, filtered, embedded, embedded - scanlineLen, scanlineLen);
+            }
+        }
+    };
+
+    size_t numRuns = std::min((size_t) std::max(band->threads, 1), numRows);
+    if (numRuns <= 1) {
+        refilterRows(0, numRows, band->candidate);
+    } else {
+        size_t runRows = (numRows + numRuns - 1) / numRuns;
+        std::vector<std::future<void>> runs;
+        for (size_t firstRow = 0; firstRow < numRows; firstRow += runRows) {
+            size_t endRow = std::min(firstRow + runRows, numRows);
+            runs.push_back(ThreadPool::shared().submit([&refilterRows, band, scanlineLen, firstRow, endRow]() {
+                PooledBuffer candidate(band->adaptiveFilter ? scanlineLen : 0);
+                refilterRows(firstRow, endRow, candidate.data());
+            }));
+        }
+        // Every run is waited for before any error is passed on, since they
+        // all share this frame
+        for (std::future<void>& result : runs) {
+            result.wait();
+        }
+        for (std::future<void>& result : runs) {
+            result.get();
         }
     }
 
-    free(orig);
+    memcpy(band->embedded, band->embedded + numRows * scanlineLen, scanlineLen);
+    band->numRows = 0;
 }
 
-void refilterSub(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel) {
-    // start on 2nd image pixel
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        if (i < startPos + bytesPerPixel) {
-            continue;
-        }
+void deflateRows(IDATDeflater *deflater, const uint8_t *rows, size_t numRows, size_t scanlineLen) {
+    for (size_t row = 0; row < numRows; row++) {
+        deflateScanline(deflater, rows + row * scanlineLen, scanlineLen);
+    }
+}
 
-        uint8_t prevPixel = orig[i - bytesPerPixel];
-        data[i] -= prevPixel;
+std::vector<uint8_t> compressIDATChunk(const std::vector<uint8_t>& decompressedData, size_t scanlineLen, int threads, const EncoderSettings& settings) {
+    if (settings.level == 0) {
+        return storeIDATChunk(decompressedData);
     }
+
+    if (threads > 1) {
+        return parallelDeflate(decompressedData.data(), decompressedData.size(), scanlineLen, threads, settings.level, settings.strategy);
+    }
+
+    // Sized to the worst case, so one call deflates everything in place
+    z_stream *deflateStream = takeDeflateStream(settings.level, 15, settings.strategy);
+    std::vector<uint8_t> compressedData(deflateBound(deflateStream, decompressedData.size()));
+
+    deflateStream->avail_in = decompressedData.size();
+    deflateStream->next_in = const_cast<uint8_t *>(decompressedData.data());
+    deflateStream->avail_out = compressedData.size();
+    deflateStream->next_out = compressedData.data();
+
+    int ret = deflate(deflateStream, Z_FINISH);
+    compressedData.resize(compressedData.size() - deflateStream->avail_out);
+    giveDeflateStream(deflateStream);
+    if (ret != Z_STREAM_END) {
+        throw StegoError(std::string("Error: deflate returned ") + std::to_string(ret));
+    }
+    return compressedData;
 }
 
-void refilterUp(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel) {
-    if (startPos < len) {
-        return;
+std::vector<uint8_t> storeIDATChunk(const std::vector<uint8_t>& decompressedData) {
+    return storedDeflate(decompressedData.data(), decompressedData.size());
+}
+
+bool messageFits(int msgLen, size_t numSamples, int bitsPerSample) {
+    return msgLen >= 0 && (size_t) msgLen <= maxMessageLen(numSamples, bitsPerSample);
+}
+
+size_t maxMessageLen(size_t numSamples, int bitsPerSample) {
+    if (bitsPerSample < 1 || bitsPerSample > MAX_BITS_PER_SAMPLE) {
+        throw StegoError("Bits per sample must be between 1 and " + std::to_string(MAX_BITS_PER_SAMPLE));
     }
-    
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        uint8_t prevPixelUp = orig[i - len];
-        data[i] -= prevPixelUp;
+    if (numSamples < STEGO_HEADER_BITS) {
+        return 0;
     }
+
+    // Lengths are passed around as int
+    size_t numBytes = (numSamples - STEGO_HEADER_BITS) * bitsPerSample / 8;
+    return std::min(numBytes, (size_t) INT_MAX);
 }
 
-void refilterAvg(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel) {
-    if (startPos < len) {
-        return;
+void embedMessage(std::vector<uint8_t>& data, unsigned char *message, int msgLen, size_t scanlineLen) {
+    size_t numSamples = data.size() - (data.size() / scanlineLen);
+    if (!messageFits(msgLen, numSamples, 1)) {
+        throw StegoError("Message is too long!");
     }
 
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        uint8_t average;
-        uint8_t prevPixelUp = orig[i - len];
+    MessageEmbedder embedder;
+    initMessageEmbedder(&embedder, message, msgLen, 1);
 
-        if (i < startPos + bytesPerPixel) {
-            average = prevPixelUp / 2;
-        } else {
-            uint8_t prevPixel = orig[i - bytesPerPixel];
-            average = (prevPixel + prevPixelUp) / 2;
-        } 
+    for (size_t i = 0; i < data.size() && embedder.bitIndex < embedder.numBits; i += scanlineLen) {
+        embedScanline(&embedder, &data[i], scanlineLen);
+    }
+}
+
+void initMessageEmbedder(MessageEmbedder *embedder, const unsigned char *message, int msgLen, int bitsPerSample) {
+    embedder->kernels = bitPackKernels();
+
+    memcpy(embedder->header, STEGO_MAGIC, sizeof(STEGO_MAGIC));
+    embedder->header[4] = STEGO_HEADER_VERSION;
+    embedder->header[5] = bitsPerSample;
+    writeBigEndian32(embedder->header + 6, msgLen);
+
+    embedder->message = message;
+    embedder->msgLen = msgLen;
+    embedder->bitsPerSample = bitsPerSample;
+    embedder->bitIndex = 0;
+    embedder->numBits = STEGO_HEADER_BITS + (size_t) msgLen * 8;
+}
+
+void embedScanline(MessageEmbedder *embedder, uint8_t *scanline, size_t scanlineLen) {
+    // skip filter byte
+    uint8_t *samples = scanline + 1;
+    size_t numSamples = scanlineLen - 1;
 
-        data[i] -= average;
+    if (embedder->bitIndex < STEGO_HEADER_BITS) {
+        embedBits(embedder->kernels, 1, embedder->header, STEGO_HEADER_BITS, &embedder->bitIndex, &samples, &numSamples);
+    }
+
+    if (embedder->bitIndex >= STEGO_HEADER_BITS) {
+        size_t messageBitIndex = embedder->bitIndex - STEGO_HEADER_BITS;
+        embedBits(embedder->kernels, embedder->bitsPerSample, embedder->message, embedder->msgLen * 8, &messageBitIndex, &samples, &numSamples);
+        embedder->bitIndex = STEGO_HEADER_BITS + messageBitIndex;
     }
 }
 
-void refilterPaeth(std::vector<uint8_t>& data, uint8_t *orig, int startPos, int len, int bytesPerPixel) {
-    if (startPos < len) {
-        return;
+// Bits of data from bitIndex on, most significant first, with zeroes past
+// the end of the data
+uint8_t readBits(const uint8_t *data, size_t numBits, size_t bitIndex, int depth) {
+    uint8_t bits = 0;
+    for (int i = 0; i < depth; i++, bitIndex++) {
+        int bit = bitIndex < numBits ? (data[bitIndex >> 3] >> (7 - (bitIndex & 7))) & 1 : 0;
+        bits = (bits << 1) | bit;
     }
+    return bits;
+}
 
-    for (int i = startPos; i < startPos + len - 1; i++) {
-        uint8_t prevPixel;
-        uint8_t prevPixelUpLeft;
-        uint8_t prevPixelUp = orig[i - len];
+// Writes data's bits from *bitIndex on at depth bits per sample until either
+// the data or the samples run out, moving both cursors on. Groups of eight
+// samples go to the kernel. Only groups split by a row boundary, and the
+// last sample of the data, go one sample at a time.
+void embedBits(const BitPackKernels *kernels, int depth, const uint8_t *data, size_t numBits, size_t *bitIndex, uint8_t **samples, size_t *numSamples) {
+    const size_t groupBits = 8 * depth;
+    const uint8_t fieldMask = (1 << depth) - 1;
+
+    while (*numSamples > 0 && *bitIndex < numBits) {
+        size_t numGroups = 0;
+        if (*bitIndex % groupBits == 0) {
+            numGroups = std::min(*numSamples >> 3, (numBits - *bitIndex) / groupBits);
+        }
 
-        if (i < startPos + bytesPerPixel) {
-            prevPixel = 0;
-            prevPixelUpLeft = 0;
+        if (numGroups > 0) {
+            kernels->embed[depth](*samples, &data[*bitIndex >> 3], numGroups);
+            *samples += numGroups << 3;
+            *numSamples -= numGroups << 3;
+            *bitIndex += numGroups * groupBits;
         } else {
-            prevPixel = orig[i - bytesPerPixel];
-            prevPixelUpLeft = orig[i - len - bytesPerPixel];
+            **samples = (**samples & ~fieldMask) | readBits(data, numBits, *bitIndex, depth);
+            (*samples)++;
+            (*numSamples)--;
+            *bitIndex = std::min(*bitIndex + depth, numBits);
         }
+    }
+}
+
+void createPNG(const std::vector<uint8_t>& compressedData, const MappedPNG& png, char *outputFileString, size_t IDATSize) {
+    PNGWriter writer(outputFileString, IDATSize);
+    writeLeadingChunks(writer, png);
+    writer.writeIDATs(compressedData.data(), compressedData.size());
+    writeTrailingChunks(writer, png);
+    writer.commit();
+}
 
-        data[i] -= paethPredictor(prevPixel, prevPixelUp, prevPixelUpLeft);
+void initMessageExtractor(MessageExtractor *extractor, size_t numSamples) {
+    extractor->kernels = bitPackKernels();
+    extractor->numSamples = numSamples;
+    memset(extractor->header, 0, sizeof(extractor->header));
+    extractor->headerIndex = 0;
+    extractor->headerBits = 8;
+    extractor->haveHeader = false;
+    extractor->message.clear();
+    extractor->bitsPerSample = 1;
+    extractor->bitIndex = 0;
+    extractor->numBits = 0;
+}
+
+// Returns true once the header and the whole message have been read
+bool extractScanline(MessageExtractor *extractor, const uint8_t *scanline, size_t scanlineLen) {
+    // skip filter byte
+    const uint8_t *samples = scanline + 1;
+    size_t numSamples = scanlineLen - 1;
+
+    while (numSamples > 0 && !extractor->haveHeader) {
+        extractBits(extractor->kernels, 1, extractor->header, extractor->headerBits, &extractor->headerIndex, &samples, &numSamples);
+        if (extractor->headerIndex == extractor->headerBits) {
+            readMessageHeader(extractor);
+        }
     }
+
+    if (extractor->haveHeader) {
+        extractBits(extractor->kernels, extractor->bitsPerSample, extractor->message.data(), extractor->numBits, &extractor->bitIndex,
+                    &samples, &numSamples);
+    }
+
+    return extractor->haveHeader && extractor->bitIndex == extractor->numBits;
 }
 
-void embedMessage(std::vector<uint8_t>& data, unsigned char *message, int msgLen, int scanlineLen) {
-    if (msgLen * 8 >= data.size() - (data.size() / scanlineLen)) {
-        std::cerr << "Message is too long!\n";
-        exit(1);
+// The counterpart of embedBits. data must start zeroed, as bits are ORed in.
+void extractBits(const BitPackKernels *kernels, int depth, uint8_t *data, size_t numBits, size_t *bitIndex, const uint8_t **samples, size_t *numSamples) {
+    const size_t groupBits = 8 * depth;
+
+    while (*numSamples > 0 && *bitIndex < numBits) {
+        size_t numGroups = 0;
+        if (*bitIndex % groupBits == 0) {
+            numGroups = std::min(*numSamples >> 3, (numBits - *bitIndex) / groupBits);
+        }
+
+        if (numGroups > 0) {
+            kernels->extract[depth](*samples, &data[*bitIndex >> 3], numGroups);
+            *samples += numGroups << 3;
+            *numSamples -= numGroups << 3;
+            *bitIndex += numGroups * groupBits;
+        } else {
+            for (int i = depth - 1; i >= 0 && *bitIndex < numBits; i--, (*bitIndex)++) {
+                data[*bitIndex >> 3] |= ((**samples >> i) & 1) << (7 - (*bitIndex & 7));
+            }
+            (*samples)++;
+            (*numSamples)--;
+        }
     }
+}
 
-    std::vector<uint8_t> messageBits;
+void readMessageHeader(MessageExtractor *extractor) {
+    const uint8_t *header = extractor->header;
 
-    for (int i = 7; i >= 0; i--) {
-        messageBits.push_back((msgLen >> i) & 1);
+    // A first byte that could start the magic tag means reading the rest of
+    // the header before deciding
+    if (extractor->headerBits == 8 && header[0] == STEGO_MAGIC[0]) {
+        extractor->headerBits = STEGO_HEADER_BITS;
+        return;
     }
 
-    for (int i = 0; i < msgLen; i++) {
-        uint8_t byte = message[i];
-        for (int i = 7; i >= 0; i--) {
-            messageBits.push_back((byte >> i) & 1);
+    if (extractor->headerBits == STEGO_HEADER_BITS && memcmp(header, STEGO_MAGIC, sizeof(STEGO_MAGIC)) == 0) {
+        if (header[4] != STEGO_HEADER_VERSION) {
+            throw StegoError("Unsupported message header version: " + std::to_string(header[4]));
+        }
+
+        int bitsPerSample = header[5];
+        if (bitsPerSample < 1 || bitsPerSample > MAX_BITS_PER_SAMPLE) {
+            throw StegoError("Message header has an invalid bits per sample: " + std::to_string(bitsPerSample));
+        }
+
+        size_t msgLen = readBigEndian32(header + 6);
+        if (msgLen > maxMessageLen(extractor->numSamples, bitsPerSample)) {
+            throw StegoError("Message header claims more data than the image holds");
         }
+
+        startMessage(extractor, bitsPerSample, msgLen, NULL, 0);
+        return;
     }
 
-    for (int dataIndex = 1, bitsIndex = 0; bitsIndex < messageBits.size(); dataIndex++, bitsIndex++) {
-        // skip filter bytes
-        if (dataIndex % scanlineLen == 0) {
-            continue;
+    // Images from before the header had a magic tag start with a one byte
+    // length, and any further header bytes read were the message's
+    startMessage(extractor, 1, header[0], header + 1, extractor->headerBits / 8 - 1);
+}
+
+void startMessage(MessageExtractor *extractor, int bitsPerSample, size_t msgLen, const uint8_t *readSoFar, size_t readSoFarLen) {
+    extractor->haveHeader = true;
+    extractor->bitsPerSample = bitsPerSample;
+    extractor->message.assign(msgLen, 0);
+    if (readSoFarLen > 0) {
+        memcpy(extractor->message.data(), readSoFar, readSoFarLen);
+    }
+    extractor->bitIndex = readSoFarLen * 8;
+    extractor->numBits = msgLen * 8;
+}
+
+bool hasTaggedHeader(const MessageExtractor *extractor) {
+    return extractor->headerBits == STEGO_HEADER_BITS && memcmp(extractor->header, STEGO_MAGIC, sizeof(STEGO_MAGIC)) == 0;
+}
+
+std::vector<uint8_t> extractedMessage(MessageExtractor *extractor) {
+    return std::move(extractor->message);
+}
+
+std::vector<uint8_t> decodeMessage(IDATInflater *inflater, const FilterKernels *kernels, size_t scanlineLen, uint32_t height, StegoStats *stats) {
+    PooledBuffer scanline(scanlineLen);
+    PooledBuffer prevScanline(scanlineLen, true);
+    noteStageBuffer(stats, STAGE_INFLATE, 2 * scanlineLen);
+
+    MessageExtractor extractor;
+    initMessageExtractor(&extractor, (size_t) height * (scanlineLen - 1));
+
+    // Only inflate and unfilter as many scanlines as the header and message span
+    bool done = false;
+    while (!done) {
+        if (!inflateScanline(inflater, scanline.data(), scanlineLen)) {
+            throw StegoError("Image data ended before the end of the message");
+        }
+
+        {
+            StageTimer timer(stats, STAGE_UNFILTER);
+            addStageBytes(stats, STAGE_UNFILTER, scanlineLen, scanlineLen);
+            unfilterScanline(kernels, scanline.data(), prevScanline.data(), scanlineLen);
         }
-        // 11111110
-        data[dataIndex] = (data[dataIndex] & 0xFE) | messageBits[bitsIndex];
+
+        StageTimer timer(stats, STAGE_EXTRACT);
+        addStageBytes(stats, STAGE_EXTRACT, scanlineLen, 0);
+        done = extractScanline(&extractor, scanline.data(), scanlineLen);
+        std::swap(scanline, prevScanline);
     }
+
+    addStageBytes(stats, STAGE_EXTRACT, 0, extractor.message.size());
+    noteStageBuffer(stats, STAGE_EXTRACT, extractor.message.capacity());
+    return extractedMessage(&extractor);
 }
 
-void createPNG(std::vector<uint8_t> compressedData, char *originalFileName, std::ifstream& img, int IDATDataStartPos, uint32_t originalIDATChunkSize, int maxOutputLen, char *outputFileString) {
-    // b indicates binary 
-    FILE *original = fopen(originalFileName, "rb");
-    FILE *output = fopen(outputFileString, "wb");
+MessageHeader probeMessage(const char *path, std::vector<uint8_t> *message, const StegoOptions& options) {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    MappedPNG png(path, options.stats);
+    ChunkIHDR chunkIHDR;
+    parseIHDR(png.chunks()[0], &chunkIHDR);
+    int bytesPerPixel = bytesPerPixelOf(&chunkIHDR);
 
-    // Go back to right before length bytes
-    int headerSize = IDATDataStartPos - 8;
+    if (png.IDATChunks().empty()) {
+        throw StegoError("IDAT Chunk not found");
+    }
 
-    uint8_t *buffer = (uint8_t *)malloc(headerSize);
-    fread(buffer, sizeof(uint8_t), headerSize, original);
-    fwrite(buffer, sizeof(uint8_t), headerSize, output);
+    MessageHeader header = {false, 0, 0, 0};
+    size_t scanlineLen = ((size_t) chunkIHDR.width * bytesPerPixel) + 1;
+    size_t numSamples = (size_t) chunkIHDR.height * (scanlineLen - 1);
+    if (numSamples < STEGO_HEADER_BITS) {
+        return header;
+    }
 
-    uint32_t length = compressedData.size();
-    uint32_t lengthBigEndian = __builtin_bswap32(length);
-    fwrite(&lengthBigEndian, sizeof(uint32_t), 1, output);
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
+    PooledBuffer scanline(scanlineLen);
+    PooledBuffer prevScanline(scanlineLen, true);
+    MessageExtractor extractor;
+    initMessageExtractor(&extractor, numSamples);
+
+    IDATInflater inflater;
+    clearIDATInflater(&inflater);
+    try {
+        initIDATInflater(&inflater, png, options.stats, options.progress);
+        bool done = false;
+        while (!done) {
+            if (!inflateScanline(&inflater, scanline.data(), scanlineLen)) {
+                throw StegoError("Image data ended before the end of the message");
+            }
 
-    std::vector<uint8_t> vectorIDAT = {'I', 'D', 'A', 'T'};
+            {
+                StageTimer timer(options.stats, STAGE_UNFILTER);
+                unfilterScanline(kernels, scanline.data(), prevScanline.data(), scanlineLen);
+            }
 
-    uint32_t crc = 0;
+            StageTimer timer(options.stats, STAGE_EXTRACT);
+            done = extractScanline(&extractor, scanline.data(), scanlineLen);
+            std::swap(scanline, prevScanline);
 
-    for (uint8_t c : vectorIDAT) {
-        fwrite(&c, sizeof(uint8_t), 1, output);
-        crc = crc32(crc, &c, 1);
-    }   
-    
-    for (uint8_t c : compressedData) {
-        fwrite(&c, sizeof(uint8_t), 1, output);
-        crc = crc32(crc, &c, 1);
+            // Untagged, or tagged with nothing more wanted
+            if (extractor.haveHeader && (!hasTaggedHeader(&extractor) || message == NULL)) {
+                done = true;
+            }
+        }
+    } catch (...) {
+        endIDATInflater(&inflater);
+        throw;
     }
+    endIDATInflater(&inflater);
+
+    header.found = hasTaggedHeader(&extractor);
+    if (header.found) {
+        header.version = extractor.header[4];
+        header.bitsPerSample = extractor.bitsPerSample;
+        header.length = extractor.numBits / 8;
+        if (message != NULL) {
+            *message = extractedMessage(&extractor);
+        }
+    }
+    return header;
+}
 
-    uint32_t crcBigEndian = __builtin_bswap32(crc);
-    fwrite(&crcBigEndian, sizeof(uint32_t), 1, output);
+size_t messageCapacity(const char *path, int bitsPerSample) {
+    MappedPNG png(path);
+    ChunkIHDR chunkIHDR;
+    parseIHDR(png.chunks()[0], &chunkIHDR);
+    return maxMessageLen((size_t) chunkIHDR.height * chunkIHDR.width * bytesPerPixelOf(&chunkIHDR), bitsPerSample);
+}
 
-    uint8_t endBytes[] = {0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82};
-    fwrite(endBytes, sizeof(uint8_t), sizeof(endBytes), output);
+size_t messageCapacity(const uint8_t *png, size_t pngLen, int bitsPerSample) {
+    MappedPNG input(png, pngLen);
+    ChunkIHDR chunkIHDR;
+    parseIHDR(input.chunks()[0], &chunkIHDR);
+    return maxMessageLen((size_t) chunkIHDR.height * chunkIHDR.width * bytesPerPixelOf(&chunkIHDR), bitsPerSample);
+}
 
-    free(buffer);
+StegoImage::StegoImage(const char *path) {
+    MappedPNG png(path);
+    load(png);
 }
 
-void readRestIDATs(std::vector<uint8_t>& compressedData, std::ifstream& img) {
-    uint32_t sizeIDAT;
-    std::vector<uint8_t> newCompressedData;
+StegoImage::StegoImage(const uint8_t *png, size_t pngLen) {
+    MappedPNG input(png, pngLen);
+    load(input);
+}
 
-    while(findIDAT(img, &sizeIDAT)) {
-        newCompressedData = readIDATChunk(img, sizeIDAT);
-        compressedData.insert(compressedData.end(), newCompressedData.begin(), newCompressedData.end());
+void StegoImage::load(const MappedPNG& png) {
+    ChunkIHDR chunkIHDR;
+    parseIHDR(png.chunks()[0], &chunkIHDR);
+    bytesPerPixel = bytesPerPixelOf(&chunkIHDR);
+    if (png.IDATChunks().empty()) {
+        throw StegoError("IDAT Chunk not found");
     }
+
+    height = chunkIHDR.height;
+    scanlineLen = ((size_t) chunkIHDR.width * bytesPerPixel) + 1;
+
+    // The chunks around the image data are kept as bytes, so the source
+    // buffer or mapping can go away
+    PNGWriter leadingWriter(&leadingChunks, 1);
+    writeLeadingChunks(leadingWriter, png);
+    PNGWriter trailingWriter(&trailingChunks, 1);
+    writeTrailingChunks(trailingWriter, png);
+
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
+    filtered.resize((size_t) height * scanlineLen);
+    unfiltered.resize(filtered.size());
+    std::vector<uint8_t> zeroScanline(scanlineLen, 0);
+
+    IDATInflater inflater;
+    clearIDATInflater(&inflater);
+    try {
+        initIDATInflater(&inflater, png, NULL, NULL);
+        for (uint32_t row = 0; row < height; row++) {
+            uint8_t *scanline = &filtered[(size_t) row * scanlineLen];
+            if (!inflateScanline(&inflater, scanline, scanlineLen)) {
+                throw StegoError("Image data ended unexpectedly");
+            }
+
+            uint8_t *pixels = &unfiltered[(size_t) row * scanlineLen];
+            memcpy(pixels, scanline, scanlineLen);
+            unfilterScanline(kernels, pixels, row == 0 ? zeroScanline.data() : pixels - scanlineLen, scanlineLen);
+        }
+    } catch (...) {
+        endIDATInflater(&inflater);
+        throw;
+    }
+    endIDATInflater(&inflater);
 }
 
-std::vector<uint8_t> decodeMessage(std::vector<uint8_t>& decompressedData, int scanlineLen) {
-    uint8_t messageLenByte = 0;
+size_t StegoImage::capacity(int bitsPerSample) const {
+    return maxMessageLen((size_t) height * (scanlineLen - 1), bitsPerSample);
+}
 
-    for (int i = 1; i <= 8; i++) {
-        uint8_t byte = decompressedData[i];
-        messageLenByte |= (byte & 1);
+std::vector<uint8_t> StegoImage::encode(const unsigned char *message, int msgLen, const StegoOptions& options) const {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    std::vector<uint8_t> output;
+    PNGWriter writer(&output, options.IDATSize, options.stats);
+    encodeTo(&writer, message, msgLen, options);
+    return output;
+}
 
-        if (i < 8) {
-            messageLenByte <<= 1;
+void StegoImage::encodeToFile(const unsigned char *message, int msgLen, const char *outputFile, const StegoOptions& options) const {
+    StageTimer timer(options.stats, STAGE_OTHER);
+    PNGWriter writer(outputFile, options.IDATSize, options.stats);
+    encodeTo(&writer, message, msgLen, options);
+    writer.commit();
+}
+
+void StegoImage::encodeTo(PNGWriter *writer, const unsigned char *message, int msgLen, const StegoOptions& options) const {
+    if (!messageFits(msgLen, (size_t) height * (scanlineLen - 1), options.bitsPerSample)) {
+        throw StegoError("Message is too long!");
+    }
+
+    const FilterKernels *kernels = filterKernels(bytesPerPixel);
+    EncoderSettings settings = encoderSettings(options.profile);
+    int threads = resolveThreads(options.threads);
+    size_t bandRows = refilterBandRows(scanlineLen, threads);
+    PooledBuffer embeddedRows((bandRows + 1) * scanlineLen, true);
+    PooledBuffer filteredRows(bandRows * scanlineLen);
+    PooledBuffer candidateScanline(settings.adaptiveFilter ? scanlineLen : 0);
+    RefilterBand band;
+    initRefilterBand(&band, kernels, scanlineLen, settings.adaptiveFilter, threads, bandRows, embeddedRows.data(), candidateScanline.data());
+
+    writer->copyBytes(leadingChunks.data(), leadingChunks.size());
+
+    IDATDeflater deflater;
+    MessageEmbedder embedder;
+    clearIDATDeflater(&deflater);
+    try {
+        initIDATDeflater(&deflater, writer, filtered.size(), threads, settings, options.stats);
+        initMessageEmbedder(&embedder, message, msgLen, options.bitsPerSample);
+        addStageBytes(options.stats, STAGE_EMBED, embedder.numBits / 8, 0);
+
+        bool prevRowEmbedded = false;
+        for (uint32_t row = 0; row < height; row++) {
+            size_t offset = (size_t) row * scanlineLen;
+
+            // Past the message, the remaining rows go to deflate exactly as
+            // the carrier stored them, still a row at a time so a parallel
+            // deflate can spread them over its blocks
+            if (!settings.adaptiveFilter && embedder.bitIndex == embedder.numBits && !prevRowEmbedded) {
+                if (band.numRows > 0) {
+                    size_t numRows = band.numRows;
+                    refilterBand(&band, filteredRows.data(), options.stats);
+                    deflateRows(&deflater, filteredRows.data(), numRows, scanlineLen);
+                }
+                deflateScanline(&deflater, &filtered[offset], scanlineLen);
+                continue;
+            }
+
+            prevRowEmbedded = embedRow(&embedder, &unfiltered[offset], nextBandRow(&band), scanlineLen, options.stats);
+            if (band.numRows == band.maxRows) {
+                refilterBand(&band, filteredRows.data(), options.stats);
+                deflateRows(&deflater, filteredRows.data(), bandRows, scanlineLen);
+            }
         }
+
+        size_t numRows = band.numRows;
+        refilterBand(&band, filteredRows.data(), options.stats);
+        deflateRows(&deflater, filteredRows.data(), numRows, scanlineLen);
+
+        finishIDATDeflater(&deflater);
+        endIDATDeflater(&deflater);
+    } catch (...) {
+        endIDATDeflater(&deflater);
+        throw;
     }
 
-    int messageLen = static_cast<int>(messageLenByte);
-    std::vector<uint8_t> messageVec;
+    writer->copyBytes(trailingChunks.data(), trailingChunks.size());
+}
 
-    for (int i = 1; i <= messageLen; i++) {
-        uint8_t letter = 0;
-        for (int j = 1; j <= 8; j++) {
-            uint8_t byte = decompressedData[j + (8 * i)];
-            letter |= (byte & 1);
+std::string StegoImage::decode() const {
+    MessageExtractor extractor;
+    initMessageExtractor(&extractor, (size_t) height * (scanlineLen - 1));
 
-            if (j < 8) {
-                letter <<= 1;
-            }
+    for (uint32_t row = 0; row < height; row++) {
+        if (extractScanline(&extractor, &unfiltered[(size_t) row * scanlineLen], scanlineLen)) {
+            std::vector<uint8_t> message = extractedMessage(&extractor);
+            return std::string(message.begin(), message.end());
         }
-        messageVec.push_back(letter);
     }
 
-    return messageVec;
-}
\ No newline at end of file
+    throw StegoError("Image data ended before the end of the message");
+}
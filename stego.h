@@ -1,17 +1,132 @@
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
+#include "stats.h"
+#include "stegoerror.h"
 #ifndef ENCODER_H
 #define ENCODER_H
 
+const int PROFILE_FAST = 0;
+const int PROFILE_BALANCED = 1;
+const int PROFILE_SMALL = 2;
+const int PROFILE_STORED = 3;
 
-void encodePlaintext(char *inputFile, unsigned char *message, int msgLen, char *outputFile);
-std::string decodePlaintext(char *inputFile);
-void encodeAES(char *inputFile, unsigned char *message, int msgLen, char *outputFile, char *inputKeyFile, char *outputKeyFile);
-std::string decodeAES(char *inputFile, char *inputKeyFile);
+typedef struct StegoOptions {
+    // Threads refiltering and compressing the output image data, 0 for one
+    // per core
+    int threads = 1;
+    // Trades encode time against output size: fast compresses at the lowest
+    // level, small picks each row's filter and compresses hardest, stored
+    // skips compression for images that are decoded right away
+    int profile = PROFILE_BALANCED;
+    // Largest IDAT chunk written to the output image
+    size_t IDATSize = 65536;
+    // Low bits of each sample the message is written to, 1 to 4. More bits
+    // hold longer messages but change the image more visibly.
+    int bitsPerSample = 1;
+    // In AES mode, runs the key image's pipeline on another thread while the
+    // payload's runs on the caller's
+    bool concurrentAES = true;
+    // Overlaps inflating, embedding and deflating a large image on three
+    // threads. Callers already encoding several images at once turn it off.
+    bool pipelineStages = true;
+    // Filled in with time and bytes per stage when set. Each call needs its
+    // own, as nothing guards it against concurrent calls.
+    StegoStats *stats = NULL;
+    // Told as each image's data is read when set, and shared by every
+    // pipeline of the call
+    StegoProgress *progress = NULL;
+} StegoOptions;
+
+void encodePlaintext(char *inputFile, unsigned char *message, int msgLen, char *outputFile, const StegoOptions& options = StegoOptions());
+std::string decodePlaintext(char *inputFile, const StegoOptions& options = StegoOptions());
+void encodeAES(char *inputFile, unsigned char *message, int msgLen, char *outputFile, char *inputKeyFile, char *outputKeyFile, const StegoOptions& options = StegoOptions());
+std::string decodeAES(char *inputFile, char *inputKeyFile, const StegoOptions& options = StegoOptions());
+
+// The same operations on PNGs held in memory, returning the encoded images
+std::vector<uint8_t> encodePlaintextBuffer(const uint8_t *png, size_t pngLen, const unsigned char *message, int msgLen, const StegoOptions& options = StegoOptions());
+std::string decodePlaintextBuffer(const uint8_t *png, size_t pngLen, const StegoOptions& options = StegoOptions());
+void encodeAESBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen, const unsigned char *message, int msgLen,
+                     std::vector<uint8_t> *output, std::vector<uint8_t> *keyOutput, const StegoOptions& options = StegoOptions());
+std::string decodeAESBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen,
+                            const StegoOptions& options = StegoOptions());
+
+// AES with the key derived from the key image's pixels rather than hidden in
+// a copy of it. The key image is only read, and only the payload image is
+// written, holding a salt and IV ahead of the ciphertext.
+void encodeAESDerived(char *inputFile, unsigned char *message, int msgLen, char *outputFile, char *keyFile, const StegoOptions& options = StegoOptions());
+std::string decodeAESDerived(char *inputFile, char *keyFile, const StegoOptions& options = StegoOptions());
+std::vector<uint8_t> encodeAESDerivedBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen, const unsigned char *message,
+                                            int msgLen, const StegoOptions& options = StegoOptions());
+std::string decodeAESDerivedBuffer(const uint8_t *png, size_t pngLen, const uint8_t *keyPng, size_t keyPngLen,
+                                   const StegoOptions& options = StegoOptions());
+
+// Longest message an image can hold at the given bits per sample, worked out
+// from its IHDR alone
+size_t messageCapacity(const char *path, int bitsPerSample = 1);
+size_t messageCapacity(const uint8_t *png, size_t pngLen, int bitsPerSample = 1);
+
+// A message too long for one carrier, split across several with a shard per
+// output. Each shard holds its index, the shard count and the whole
+// message's length and SHA-256, so decodeShards takes the images in any
+// order. Shards are encoded and decoded side by side.
+size_t shardCapacity(const std::vector<std::string>& inputFiles, int bitsPerSample = 1);
+void encodeShards(const std::vector<std::string>& inputFiles, const unsigned char *message, size_t msgLen, const std::vector<std::string>& outputFiles,
+                  const StegoOptions& options = StegoOptions());
+std::string decodeShards(const std::vector<std::string>& inputFiles, const StegoOptions& options = StegoOptions());
+
+// What the header at the start of an image's data says. Only tagged headers
+// are found: an image from before the tag may hold a message, but its one
+// byte length cannot be told apart from any other image's pixels.
+typedef struct MessageHeader {
+    bool found;
+    int version;
+    int bitsPerSample;
+    size_t length;
+} MessageHeader;
+
+// Inflates only the rows the header spans, or with message given, the rows
+// the message spans too, filling it in if a header is found
+MessageHeader probeMessage(const char *path, std::vector<uint8_t> *message = NULL, const StegoOptions& options = StegoOptions());
+
+class MappedPNG;
+class PNGWriter;
+
+// A carrier inflated and unfiltered once, so any number of messages can be
+// embedded in it without reading or inflating it again. Only the rows a
+// message touches are refiltered, and the rest go to deflate as they were
+// stored. encode and decode can be called from several threads at once.
+class StegoImage {
+public:
+    explicit StegoImage(const char *path);
+    StegoImage(const uint8_t *png, size_t pngLen);
+
+    size_t capacity(int bitsPerSample = 1) const;
+    std::vector<uint8_t> encode(const unsigned char *message, int msgLen, const StegoOptions& options = StegoOptions()) const;
+    void encodeToFile(const unsigned char *message, int msgLen, const char *outputFile, const StegoOptions& options = StegoOptions()) const;
+    std::string decode() const;
+
+private:
+    void load(const MappedPNG& png);
+    void encodeTo(PNGWriter *writer, const unsigned char *message, int msgLen, const StegoOptions& options) const;
+
+    // Everything before the image data, and everything after it
+    std::vector<uint8_t> leadingChunks;
+    std::vector<uint8_t> trailingChunks;
+    // Scanlines as stored, filter bytes included, and the same rows unfiltered
+    std::vector<uint8_t> filtered;
+    std::vector<uint8_t> unfiltered;
+    uint32_t height;
+    size_t scanlineLen;
+    int bytesPerPixel;
+};
 
 const int ENCODE = 0;
 const int DECODE = 1;
 
 const int PLAINTEXT_MODE = 0;
 const int AES_MODE = 1;
+const int AES_DERIVED_MODE = 2;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+#include "stego.h"
+#include "stegoapi.h"
+
+static thread_local std::string lastError;
+
+int runGuarded(const std::function<void()>& call);
+int failWith(int code, const std::string& message);
+bool copyOut(const void *data, size_t len, uint8_t **output, size_t *outputLen);
+void applyOptions(const stego_options *options, StegoOptions *stegoOptions, StegoProgress *progress);
+bool validImage(const uint8_t *png, size_t pngLen);
+
+void stego_default_options(stego_options *options) {
+    if (options == NULL) {
+        return;
+    }
+    StegoOptions defaults;
+    options->threads = defaults.threads;
+    options->profile = defaults.profile;
+    options->bits_per_sample = defaults.bitsPerSample;
+    options->progress = NULL;
+    options->progress_user = NULL;
+}
+
+int stego_encode_plaintext(const uint8_t *png, size_t png_len, const uint8_t *message, size_t message_len,
+                           const stego_options *options, uint8_t **output, size_t *output_len) {
+    if (!validImage(png, png_len) || (message == NULL && message_len > 0) || message_len > INT_MAX || output == NULL || output_len == NULL) {
+        return failWith(STEGO_INVALID_ARGUMENT, "Invalid argument");
+    }
+
+    return runGuarded([&]() {
+        StegoOptions stegoOptions;
+        StegoProgress progress;
+        applyOptions(options, &stegoOptions, &progress);
+        std::vector<uint8_t> encoded = encodePlaintextBuffer(png, png_len, message, message_len, stegoOptions);
+        if (!copyOut(encoded.data(), encoded.size(), output, output_len)) {
+            throw std::bad_alloc();
+        }
+    });
+}
+
+int stego_decode_plaintext(const uint8_t *png, size_t png_len, const stego_options *options, uint8_t **message, size_t *message_len) {
+    if (!validImage(png, png_len) || message == NULL || message_len == NULL) {
+        return failWith(STEGO_INVALID_ARGUMENT, "Invalid argument");
+    }
+
+    return runGuarded([&]() {
+        StegoOptions stegoOptions;
+        StegoProgress progress;
+        applyOptions(options, &stegoOptions, &progress);
+        std::string decoded = decodePlaintextBuffer(png, png_len, stegoOptions);
+        if (!copyOut(decoded.data(), decoded.size(), message, message_len)) {
+            throw std::bad_alloc();
+        }
+    });
+}
+
+int stego_encode_aes(const uint8_t *png, size_t png_len, const uint8_t *key_png, size_t key_png_len, const uint8_t *message,
+                     size_t message_len, const stego_options *options, uint8_t **output, size_t *output_len, uint8_t **key_output,
+                     size_t *key_output_len) {
+    if (!validImage(png, png_len) || !validImage(key_png, key_png_len) || (message == NULL && message_len > 0) || message_len > INT_MAX ||
+        output == NULL || output_len == NULL || key_output == NULL || key_output_len == NULL) {
+        return failWith(STEGO_INVALID_ARGUMENT, "Invalid argument");
+    }
+
+    return runGuarded([&]() {
+        StegoOptions stegoOptions;
+        StegoProgress progress;
+        applyOptions(options, &stegoOptions, &progress);
+        std::vector<uint8_t> encoded;
+        std::vector<uint8_t> keyEncoded;
+        encodeAESBuffer(png, png_len, key_png, key_png_len, message, message_len, &encoded, &keyEncoded, stegoOptions);
+
+        if (!copyOut(encoded.data(), encoded.size(), output, output_len)) {
+            throw std::bad_alloc();
+        }
+        if (!copyOut(keyEncoded.data(), keyEncoded.size(), key_output, key_output_len)) {
+            stego_free(*output);
+            *output = NULL;
+            *output_len = 0;
+            throw std::bad_alloc();
+        }
+    });
+}
+
+int stego_decode_aes(const uint8_t *png, size_t png_len, const uint8_t *key_png, size_t key_png_len, const stego_options *options,
+                     uint8_t **message, size_t *message_len) {
+    if (!validImage(png, png_len) || !validImage(key_png, key_png_len) || message == NULL || message_len == NULL) {
+        return failWith(STEGO_INVALID_ARGUMENT, "Invalid argument");
+    }
+
+    return runGuarded([&]() {
+        StegoOptions stegoOptions;
+        StegoProgress progress;
+        applyOptions(options, &stegoOptions, &progress);
+        std::string decoded = decodeAESBuffer(png, png_len, key_png, key_png_len, stegoOptions);
+        if (!copyOut(decoded.data(), decoded.size(), message, message_len)) {
+            throw std::bad_alloc();
+        }
+    });
+}
+
+void stego_free(void *buffer) {
+    free(buffer);
+}
+
+const char *stego_last_error(void) {
+    return lastError.c_str();
+}
+
+// No exception may cross the C boundary, so each one becomes an error code
+// with its message kept for stego_last_error
+int runGuarded(const std::function<void()>& call) {
+    try {
+        call();
+    } catch (const StegoError& e) {
+        return failWith(STEGO_ERROR, e.what());
+    } catch (const std::bad_alloc&) {
+        return failWith(STEGO_OUT_OF_MEMORY, "Out of memory");
+    } catch (const std::exception& e) {
+        return failWith(STEGO_INTERNAL_ERROR, e.what());
+    } catch (...) {
+        return failWith(STEGO_INTERNAL_ERROR, "Unknown error");
+    }
+    lastError.clear();
+    return STEGO_OK;
+}
+
+int failWith(int code, const std::string& message) {
+    lastError = message;
+    return code;
+}
+
+// malloc'd rather than new'd so C callers and stego_free agree on how to free
+// it, with a byte to spare so an empty message is not a NULL pointer
+bool copyOut(const void *data, size_t len, uint8_t **output, size_t *outputLen) {
+    uint8_t *buffer = (uint8_t *) malloc(len + 1);
+    if (buffer == NULL) {
+        return false;
+    }
+    if (len > 0) {
+        memcpy(buffer, data, len);
+    }
+    *output = buffer;
+    *outputLen = len;
+    return true;
+}
+
+void applyOptions(const stego_options *options, StegoOptions *stegoOptions, StegoProgress *progress) {
+    if (options == NULL) {
+        return;
+    }
+    stegoOptions->threads = options->threads;
+    stegoOptions->profile = options->profile;
+    stegoOptions->bitsPerSample = options->bits_per_sample;
+    if (options->progress != NULL) {
+        progress->callback = options->progress;
+        progress->user = options->progress_user;
+        stegoOptions->progress = progress;
+    }
+}
+
+bool validImage(const uint8_t *png, size_t pngLen) {
+    return png != NULL && pngLen > 0;
+}
@@ -0,0 +1,70 @@
+#include <stddef.h>
+#include <stdint.h>
+#ifndef STEGOAPI_H
+#define STEGOAPI_H
+
+// C interface to libstegopng over PNGs and messages held in memory, for
+// bindings such as stegopng.py. Every call is safe to make from any thread.
+
+#define STEGO_API __attribute__((visibility("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returned by every call. Anything but STEGO_OK leaves a message for
+// stego_last_error on the calling thread.
+enum {
+    STEGO_OK = 0,
+    // The image could not be encoded or decoded, such as a corrupt PNG, a
+    // message too long for it or a wrong key image
+    STEGO_ERROR = 1,
+    // A NULL pointer or a length out of range
+    STEGO_INVALID_ARGUMENT = 2,
+    STEGO_OUT_OF_MEMORY = 3,
+    STEGO_INTERNAL_ERROR = 4
+};
+
+// Called as the images' data is read, with the bytes read so far and the
+// total known so far. May be called from worker threads, and from more than
+// one at once in AES mode.
+typedef void (*stego_progress_fn)(uint64_t done, uint64_t total, void *user);
+
+typedef struct stego_options {
+    // Threads compressing the output image data, 0 for one per core
+    int threads;
+    // One of the PROFILE_ values in stego.h
+    int profile;
+    // Low bits of each sample the message is written to, 1 to 4
+    int bits_per_sample;
+    // Optional, NULL for no progress reports
+    stego_progress_fn progress;
+    void *progress_user;
+} stego_options;
+
+// Fills in the defaults the command line uses. Passing NULL options to any
+// call does the same.
+STEGO_API void stego_default_options(stego_options *options);
+
+// Encoded images and decoded messages are allocated by the library and
+// handed to the caller, who frees them with stego_free. Outputs are only set
+// on STEGO_OK.
+STEGO_API int stego_encode_plaintext(const uint8_t *png, size_t png_len, const uint8_t *message, size_t message_len,
+                                     const stego_options *options, uint8_t **output, size_t *output_len);
+STEGO_API int stego_decode_plaintext(const uint8_t *png, size_t png_len, const stego_options *options, uint8_t **message, size_t *message_len);
+STEGO_API int stego_encode_aes(const uint8_t *png, size_t png_len, const uint8_t *key_png, size_t key_png_len, const uint8_t *message,
+                               size_t message_len, const stego_options *options, uint8_t **output, size_t *output_len, uint8_t **key_output,
+                               size_t *key_output_len);
+STEGO_API int stego_decode_aes(const uint8_t *png, size_t png_len, const uint8_t *key_png, size_t key_png_len, const stego_options *options,
+                               uint8_t **message, size_t *message_len);
+
+STEGO_API void stego_free(void *buffer);
+
+// Message for the last failed call on this thread, empty if none has failed
+STEGO_API const char *stego_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,13 @@
+#include <stdexcept>
+#include <string>
+#ifndef STEGOERROR_H
+#define STEGOERROR_H
+
+// Thrown for bad input images and failed encodes or decodes, so callers
+// handling many images can report a failure and carry on
+class StegoError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+#endif
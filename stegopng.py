@@ -0,0 +1,137 @@
+import ctypes
+import os
+
+# ctypes binding to libstegopng, the C interface declared in stegoapi.h. Every
+# call works on bytes in memory and raises StegoError on failure.
+
+STEGO_OK = 0
+STEGO_ERROR = 1
+STEGO_INVALID_ARGUMENT = 2
+STEGO_OUT_OF_MEMORY = 3
+STEGO_INTERNAL_ERROR = 4
+
+PROFILE_FAST = 0
+PROFILE_BALANCED = 1
+PROFILE_SMALL = 2
+PROFILE_STORED = 3
+
+LIBRARY_NAME = "libstegopng.so"
+
+# Where the library is looked for after STEGOPNG_LIBRARY, relative to this file
+SEARCH_DIRS = [".", "build", "_build", "cmake-build-release"]
+
+PROGRESS_FN = ctypes.CFUNCTYPE(None, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_void_p)
+
+class StegoOptions(ctypes.Structure):
+    _fields_ = [
+        ("threads", ctypes.c_int),
+        ("profile", ctypes.c_int),
+        ("bits_per_sample", ctypes.c_int),
+        ("progress", PROGRESS_FN),
+        ("progress_user", ctypes.c_void_p),
+    ]
+
+class StegoError(Exception):
+    def __init__(self, code, message):
+        super().__init__(message)
+        self.code = code
+
+def find_library():
+    path = os.environ.get("STEGOPNG_LIBRARY")
+    if path:
+        return path
+    here = os.path.dirname(os.path.abspath(__file__))
+    for directory in SEARCH_DIRS:
+        candidate = os.path.join(here, directory, LIBRARY_NAME)
+        if os.path.exists(candidate):
+            return candidate
+    # Leave it to the dynamic loader's own search path
+    return LIBRARY_NAME
+
+def load_library(path=None):
+    lib = ctypes.CDLL(path or find_library())
+
+    buffer_out = ctypes.POINTER(ctypes.POINTER(ctypes.c_uint8))
+    size_out = ctypes.POINTER(ctypes.c_size_t)
+    options = ctypes.POINTER(StegoOptions)
+
+    lib.stego_default_options.argtypes = [options]
+    lib.stego_default_options.restype = None
+    lib.stego_encode_plaintext.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t, options, buffer_out, size_out]
+    lib.stego_encode_plaintext.restype = ctypes.c_int
+    lib.stego_decode_plaintext.argtypes = [ctypes.c_char_p, ctypes.c_size_t, options, buffer_out, size_out]
+    lib.stego_decode_plaintext.restype = ctypes.c_int
+    lib.stego_encode_aes.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t,
+                                     options, buffer_out, size_out, buffer_out, size_out]
+    lib.stego_encode_aes.restype = ctypes.c_int
+    lib.stego_decode_aes.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t, options, buffer_out, size_out]
+    lib.stego_decode_aes.restype = ctypes.c_int
+    lib.stego_free.argtypes = [ctypes.c_void_p]
+    lib.stego_free.restype = None
+    lib.stego_last_error.argtypes = []
+    lib.stego_last_error.restype = ctypes.c_char_p
+    return lib
+
+class Stego:
+    def __init__(self, path=None):
+        self.lib = load_library(path)
+
+    def make_options(self, progress, threads, profile, bits_per_sample):
+        options = StegoOptions()
+        self.lib.stego_default_options(ctypes.byref(options))
+        if threads is not None:
+            options.threads = threads
+        if profile is not None:
+            options.profile = profile
+        if bits_per_sample is not None:
+            options.bits_per_sample = bits_per_sample
+        # Kept on the options so it is not collected while the call runs
+        callback = PROGRESS_FN(lambda done, total, user: progress(done, total)) if progress else PROGRESS_FN()
+        options.progress = callback
+        return options, callback
+
+    def check(self, code):
+        if code != STEGO_OK:
+            raise StegoError(code, self.lib.stego_last_error().decode("utf-8", errors="replace"))
+
+    def take(self, buffer, length):
+        try:
+            return ctypes.string_at(buffer, length.value)
+        finally:
+            self.lib.stego_free(buffer)
+
+    # progress, when given, is called as progress(done, total) from whichever
+    # thread is reading an image, never the caller's event loop
+    def encode_plaintext(self, png, message, progress=None, threads=None, profile=None, bits_per_sample=None):
+        options, callback = self.make_options(progress, threads, profile, bits_per_sample)
+        output = ctypes.POINTER(ctypes.c_uint8)()
+        output_len = ctypes.c_size_t()
+        self.check(self.lib.stego_encode_plaintext(png, len(png), message, len(message), ctypes.byref(options),
+                                                   ctypes.byref(output), ctypes.byref(output_len)))
+        return self.take(output, output_len)
+
+    def decode_plaintext(self, png, progress=None, threads=None):
+        options, callback = self.make_options(progress, threads, None, None)
+        message = ctypes.POINTER(ctypes.c_uint8)()
+        message_len = ctypes.c_size_t()
+        self.check(self.lib.stego_decode_plaintext(png, len(png), ctypes.byref(options), ctypes.byref(message), ctypes.byref(message_len)))
+        return self.take(message, message_len)
+
+    # Returns the encoded image and the encoded key image
+    def encode_aes(self, png, key_png, message, progress=None, threads=None, profile=None, bits_per_sample=None):
+        options, callback = self.make_options(progress, threads, profile, bits_per_sample)
+        output = ctypes.POINTER(ctypes.c_uint8)()
+        output_len = ctypes.c_size_t()
+        key_output = ctypes.POINTER(ctypes.c_uint8)()
+        key_output_len = ctypes.c_size_t()
+        self.check(self.lib.stego_encode_aes(png, len(png), key_png, len(key_png), message, len(message), ctypes.byref(options),
+                                             ctypes.byref(output), ctypes.byref(output_len), ctypes.byref(key_output), ctypes.byref(key_output_len)))
+        return self.take(output, output_len), self.take(key_output, key_output_len)
+
+    def decode_aes(self, png, key_png, progress=None, threads=None):
+        options, callback = self.make_options(progress, threads, None, None)
+        message = ctypes.POINTER(ctypes.c_uint8)()
+        message_len = ctypes.c_size_t()
+        self.check(self.lib.stego_decode_aes(png, len(png), key_png, len(key_png), ctypes.byref(options),
+                                             ctypes.byref(message), ctypes.byref(message_len)))
+        return self.take(message, message_len)
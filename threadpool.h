@@ -0,0 +1,53 @@
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Fixed set of worker threads running queued tasks in submission order
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned numThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& task) {
+        using Result = std::invoke_result_t<F>;
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+        std::future<Result> result = packaged->get_future();
+        enqueue([packaged]() { (*packaged)(); });
+        return result;
+    }
+
+    unsigned size() const;
+
+    // Process-wide pool with one worker per hardware thread, shared by the
+    // parallel encode stages. Tasks run on it must not wait on other tasks.
+    static ThreadPool& shared();
+
+    // Process-wide pool for whole-image pipelines run alongside the
+    // caller's own, such as the key image in AES mode. Its tasks may wait on
+    // the shared pool but not on this one.
+    static ThreadPool& pipelines();
+
+private:
+    void enqueue(std::function<void()> task);
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping;
+};
+
+#endif